@@ -0,0 +1,62 @@
+//
+// concurrencyController.cpp
+//
+#include "concurrencyController.h"
+#include <algorithm>    // std::min, std::max
+
+ConcurrencyController::ConcurrencyController(int minThreads, int maxThreads, int threads)
+{
+    mMinThreads = std::max(minThreads, 1);
+    mMaxThreads = std::max(maxThreads, mMinThreads);
+    mThreads = std::min(std::max(threads, mMinThreads), mMaxThreads);
+}
+
+int ConcurrencyController::Update(double bytesPerSec, double filesPerSec, double latencyMs)
+{
+    double score = bytesPerSec + filesPerSec * fileCost;
+
+    if(score == 0)
+    {
+        // Nothing was done in the last interval (i.e. stuck on a large file
+        // or waiting for the directory reader), nothing to learn from it
+        return mThreads;
+    }
+
+    if(mLastScore < 0)
+    {
+        // First measurement, start climbing
+    }
+    else if(score > mLastScore * (1 + tolerance))
+    {
+        // Better, keep going in the same direction
+    }
+    else if(score < mLastScore * (1 - tolerance))
+    {
+        // Worse, go back
+        mDirection = -mDirection;
+    }
+    else
+    {
+        // About the same throughput. If latency went up, then we are past the
+        // knee (threads just wait for each other), so use less threads.
+        // Otherwise keep probing in the same direction.
+        if(latencyMs > mLastLatencyMs * (1 + tolerance))
+            mDirection = -1;
+    }
+
+    mLastScore = score;
+    mLastLatencyMs = latencyMs;
+
+    // Step proportionally to the current count to converge faster on large pools
+    int step = std::max(mThreads / 4, 1);
+    int threads = mThreads + mDirection * step;
+    threads = std::min(std::max(threads, mMinThreads), mMaxThreads);
+
+    // Bounce off the bounds
+    if(threads == mThreads)
+        mDirection = -mDirection;
+
+    mThreads = threads;
+    return mThreads;
+}
+
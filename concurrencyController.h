@@ -0,0 +1,44 @@
+//
+// concurrencyController.h
+//
+#ifndef __CONCURRENCY_CONTROLLER_H__
+#define __CONCURRENCY_CONTROLLER_H__
+
+//
+// Hill-climbing controller for the number of active worker threads.
+// It is fed with throughput and latency measured over the last interval and
+// moves the thread count in the direction that improves throughput. Once
+// adding threads no longer helps (only increases latency), it backs off
+// toward the knee of the throughput curve.
+//
+class ConcurrencyController
+{
+public:
+    ConcurrencyController(int minThreads, int maxThreads, int threads);
+    ~ConcurrencyController() = default;
+
+    // Get the next thread count based on the last interval measurements
+    int Update(double bytesPerSec, double filesPerSec, double latencyMs);
+
+    int GetThreads() { return mThreads; }
+    int GetMinThreads() { return mMinThreads; }
+    int GetMaxThreads() { return mMaxThreads; }
+
+    // Treat every file as that many bytes of work, so metadata bound copies
+    // (lots of small files) are measured fairly
+    static constexpr double fileCost = 64 * 1024;
+
+    // Throughput changes within that ratio are considered the same
+    static constexpr double tolerance = 0.05;
+
+private:
+    int mMinThreads{1};
+    int mMaxThreads{1};
+    int mThreads{1};
+    int mDirection{1};          // +1 to add threads, -1 to remove threads
+    double mLastScore{-1};      // Throughput (bytes/sec) of the last interval
+    double mLastLatencyMs{0};
+};
+
+#endif // __CONCURRENCY_CONTROLLER_H__
+
@@ -0,0 +1,69 @@
+//
+// copyJob.cpp
+//
+#include "copyJob.h"
+
+CopyJob::~CopyJob()
+{
+    // Don't leave the job running on its own
+    if(mThread.joinable())
+    {
+        if(!IsDone())
+            Cancel();
+        mThread.join();
+    }
+}
+
+bool CopyJob::Start(const std::string& srcName, const std::vector<std::string>& destNames, size_t sparseBlockSize /*=0*/)
+{
+    return StartThread([this, srcName, destNames, sparseBlockSize]()
+        { return mDirCopy.Copy(srcName, destNames, sparseBlockSize); });
+}
+
+bool CopyJob::StartWatch(const std::string& srcName, const std::vector<std::string>& destNames,
+                         size_t sparseBlockSize /*=0*/, int coalesceMs /*=500*/)
+{
+    return StartThread([this, srcName, destNames, sparseBlockSize, coalesceMs]()
+        { return mDirCopy.Watch(srcName, destNames, sparseBlockSize, coalesceMs); });
+}
+
+bool CopyJob::StartTar(const std::string& srcName, int tarFd, size_t sparseBlockSize /*=0*/)
+{
+    return StartThread([this, srcName, tarFd, sparseBlockSize]()
+        { return mDirCopy.CopyToTar(srcName, tarFd, sparseBlockSize); });
+}
+
+bool CopyJob::StartRemote(const std::string& srcName, const std::string& address,
+                          int connectionCount /*=4*/, size_t sparseBlockSize /*=0*/)
+{
+    return StartThread([this, srcName, address, connectionCount, sparseBlockSize]()
+        { return mDirCopy.CopyToRemote(srcName, address, connectionCount, sparseBlockSize); });
+}
+
+bool CopyJob::StartThread(std::function<bool()>&& copy)
+{
+    if(mFuture.valid())
+        return false; // Already started
+
+    mFuture = mPromise.get_future().share();
+
+    mThread = std::thread([this](const std::function<bool()>& copy)
+    {
+        Result result;
+        result.success = copy();
+        result.cancelled = mDirCopy.WasCancelled();
+        result.error = mDirCopy.GetError();
+        result.failures = mDirCopy.GetFailures();
+        result.metrics = mDirCopy.GetMetrics();
+        mPromise.set_value(std::move(result));
+
+    }, std::move(copy));
+
+    return true;
+}
+
+bool CopyJob::IsDone()
+{
+    return (mFuture.valid() && mFuture.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+}
+
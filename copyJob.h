@@ -0,0 +1,103 @@
+//
+// copyJob.h
+//
+#ifndef __COPY_JOB_H__
+#define __COPY_JOB_H__
+
+#include "dirCopy.h"
+#include <future>       // std::promise, std::shared_future
+#include <thread>       // std::thread
+#include <memory>       // std::unique_ptr
+#include <functional>   // std::function
+
+//
+// Class CopyJob to run DirCopy in the background. The caller can start
+// several jobs, poll their progress, cancel them and wait for the results.
+//
+class CopyJob
+{
+public:
+    // Copy job result
+    struct Result
+    {
+        bool success{false};
+        bool cancelled{false};
+        std::string error;                      // First (most relevant) error
+        std::vector<DirCopy::Failure> failures; // All files we failed to copy
+        DirCopy::Metrics metrics;
+    };
+
+    CopyJob(int threadCount=4) : mDirCopy(threadCount) {}
+    CopyJob(ThreadPool& sharedPool, int priority=0, int weight=1) { mDirCopy.SetThreadPool(&sharedPool, priority, weight); }
+    ~CopyJob();
+
+    CopyJob(const CopyJob&) = delete;
+    CopyJob& operator=(const CopyJob&) = delete;
+
+    // Use it to configure the copy (schedule, limits, etc.) before Start()
+    DirCopy& GetDirCopy() { return mDirCopy; }
+
+    // Start copying in the background (only once per job)
+    bool Start(const std::string& srcName, const std::string& destName, size_t sparseBlockSize=0)
+    {
+        return Start(srcName, std::vector<std::string> { destName }, sparseBlockSize);
+    }
+    bool Start(const std::string& srcName, const std::vector<std::string>& destNames, size_t sparseBlockSize=0);
+
+    // Start mirroring the source directory in the background (see DirCopy::Watch())
+    bool StartWatch(const std::string& srcName, const std::vector<std::string>& destNames,
+                    size_t sparseBlockSize=0, int coalesceMs=500);
+
+    // Start writing the source as a tar stream to tarFd in the background
+    // Note: tarFd must stay open until the job is done.
+    bool StartTar(const std::string& srcName, int tarFd, size_t sparseBlockSize=0);
+
+    // Start sending the source to the receiver in the background
+    bool StartRemote(const std::string& srcName, const std::string& address,
+                     int connectionCount=4, size_t sparseBlockSize=0);
+
+    // Get the result future to wait for the job completion
+    std::shared_future<Result> GetFuture() { return mFuture; }
+
+    // Non-blocking job status
+    bool IsDone();
+    DirCopy::Stats GetStats() { return mDirCopy.GetStats(); }
+
+    // Cancel the job. Its future is ready once all threads are stopped.
+    void Cancel() { mDirCopy.Cancel(); }
+
+private:
+    bool StartThread(std::function<bool()>&& copy);
+
+    DirCopy mDirCopy;
+    std::thread mThread;
+    std::promise<Result> mPromise;
+    std::shared_future<Result> mFuture;
+};
+
+//
+// Class CopyExecutor to run many copy jobs on the same pool of threads,
+// so the total number of copy threads never goes above maxThreads no
+// matter how many jobs are running. A job of a higher priority (i.e. urgent
+// restore) gets threads before the lower priority jobs (i.e. bulk backup) as
+// soon as they are done with their current files. Jobs of the same priority
+// share threads in proportion to their weights.
+// Note: All the jobs must be destroyed before the executor.
+//
+class CopyExecutor
+{
+public:
+    CopyExecutor(int maxThreads) { mTpool.Create(maxThreads); }
+    ~CopyExecutor() { mTpool.Destroy(); }
+
+    std::unique_ptr<CopyJob> MakeJob(int priority=0, int weight=1)
+    {
+        return std::make_unique<CopyJob>(mTpool, priority, weight);
+    }
+
+private:
+    ThreadPool mTpool;
+};
+
+#endif // __COPY_JOB_H__
+
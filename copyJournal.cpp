@@ -0,0 +1,249 @@
+//
+// copyJournal.cpp
+//
+#include "copyJournal.h"
+#include <unistd.h>     // write(), fdatasync(), syncfs()
+#include <fcntl.h>      // open()
+#include <string.h>     // strerror()
+#include <charconv>     // std::from_chars()
+
+bool CopyJournal::Open(const std::string& fileName, const std::vector<std::string>& destDirs, bool resume, int flushIntervalMs /*=1000*/)
+{
+    Close();
+
+    mFileName = fileName;
+    mFlushIntervalMs = flushIntervalMs;
+    mEntries.clear();
+    mErrMsg.clear();
+
+    mFd = open(fileName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0660);
+    if(mFd < 0)
+    {
+        mErrMsg = "Could not open journal '" + fileName + "' because of: " + strerror(errno);
+        return false;
+    }
+
+    if(resume && !Load())
+    {
+        Close();
+        return false;
+    }
+
+    // Note: Without them, done records could get ahead of the data
+    for(const std::string& dir : destDirs)
+    {
+        int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(fd < 0)
+        {
+            mErrMsg = "Could not open '" + dir + "' to sync the journal because of: " + strerror(errno);
+            Close();
+            return false;
+        }
+        mSyncFds.push_back(fd);
+    }
+
+    mStop = false;
+    mThread = std::thread(&CopyJournal::Run, this);
+    return true;
+}
+
+// Parse " <number>" field of a record, moving ptr past it
+template<typename T>
+static bool ParseField(const char*& ptr, const char* end, T& value)
+{
+    if(ptr >= end || *ptr != ' ')
+        return false;
+
+    auto res = std::from_chars(ptr + 1, end, value);
+    if(res.ec != std::errc())
+        return false;
+
+    ptr = res.ptr;
+    return true;
+}
+
+bool CopyJournal::Load()
+{
+    // Read the entire journal
+    std::string data;
+    char buf[64 * 1024];
+    ssize_t got;
+    while((got = read(mFd, buf, sizeof(buf))) > 0)
+        data.append(buf, got);
+    if(got < 0)
+    {
+        mErrMsg = "Could not read journal '" + mFileName + "' because of: " + strerror(errno);
+        return false;
+    }
+
+    // Parse records until the end (or the first torn record)
+    // Note: Paths can have new lines, so records are walked by path length
+    const char* begin = data.data();
+    const char* end = begin + data.size();
+    const char* ptr = begin;
+    while(ptr < end)
+    {
+        char type = *ptr;
+        const char* next = ptr + 1;
+        long long offset;
+        long long mtimeNs;
+        long long ctimeNs;
+        unsigned long long inode;
+        size_t pathLen;
+        if((type != 'F' && type != 'C') || !ParseField(next, end, offset) || !ParseField(next, end, mtimeNs) ||
+           !ParseField(next, end, ctimeNs) || !ParseField(next, end, inode) || !ParseField(next, end, pathLen) ||
+           next >= end || *next++ != ' ' || (size_t)(end - next) <= pathLen || next[pathLen] != '\n')
+        {
+            break;
+        }
+
+        // Later records override earlier ones
+        Entry& entry = mEntries[std::string(next, pathLen)];
+        entry.done = (type == 'F');
+        entry.offset = offset;
+        entry.mtimeNs = mtimeNs;
+        entry.ctimeNs = ctimeNs;
+        entry.inode = inode;
+
+        ptr = next + pathLen + 1;
+    }
+    size_t pos = ptr - begin;
+
+    // Drop the torn record (if any) so new records follow the last good one
+    if(pos < data.size() && (ftruncate(mFd, pos) != 0 || lseek(mFd, pos, SEEK_SET) < 0))
+    {
+        mErrMsg = "Could not truncate journal '" + mFileName + "' because of: " + strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool CopyJournal::Close()
+{
+    if(mThread.joinable())
+    {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mCv.notify_one();
+        mThread.join();
+    }
+
+    for(int fd : mSyncFds)
+        close(fd);
+    mSyncFds.clear();
+
+    if(mFd >= 0)
+    {
+        close(mFd);
+        mFd = -1;
+    }
+
+    return GetError().empty();
+}
+
+bool CopyJournal::Find(const std::string& path, Entry& entry) const
+{
+    auto it = mEntries.find(path);
+    if(it == mEntries.end())
+        return false;
+
+    entry = it->second;
+    return true;
+}
+
+static int64_t ToNanos(const struct timespec& ts)
+{
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool CopyJournal::Entry::IsSameFile(const struct stat& st) const
+{
+    return (inode == st.st_ino && mtimeNs == ToNanos(st.st_mtim) && ctimeNs == ToNanos(st.st_ctim));
+}
+
+void CopyJournal::Add(char type, const std::string& path, off_t offset, const struct stat& st)
+{
+    std::string record = std::string(1, type) + " " + std::to_string(offset) + " " +
+                         std::to_string(ToNanos(st.st_mtim)) + " " + std::to_string(ToNanos(st.st_ctim)) + " " +
+                         std::to_string((unsigned long long)st.st_ino) + " " +
+                         std::to_string(path.size()) + " " + path + "\n";
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mRecords += record;
+}
+
+void CopyJournal::Run()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while(true)
+    {
+        mCv.wait_for(lock, std::chrono::milliseconds(mFlushIntervalMs));
+        bool stop = mStop;
+
+        std::string records;
+        records.swap(mRecords);
+        lock.unlock();
+
+        if(!records.empty() && !Flush(records))
+            return; // Journal is no good from now on
+
+        lock.lock();
+        if(stop)
+            break;
+    }
+}
+
+bool CopyJournal::Flush(std::string& records)
+{
+    // Files we are about to call done must be on disk first
+    for(int fd : mSyncFds)
+    {
+        if(syncfs(fd) != 0)
+        {
+            SetError(std::string("Failed to sync destination because of: ") + strerror(errno));
+            return false;
+        }
+    }
+
+    const char* ptr = records.data();
+    size_t rem = records.size();
+    while(rem > 0)
+    {
+        ssize_t wrote = write(mFd, ptr, rem);
+        if(wrote < 0)
+        {
+            if(errno == EINTR || errno == EAGAIN)
+                continue;
+            SetError("Failed to write journal '" + mFileName + "' because of: " + strerror(errno));
+            return false;
+        }
+        ptr += wrote;
+        rem -= wrote;
+    }
+
+    if(fdatasync(mFd) != 0)
+    {
+        SetError("Failed to sync journal '" + mFileName + "' because of: " + strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+std::string CopyJournal::GetError()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mErrMsg;
+}
+
+void CopyJournal::SetError(const std::string& err)
+{
+    // Note: we only set the first error as most relevant
+    std::unique_lock<std::mutex> lock(mMutex);
+    if(mErrMsg.empty())
+        mErrMsg = err;
+}
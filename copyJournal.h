@@ -0,0 +1,91 @@
+//
+// copyJournal.h
+//
+#ifndef __COPY_JOURNAL_H__
+#define __COPY_JOURNAL_H__
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <sys/types.h>  // off_t, ino_t
+#include <sys/stat.h>   // struct stat
+
+//
+// Class CopyJournal to record copy progress, so a copy that died can be
+// resumed without redoing the work already done. The journal is an append-only
+// file of records:
+//
+//   F <size> <mtime> <ctime> <inode> <path length> <path>\n      File is copied (with its size)
+//   C <offset> <mtime> <ctime> <inode> <path length> <path>\n    File is copied up to offset (checkpoint)
+//
+// The source file modification and change times (in nanoseconds) and inode
+// tell whether a record is still good for the file, i.e. it hasn't changed
+// (or been replaced) since.
+// Records are kept in memory and flushed by the background thread every
+// flushIntervalMs. Destination file systems are synced (syncfs) before every
+// flush, so whatever the journal says is done is really on disk.
+// Note: A record torn by a crash (and everything after it) is dropped on resume.
+//
+class CopyJournal
+{
+public:
+    CopyJournal() = default;
+    ~CopyJournal() { Close(); }
+
+    CopyJournal(const CopyJournal&) = delete;
+    CopyJournal& operator=(const CopyJournal&) = delete;
+
+    // Open the journal. If resume, then load it first, otherwise start a new
+    // one. Destination directories (they must exist) are used to sync their
+    // file systems.
+    bool Open(const std::string& fileName, const std::vector<std::string>& destDirs, bool resume, int flushIntervalMs=1000);
+
+    // Flush the rest of the records and close the journal
+    bool Close();
+
+    // What the loaded journal has for the file (source path)
+    struct Entry
+    {
+        bool done{false};       // File is copied
+        off_t offset{0};        // File size (if done) or checkpoint
+        int64_t mtimeNs{0};     // Source file modification time
+        int64_t ctimeNs{0};     // Source file change time
+        ino_t inode{0};         // Source file inode
+
+        // Is the record for this very (unchanged) source file?
+        bool IsSameFile(const struct stat& st) const;
+    };
+    bool Find(const std::string& path, Entry& entry) const;
+
+    // Add records (can be called by any thread). Source file status (st) is
+    // the one from before copying, so any change during the copy shows up.
+    void AddFile(const std::string& path, off_t size, const struct stat& st) { Add('F', path, size, st); }
+    void AddCheckpoint(const std::string& path, off_t offset, const struct stat& st) { Add('C', path, offset, st); }
+
+    std::string GetError();
+
+private:
+    bool Load();
+    void Add(char type, const std::string& path, off_t offset, const struct stat& st);
+    void Run();
+    bool Flush(std::string& records);
+    void SetError(const std::string& err);
+
+    std::string mFileName;
+    int mFd{-1};
+    std::vector<int> mSyncFds;          // Destination directories (for syncfs)
+    int mFlushIntervalMs{1000};
+    std::unordered_map<std::string, Entry> mEntries; // Loaded journal (read only once opened)
+
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::string mRecords;               // Not flushed yet
+    bool mStop{false};
+    std::thread mThread;
+    std::string mErrMsg;
+};
+
+#endif // __COPY_JOURNAL_H__
@@ -0,0 +1,841 @@
+//
+// copyTest.cpp
+//
+// Randomized differential tests of the file copy paths: files with random
+// data, zero and hole patterns are read through every FileReader mode (and
+// copied by DirCopy through every engine and sparse mode), and the result
+// is compared with the source content and allocated blocks. Copies with
+// injected errors check the continue on errors mode and retries, and jobs
+// sharing an executor check priorities. Timing micro-benchmarks of every
+// reader and writer path follow.
+// Build and run with 'make test'.
+//
+#include <string.h>     // memcmp()
+#include <getopt.h>     // getopt_long()
+#include <unistd.h>     // pwrite()
+#include <fcntl.h>      // open()
+#include <sys/stat.h>   // stat()
+#include <dlfcn.h>      // dlsym()
+#include <stdarg.h>     // va_list
+#include <limits.h>     // PATH_MAX
+#include <random>       // std::mt19937_64
+#include <chrono>       // std::chrono
+#include <filesystem>   // std::filesystem
+#include <functional>   // std::function
+#include <thread>       // std::this_thread
+#include <atomic>       // std::atomic
+#include <map>          // std::map
+#include <iostream>     // std::cout
+#include "fileReader.h"
+#include "fileWriter.h"
+#include "fileSplicer.h"
+#include "dirCopy.h"
+#include "copyJob.h"
+
+#define ERRORMSG(msg) std::cout << "[ERROR] " << __func__ << ": " << msg << std::endl;
+#define OUTMSG(msg) std::cout << msg << std::endl;
+
+// Report the failed check (with the seed to reproduce it) and fail the test
+#define CHECK(cond, msg) \
+    if(!(cond)) { ERRORMSG(msg << " (seed " << seed << ")"); return false; }
+
+static std::mt19937_64 rng;
+static uint64_t seed = 0;
+
+static size_t Random(size_t min, size_t max) { return min + rng() % (max - min + 1); }
+
+static void Usage()
+{
+    std::cout << "Usage: copy_test [options]" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -s, --seed=<n>             Random seed (default time based, printed to reproduce a failure)" << std::endl;
+    std::cout << "  -i, --iterations=<n>       Test files sets to generate (default 4)" << std::endl;
+    std::cout << "  -d, --dir=<dir>            Directory to test in (default /tmp)" << std::endl;
+    std::cout << "  -b, --bench-size=<MB>      Benchmark file size (default 64, 0 - no benchmarks)" << std::endl;
+    std::cout << "  -B, --bench-only           Only run benchmarks" << std::endl;
+}
+
+//
+// Test files
+//
+static std::vector<char> ReadAll(const std::string& fileName)
+{
+    std::vector<char> data;
+    int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return data;
+
+    struct stat st;
+    if(fstat(fd, &st) == 0)
+    {
+        data.resize(st.st_size);
+        size_t total = 0;
+        while(total < data.size())
+        {
+            ssize_t got = pread(fd, data.data() + total, data.size() - total, total);
+            if(got <= 0)
+                break;
+            total += got;
+        }
+        data.resize(total);
+    }
+
+    close(fd);
+    return data;
+}
+
+static size_t GetAllocated(const std::string& fileName)
+{
+    struct stat st;
+    return (stat(fileName.c_str(), &st) == 0 ? st.st_blocks * 512 : 0);
+}
+
+// Size around an interesting boundary (block sizes, read chunk size,
+// pread/mmap threshold), or just random
+static size_t RandomSize()
+{
+    static const size_t edges[] = { 0, 1, 512, 1000, 4096, 128 * 1024, 256 * 1024 };
+    switch(Random(0, 3))
+    {
+    case 0:
+    {
+        size_t edge = edges[Random(0, sizeof(edges) / sizeof(edges[0]) - 1)];
+        return (edge > 0 ? edge - 1 + Random(0, 2) : Random(0, 2));
+    }
+    case 1:
+        return Random(0, 64 * 1024);
+    case 2:
+        return Random(0, 512 * 1024);
+    default:
+        return Random(0, 3 * 1024 * 1024);
+    }
+}
+
+// Make a file of random data, zero data (written) and hole segments
+static bool MakeTestFile(const std::string& fileName, size_t size)
+{
+    int fd = open(fileName.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0660);
+    CHECK(fd >= 0, "Failed to make '" << fileName << "': " << strerror(errno));
+
+    std::vector<char> buf;
+    bool res = true;
+    for(size_t offset = 0; offset < size && res; )
+    {
+        // Segments of a few bytes to a few blocks, usually block aligned
+        size_t len = (Random(0, 3) ? Random(1, 16) * 4096 : Random(1, 10000));
+        if(len > size - offset)
+            len = size - offset;
+
+        int type = Random(0, 9);
+        if(type < 5)
+        {
+            buf.resize(len);
+            for(char& c : buf)
+                c = (char)Random(1, 255);
+        }
+        else if(type < 7)
+        {
+            buf.assign(len, 0);
+        }
+        else
+        {
+            buf.clear(); // Hole
+        }
+
+        if(!buf.empty() && pwrite(fd, buf.data(), buf.size(), offset) != (ssize_t)buf.size())
+            res = false;
+        offset += len;
+    }
+
+    if(ftruncate(fd, size) != 0)
+        res = false;
+    close(fd);
+
+    CHECK(res, "Failed to write '" << fileName << "': " << strerror(errno));
+    return true;
+}
+
+//
+// FileReader: read the file (or a range of it) back in every mode and check
+// that data offsets only go forward, no data is returned twice or out of
+// the range, and the data put at its offsets is the file content.
+//
+static bool TestReader(const std::string& fileName, const std::vector<char>& data)
+{
+    static const size_t sparseBlockSizes[] = { 0, 512, 1000, 4096 };
+
+    for(size_t sparseBlockSize : sparseBlockSizes)
+    for(int mode = 0; mode < 2; mode++)
+    for(int ranged = 0; ranged < 2; ranged++)
+    {
+        // Read range
+        off_t beginOffset = 0;
+        off_t endOffset = data.size();
+        if(ranged && !data.empty())
+        {
+            beginOffset = Random(0, data.size());
+            endOffset = Random(beginOffset, data.size());
+        }
+
+        // Read at once (pread) or mapped in small windows
+        FileReader reader;
+        if(mode == 0)
+            reader.SetReadStrategy(data.size() + 1, 0);
+        else
+            reader.SetReadStrategy(0, Random(1, 16) * 4096);
+
+        // Any size, including the one smaller than the sparse block
+        ssize_t maxSize = -1;
+        switch(Random(0, 3))
+        {
+        case 0: maxSize = Random(1, sparseBlockSize + 1); break;
+        case 1: maxSize = Random(1, 64 * 1024); break;
+        case 2: maxSize = 128 * 1024; break;
+        }
+
+        std::string test = "'" + fileName + "' (sparse " + std::to_string(sparseBlockSize) +
+                           (mode == 0 ? ", pread" : ", mmap") + ", range " + std::to_string(beginOffset) +
+                           "-" + std::to_string(endOffset) + ", maxSize " + std::to_string(maxSize) + ")";
+
+        CHECK(reader.OpenFile(fileName, beginOffset, (ranged ? endOffset : -1)), "OpenFile failed for " << test << ": " << reader.GetError());
+        reader.SetSparseBlockSize(sparseBlockSize);
+
+        std::vector<char> image(endOffset - beginOffset, 0);
+        off_t lastEnd = beginOffset;
+        std::string buf;
+        while(reader.HasMore())
+        {
+            size_t readSize = reader.GetReadSize();
+            off_t dataOffset = reader.ReadFile(buf, maxSize);
+            CHECK(reader.IsValid(), "ReadFile failed for " << test << ": " << reader.GetError());
+            CHECK(reader.GetReadSize() > readSize, "ReadFile didn't move on at " << readSize << " for " << test);
+            CHECK(dataOffset >= lastEnd, "Data offset " << dataOffset << " is before the previous data end " << lastEnd << " for " << test);
+            CHECK(dataOffset + (off_t)buf.size() <= endOffset, "Data " << dataOffset << "+" << buf.size() << " is past the read range for " << test);
+            CHECK(maxSize < 0 || buf.size() <= (size_t)maxSize, "Data size " << buf.size() << " is over maxSize for " << test);
+            CHECK(sparseBlockSize == 0 || dataOffset + (off_t)buf.size() <= beginOffset + (off_t)reader.GetReadSize(),
+                  "Data " << dataOffset << "+" << buf.size() << " is past the read size " << reader.GetReadSize() << " for " << test);
+
+            memcpy(image.data() + (dataOffset - beginOffset), buf.data(), buf.size());
+            lastEnd = dataOffset + buf.size();
+        }
+
+        CHECK(reader.GetReadSize() == image.size(), "Read " << reader.GetReadSize() << " of " << image.size() << " bytes for " << test);
+        CHECK(!memcmp(image.data(), data.data() + beginOffset, image.size()), "Data differs for " << test);
+    }
+
+    return true;
+}
+
+//
+// DirCopy: copy the tree through every engine, sparse mode, read strategy,
+// pipelined or not and to one or two destinations, and compare every file
+// content and allocated blocks with the source.
+//
+struct CopyConfig
+{
+    DirCopy::CopyEngine engine{DirCopy::CopyEngine::User};
+    size_t sparseBlockSize{0};
+    bool mmap{false};
+    bool pipeline{false};
+    bool fanOut{false};
+
+    std::string GetName() const
+    {
+        return std::string(engine == DirCopy::CopyEngine::Splice ? "splice" : "user") +
+               ", sparse " + std::to_string(sparseBlockSize) + (mmap ? ", mmap" : ", pread") +
+               (pipeline ? ", pipeline" : "") + (fanOut ? ", 2 destinations" : "");
+    }
+};
+
+static std::vector<CopyConfig> GetCopyConfigs()
+{
+    std::vector<CopyConfig> configs;
+    for(size_t sparseBlockSize : { 0, 512, 4096 })
+    {
+        CopyConfig config;
+        config.sparseBlockSize = sparseBlockSize;
+        for(int mmap = 0; mmap < 2; mmap++)
+        for(int pipeline = 0; pipeline < 2; pipeline++)
+        for(int fanOut = 0; fanOut < 2; fanOut++)
+        {
+            config.mmap = mmap;
+            config.pipeline = pipeline;
+            config.fanOut = fanOut;
+            configs.push_back(config);
+        }
+
+        config = CopyConfig();
+        config.engine = DirCopy::CopyEngine::Splice;
+        config.sparseBlockSize = sparseBlockSize;
+        configs.push_back(config);
+    }
+    return configs;
+}
+
+static bool CheckCopy(const std::string& srcFile, const std::string& destFile, const std::vector<char>& data,
+                      const CopyConfig& config, size_t fsBlockSize)
+{
+    std::string test = "'" + destFile + "' (" + config.GetName() + ")";
+    std::vector<char> copy = ReadAll(destFile);
+    CHECK(copy.size() == data.size(), "File size " << copy.size() << " instead of " << data.size() << " for " << test);
+    CHECK(!memcmp(copy.data(), data.data(), data.size()), "Data differs for " << test);
+
+    // Holes (and zero blocks) are kept when copying by file system blocks
+    // (or spliced), otherwise every block is written.
+    // Note: Extent tree blocks are allocated too, so allow for a few
+    size_t srcAllocated = GetAllocated(srcFile);
+    size_t destAllocated = GetAllocated(destFile);
+    size_t slack = 2 * fsBlockSize;
+    bool sparse = (config.engine == DirCopy::CopyEngine::Splice ||
+                   (config.sparseBlockSize > 0 && fsBlockSize % config.sparseBlockSize == 0));
+    if(sparse)
+    {
+        CHECK(destAllocated <= srcAllocated + slack, "Allocated " << destAllocated << " bytes, but the source only "
+              << srcAllocated << " for " << test);
+    }
+    else if(config.sparseBlockSize == 0)
+    {
+        size_t fullBlocks = data.size() / fsBlockSize * fsBlockSize;
+        CHECK(destAllocated >= fullBlocks, "Allocated " << destAllocated << " bytes of " << data.size() << " for " << test);
+    }
+
+    return true;
+}
+
+static bool TestCopy(const std::string& srcDir, const std::string& testDir,
+                     const std::vector<std::pair<std::string, std::vector<char>>>& files, size_t fsBlockSize)
+{
+    int index = 0;
+    for(const CopyConfig& config : GetCopyConfigs())
+    {
+        std::vector<std::string> destDirs { testDir + "/dest" + std::to_string(index++) };
+        if(config.fanOut)
+            destDirs.push_back(testDir + "/dest" + std::to_string(index++));
+
+        DirCopy dirCopy(Random(1, 4));
+        dirCopy.SetCopyEngine(config.engine);
+        dirCopy.SetReadStrategy(config.mmap ? 0 : FileReader::defaultPreadMaxSize, Random(1, 64) * 4096);
+        if(config.pipeline)
+            dirCopy.SetPipeline(Random(1, 8), Random(0, 256 * 1024));
+
+        bool res = dirCopy.Copy(srcDir, destDirs, config.sparseBlockSize);
+        CHECK(res, "Copy failed (" << config.GetName() << "): " << dirCopy.GetError());
+
+        for(const std::string& destDir : destDirs)
+        {
+            for(const auto& [fileName, data] : files)
+            {
+                if(!CheckCopy(srcDir + "/" + fileName, destDir + "/" + fileName, data, config, fsBlockSize))
+                    return false;
+            }
+
+            std::filesystem::remove_all(destDir);
+        }
+    }
+
+    return true;
+}
+
+static bool RunTests(const std::string& testDir, int iterations)
+{
+    std::string srcDir = testDir + "/src";
+
+    struct stat st;
+    CHECK(stat(testDir.c_str(), &st) == 0, "Failed to stat '" << testDir << "': " << strerror(errno));
+    size_t fsBlockSize = st.st_blksize;
+
+    for(int i = 0; i < iterations; i++)
+    {
+        std::filesystem::remove_all(srcDir);
+        std::filesystem::create_directories(srcDir);
+
+        // A set of random files
+        std::vector<std::pair<std::string, std::vector<char>>> files;
+        int fileCount = Random(8, 24);
+        for(int n = 0; n < fileCount; n++)
+        {
+            std::string fileName = "file" + std::to_string(n);
+            if(!MakeTestFile(srcDir + "/" + fileName, RandomSize()))
+                return false;
+            files.emplace_back(fileName, ReadAll(srcDir + "/" + fileName));
+        }
+
+        for(const auto& [fileName, data] : files)
+        {
+            if(!TestReader(srcDir + "/" + fileName, data))
+                return false;
+        }
+
+        if(!TestCopy(srcDir, testDir, files, fsBlockSize))
+            return false;
+
+        OUTMSG("Iteration " << i + 1 << " of " << iterations << ": " << fileCount << " files OK");
+    }
+
+    std::filesystem::remove_all(srcDir);
+    return true;
+}
+
+//
+// Injected errors: opening (for reading) a file or directory at the given
+// path fails with errNo, count times (-1 - always). It replaces the libc
+// openat() the copy code calls, so it works for root too (permissions don't
+// stop root).
+// Note: Errors are set before the copy starts, only counts change meanwhile.
+//
+struct InjectedError
+{
+    int errNo{0};
+    std::atomic<int> count{0};
+};
+static std::map<std::string, InjectedError> injectedErrors;
+
+extern "C" int openat(int dirFd, const char* name, int flags, ...)
+{
+    using OpenatFunc = int (*)(int, const char*, int, ...);
+    static OpenatFunc realOpenat = (OpenatFunc)dlsym(RTLD_NEXT, "openat");
+
+    mode_t mode = 0;
+    if(flags & (O_CREAT | O_TMPFILE))
+    {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+
+    if(!(flags & (O_WRONLY | O_RDWR)) && !injectedErrors.empty())
+    {
+        // Note: Copy code opens files by names relative to their directories
+        std::string path = name;
+        char dirPath[PATH_MAX];
+        ssize_t len = 0;
+        if(name[0] != '/' && dirFd != AT_FDCWD &&
+           (len = readlink(("/proc/self/fd/" + std::to_string(dirFd)).c_str(), dirPath, sizeof(dirPath))) > 0)
+        {
+            path = std::string(dirPath, len) + "/" + name;
+        }
+
+        auto it = injectedErrors.find(path);
+        if(it != injectedErrors.end() && (it->second.count < 0 || it->second.count-- > 0))
+        {
+            errno = it->second.errNo;
+            return -1;
+        }
+    }
+
+    return realOpenat(dirFd, name, flags, mode);
+}
+
+static void InjectError(const std::string& path, int errNo, int count)
+{
+    injectedErrors[path].errNo = errNo;
+    injectedErrors[path].count = count;
+}
+
+static const DirCopy::Failure* FindFailure(const std::vector<DirCopy::Failure>& failures, const std::string& path)
+{
+    for(const DirCopy::Failure& failure : failures)
+    {
+        if(failure.path == path)
+            return &failure;
+    }
+    return nullptr;
+}
+
+//
+// DirCopy with errors: files and directories that can't be read are
+// reported (and skipped) in continue on errors mode while the rest of the
+// tree is copied, and files failing with a transient error are retried.
+//
+static bool TestFailures(const std::string& testDir)
+{
+    std::string srcDir = testDir + "/src";
+    std::string destDir = testDir + "/dest";
+    std::filesystem::remove_all(srcDir);
+    std::filesystem::remove_all(destDir);
+
+    // Files around the ones that fail
+    std::vector<std::string> fileNames;
+    for(const char* dirName : { "a", "bad_dir", "z" })
+    {
+        std::filesystem::create_directories(srcDir + "/" + dirName);
+        for(int n = Random(1, 4); n > 0; n--)
+            fileNames.push_back(std::string(dirName) + "/file" + std::to_string(n));
+    }
+    fileNames.push_back("bad_file");
+    fileNames.push_back("flaky_file");
+    for(const std::string& fileName : fileNames)
+    {
+        if(!MakeTestFile(srcDir + "/" + fileName, Random(0, 256 * 1024)))
+            return false;
+    }
+
+    // Permanent errors are reported (and skipped), the transient error is
+    // retried until the file is copied
+    int flakyCount = Random(1, 3);
+    InjectError(srcDir + "/bad_dir", EACCES, -1);
+    InjectError(srcDir + "/bad_file", EACCES, -1);
+    InjectError(srcDir + "/flaky_file", EIO, flakyCount);
+
+    DirCopy dirCopy(Random(1, 4));
+    dirCopy.SetErrorPolicy(true, 3, 1);
+    bool res = dirCopy.Copy(srcDir, { destDir });
+    CHECK(!res, "Copy with errors succeeded");
+
+    std::vector<DirCopy::Failure> failures = dirCopy.GetFailures();
+    CHECK(failures.size() == 2, "Got " << failures.size() << " failures instead of 2: " << dirCopy.GetError());
+    for(const char* name : { "bad_dir", "bad_file" })
+    {
+        const DirCopy::Failure* failure = FindFailure(failures, srcDir + "/" + name);
+        CHECK(failure, "No failure for '" << name << "'");
+        CHECK(failure->errNo == EACCES, "Failure of '" << name << "' has errno " << failure->errNo);
+        CHECK(failure->attempts == 1, "Failure of '" << name << "' has " << failure->attempts << " attempts");
+    }
+    CHECK(dirCopy.GetMetrics().retries == (size_t)flakyCount,
+          "Got " << dirCopy.GetMetrics().retries << " retries instead of " << flakyCount);
+
+    for(const std::string& fileName : fileNames)
+    {
+        bool copied = std::filesystem::exists(destDir + "/" + fileName);
+        if(fileName == "bad_file" || fileName.compare(0, 8, "bad_dir/") == 0)
+        {
+            // Note: The failed file must not be left partly written
+            CHECK(!copied, "'" << fileName << "' was copied");
+            continue;
+        }
+
+        CHECK(copied, "'" << fileName << "' was not copied");
+        CHECK(ReadAll(srcDir + "/" + fileName) == ReadAll(destDir + "/" + fileName), "'" << fileName << "' copy differs");
+    }
+    std::filesystem::remove_all(destDir);
+    injectedErrors.clear();
+
+    // The transient error outlasting the retries is reported with them
+    int retryCount = Random(0, 2);
+    InjectError(srcDir + "/flaky_file", EIO, -1);
+
+    DirCopy retryCopy(Random(1, 4));
+    retryCopy.SetErrorPolicy(true, retryCount, 1);
+    res = retryCopy.Copy(srcDir, { destDir });
+    injectedErrors.clear();
+
+    failures = retryCopy.GetFailures();
+    CHECK(!res && failures.size() == 1, "Got " << failures.size() << " failures instead of 1: " << retryCopy.GetError());
+    CHECK(failures[0].path == srcDir + "/flaky_file", "Failure of '" << failures[0].path << "' instead of 'flaky_file'");
+    CHECK(failures[0].errNo == EIO, "Failure has errno " << failures[0].errNo);
+    CHECK(failures[0].attempts == retryCount + 1,
+          "Failure has " << failures[0].attempts << " attempts instead of " << retryCount + 1);
+    CHECK(retryCopy.GetMetrics().retries == (size_t)retryCount,
+          "Got " << retryCopy.GetMetrics().retries << " retries instead of " << retryCount);
+
+    std::filesystem::remove_all(srcDir);
+    std::filesystem::remove_all(destDir);
+    OUTMSG("Failures: " << fileNames.size() << " files OK");
+    return true;
+}
+
+//
+// CopyExecutor with jobs of different priorities: the urgent job started
+// after the bulk one is done long before the bulk job is (it gets threads
+// as soon as they are done with their current bulk files).
+//
+static bool TestPriority(const std::string& testDir)
+{
+    std::string bulkDir = testDir + "/bulk";
+    std::string urgentDir = testDir + "/urgent";
+    std::string destDir = testDir + "/dest";
+
+    // Note: The bulk job is rate limited, so it takes seconds whatever the disk
+    // (the first second worth of files is the rate limit burst)
+    static constexpr size_t bulkFiles = 400;
+    static constexpr double bulkFilesPerSec = 100;
+    size_t urgentFiles = Random(4, 16);
+    std::filesystem::create_directories(bulkDir);
+    std::filesystem::create_directories(urgentDir);
+    for(size_t i = 0; i < bulkFiles; i++)
+    {
+        if(!MakeTestFile(bulkDir + "/file" + std::to_string(i), Random(0, 16 * 1024)))
+            return false;
+    }
+    for(size_t i = 0; i < urgentFiles; i++)
+    {
+        if(!MakeTestFile(urgentDir + "/file" + std::to_string(i), Random(0, 256 * 1024)))
+            return false;
+    }
+
+    CopyExecutor executor(2);
+    std::unique_ptr<CopyJob> bulkJob = executor.MakeJob(0);
+    bulkJob->GetDirCopy().SetRateLimits(0, bulkFilesPerSec);
+    CHECK(bulkJob->Start(bulkDir, destDir + "/bulk"), "Bulk job failed to start");
+
+    // Let the bulk job take the threads first
+    auto start = std::chrono::steady_clock::now();
+    while(bulkJob->GetStats().files == 0 && !bulkJob->IsDone() &&
+          std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::unique_ptr<CopyJob> urgentJob = executor.MakeJob(1);
+    CHECK(urgentJob->Start(urgentDir, destDir + "/urgent"), "Urgent job failed to start");
+    CopyJob::Result urgentRes = urgentJob->GetFuture().get();
+    CHECK(urgentRes.success, "Urgent job failed: " << urgentRes.error);
+
+    size_t bulkDone = bulkJob->GetStats().files;
+    CHECK(bulkDone < bulkFiles / 2,
+          "Urgent job waited for the bulk one (" << bulkDone << " of " << bulkFiles << " bulk files copied)");
+
+    CopyJob::Result bulkRes = bulkJob->GetFuture().get();
+    CHECK(bulkRes.success && bulkRes.metrics.files == bulkFiles,
+          "Bulk job copied " << bulkRes.metrics.files << " of " << bulkFiles << " files: " << bulkRes.error);
+    for(size_t i = 0; i < urgentFiles; i++)
+    {
+        std::string fileName = "/file" + std::to_string(i);
+        CHECK(ReadAll(urgentDir + fileName) == ReadAll(destDir + "/urgent" + fileName), "Urgent '" << fileName << "' copy differs");
+    }
+
+    // Note: Jobs must be gone before their executor
+    bulkJob.reset();
+    urgentJob.reset();
+    std::filesystem::remove_all(bulkDir);
+    std::filesystem::remove_all(urgentDir);
+    std::filesystem::remove_all(destDir);
+    OUTMSG("Priority: " << urgentFiles << " urgent files done with " << bulkDone << " of " << bulkFiles << " bulk files");
+    return true;
+}
+
+//
+// Micro-benchmarks: best of a few runs (from the page cache)
+//
+static void Bench(const std::string& name, size_t bytes, const std::function<bool()>& run)
+{
+    static constexpr int runs = 3;
+    double best = 0;
+    for(int i = 0; i < runs; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if(!run())
+        {
+            OUTMSG(name << ": FAILED");
+            return;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if(i == 0 || seconds < best)
+            best = seconds;
+    }
+
+    printf("%-44s %10.3f ms %10.1f MB/s\n", name.c_str(), best * 1000, bytes / best / (1024 * 1024));
+}
+
+static bool ReadAllChunks(const std::string& fileName, size_t preadMaxSize, size_t sparseBlockSize)
+{
+    FileReader reader;
+    reader.SetReadStrategy(preadMaxSize, FileReader::defaultMapWindowSize);
+    if(!reader.OpenFile(fileName))
+        return false;
+    reader.SetSparseBlockSize(sparseBlockSize);
+
+    std::string buf;
+    while(reader.HasMore())
+        reader.ReadFile(buf, 128 * 1024);
+    return reader.IsValid();
+}
+
+static void RunBenchmarks(const std::string& testDir, size_t benchSize)
+{
+    std::string denseFile = testDir + "/bench_dense";
+    std::string sparseFile = testDir + "/bench_sparse";
+    std::string destFile = testDir + "/bench_dest";
+
+    // The dense file is all data, the sparse one is every other 64K a hole
+    std::vector<char> chunk(64 * 1024);
+    for(char& c : chunk)
+        c = (char)Random(1, 255);
+
+    int denseFd = open(denseFile.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0660);
+    int sparseFd = open(sparseFile.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0660);
+    bool res = (denseFd >= 0 && sparseFd >= 0);
+    for(size_t offset = 0; offset < benchSize && res; offset += chunk.size())
+    {
+        res = (pwrite(denseFd, chunk.data(), chunk.size(), offset) == (ssize_t)chunk.size());
+        if(res && (offset / chunk.size()) % 2 == 0)
+            res = (pwrite(sparseFd, chunk.data(), chunk.size(), offset) == (ssize_t)chunk.size());
+    }
+    if(res)
+        res = (ftruncate(sparseFd, benchSize) == 0);
+    if(denseFd >= 0)
+        close(denseFd);
+    if(sparseFd >= 0)
+        close(sparseFd);
+
+    if(!res)
+    {
+        ERRORMSG("Failed to make benchmark files: " << strerror(errno));
+        return;
+    }
+
+    OUTMSG("Benchmarks (" << benchSize / (1024 * 1024) << "MB files, 128K chunks):");
+
+    // Reader paths
+    size_t all = benchSize + 1;
+    Bench("FileReader pread", benchSize, [&]() { return ReadAllChunks(denseFile, all, 0); });
+    Bench("FileReader mmap", benchSize, [&]() { return ReadAllChunks(denseFile, 0, 0); });
+    Bench("FileReader pread, sparse 4096", benchSize, [&]() { return ReadAllChunks(denseFile, all, 4096); });
+    Bench("FileReader mmap, sparse 4096", benchSize, [&]() { return ReadAllChunks(denseFile, 0, 4096); });
+    Bench("FileReader mmap, sparse 512", benchSize, [&]() { return ReadAllChunks(denseFile, 0, 512); });
+    Bench("FileReader mmap, sparse 4096 (half holes)", benchSize, [&]() { return ReadAllChunks(sparseFile, 0, 4096); });
+
+    // Small files (pread into the pooled buffer vs. mmap)
+    std::string smallFile = testDir + "/bench_small";
+    int smallFd = open(smallFile.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0660);
+    if(smallFd >= 0)
+    {
+        res = (pwrite(smallFd, chunk.data(), 16 * 1024, 0) == 16 * 1024);
+        close(smallFd);
+        size_t count = 2000;
+        if(res)
+        {
+            Bench("FileReader pread, 16K files", count * 16 * 1024, [&]()
+            {
+                for(size_t i = 0; i < count; i++)
+                    if(!ReadAllChunks(smallFile, FileReader::defaultPreadMaxSize, 0))
+                        return false;
+                return true;
+            });
+            Bench("FileReader mmap, 16K files", count * 16 * 1024, [&]()
+            {
+                for(size_t i = 0; i < count; i++)
+                    if(!ReadAllChunks(smallFile, 0, 0))
+                        return false;
+                return true;
+            });
+        }
+        unlink(smallFile.c_str());
+    }
+
+    // Writer paths
+    std::string buf(chunk.data(), chunk.size());
+    Bench("FileWriter sequential", benchSize, [&]()
+    {
+        FileWriter writer;
+        if(!writer.OpenFile(destFile))
+            return false;
+        for(size_t offset = 0; offset < benchSize && writer.IsValid(); offset += buf.size())
+            writer.WriteFile(buf, offset);
+        return writer.IsValid();
+    });
+    Bench("FileWriter at offsets (half holes)", benchSize, [&]()
+    {
+        FileWriter writer;
+        if(!writer.OpenFile(destFile))
+            return false;
+        for(size_t offset = 0; offset < benchSize && writer.IsValid(); offset += 2 * buf.size())
+            writer.WriteFile(buf, offset);
+        return writer.IsValid() && writer.TruncateFile(benchSize);
+    });
+    Bench("FileReader mmap, sparse 4096 + FileWriter", benchSize, [&]()
+    {
+        FileReader reader;
+        FileWriter writer;
+        reader.SetReadStrategy(0, FileReader::defaultMapWindowSize);
+        if(!reader.OpenFile(denseFile) || !writer.OpenFile(destFile))
+            return false;
+        reader.SetSparseBlockSize(4096);
+
+        std::string data;
+        while(reader.HasMore() && writer.IsValid())
+        {
+            off_t offset = reader.ReadFile(data, 128 * 1024);
+            writer.WriteFile(data, offset);
+        }
+        return reader.IsValid() && writer.IsValid();
+    });
+    Bench("FileSplicer", benchSize, [&]()
+    {
+        FileSplicer splicer;
+        FileWriter writer;
+        if(!splicer.OpenFile(AT_FDCWD, denseFile) || !writer.OpenFile(destFile))
+            return false;
+
+        off_t offset = 0;
+        while(splicer.HasMore())
+        {
+            if(splicer.SpliceFile(writer.GetFd(), FileSplicer::pipeSize, offset) < 0)
+                return false;
+        }
+        return writer.TruncateFile(splicer.GetFileSize());
+    });
+
+    unlink(denseFile.c_str());
+    unlink(sparseFile.c_str());
+    unlink(destFile.c_str());
+}
+
+int main(int argc, char* argv[])
+{
+    seed = std::chrono::steady_clock::now().time_since_epoch().count();
+    int iterations = 4;
+    std::string dir = "/tmp";
+    size_t benchSize = 64;
+    bool benchOnly = false;
+
+    static const struct option longOptions[] =
+    {
+        { "seed",           required_argument, nullptr, 's' },
+        { "iterations",     required_argument, nullptr, 'i' },
+        { "dir",            required_argument, nullptr, 'd' },
+        { "bench-size",     required_argument, nullptr, 'b' },
+        { "bench-only",     no_argument,       nullptr, 'B' },
+        { "help",           no_argument,       nullptr, 'h' },
+        { nullptr,          0,                 nullptr,  0  }
+    };
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "s:i:d:b:Bh", longOptions, nullptr)) != -1)
+    {
+        switch(opt)
+        {
+        case 's':
+            seed = strtoull(optarg, nullptr, 10);
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'b':
+            benchSize = atol(optarg);
+            break;
+        case 'B':
+            benchOnly = true;
+            break;
+        default:
+            Usage();
+            return 1;
+        }
+    }
+
+    rng.seed(seed);
+    std::string testDir = dir + "/copy_test." + std::to_string(getpid());
+    std::error_code err;
+    std::filesystem::create_directories(testDir, err);
+    if(err)
+    {
+        ERRORMSG("Failed to make '" << testDir << "' directory - " << err.message());
+        return 1;
+    }
+
+    OUTMSG("Testing in '" << testDir << "' with seed " << seed);
+    bool res = (benchOnly || (RunTests(testDir, iterations) && TestFailures(testDir) && TestPriority(testDir)));
+    if(res && benchSize > 0)
+        RunBenchmarks(testDir, benchSize * 1024 * 1024);
+
+    // Note: Keep the files of the failed test to look at
+    if(res)
+        std::filesystem::remove_all(testDir, err);
+
+    OUTMSG((res ? "PASSED" : "FAILED"));
+    return (res ? 0 : 1);
+}
@@ -0,0 +1,135 @@
+//
+// cpuAffinity.cpp
+//
+#include "cpuAffinity.h"
+#include <fstream>              // std::ifstream
+#include <filesystem>           // std::filesystem
+#include <pthread.h>            // pthread_setaffinity_np()
+#include <sys/stat.h>           // stat()
+#include <sys/sysmacros.h>      // major(), minor()
+#include <sys/syscall.h>        // SYS_set_mempolicy
+#include <unistd.h>             // syscall()
+#include <linux/mempolicy.h>    // MPOL_PREFERRED
+#include <stdlib.h>             // strtol()
+#include <string.h>             // strerror()
+#include <atomic>               // std::atomic
+#include <iostream>             // std::cerr
+
+bool CpuAffinity::ParseCpuList(const std::string& list, cpu_set_t& cpus)
+{
+    CPU_ZERO(&cpus);
+
+    const char* str = list.c_str();
+    while(*str && *str != '\n')
+    {
+        char* end = nullptr;
+        long first = strtol(str, &end, 10);
+        if(end == str || first < 0)
+            return false;
+
+        long last = first;
+        if(*end == '-')
+        {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if(end == str || last < first)
+                return false;
+        }
+
+        for(long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &cpus);
+
+        str = end;
+        if(*str == ',')
+            str++;
+        else if(*str && *str != '\n')
+            return false;
+    }
+
+    return CPU_COUNT(&cpus) > 0;
+}
+
+// Read the first number from the sysfs file (-1 - no file)
+static int ReadSysNumber(const std::string& path)
+{
+    std::ifstream file(path);
+    int value = -1;
+    if(!(file >> value))
+        return -1;
+    return value;
+}
+
+int CpuAffinity::GetDeviceNode(dev_t dev)
+{
+    // Note: Partitions have no device link, their disk has. NVMe namespaces
+    // link to the controller, and the controller to its PCI device.
+    std::string blockPath = "/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+    for(const char* nodePath : { "/device/numa_node", "/device/device/numa_node",
+                                 "/../device/numa_node", "/../device/device/numa_node" })
+    {
+        int node = ReadSysNumber(blockPath + nodePath);
+        if(node >= 0)
+            return node;
+    }
+
+    return -1;
+}
+
+int CpuAffinity::GetPathNode(const std::string& path)
+{
+    // Note: Destination directories may not be there yet
+    std::filesystem::path dir = std::filesystem::absolute(path);
+    struct stat st;
+    while(stat(dir.c_str(), &st) != 0)
+    {
+        if(!dir.has_relative_path())
+            return -1;
+        dir = dir.parent_path();
+    }
+
+    return GetDeviceNode(st.st_dev);
+}
+
+bool CpuAffinity::GetNodeCpus(int node, cpu_set_t& cpus)
+{
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    return (std::getline(file, list) && ParseCpuList(list, cpus));
+}
+
+// Report the placement failure (only the first one, all the pool threads
+// are likely to fail the same way)
+static void ReportPlacementError(const std::string& err)
+{
+    static std::atomic<bool> reported{false};
+    if(!reported.exchange(true))
+        std::cerr << err << std::endl;
+}
+
+bool CpuAffinity::SetThreadPlacement(const cpu_set_t* cpus, int memNode)
+{
+    bool res = true;
+    int err = (cpus ? pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus) : 0);
+    if(err != 0)
+    {
+        ReportPlacementError(std::string("Failed to set thread CPU affinity because of: ") + strerror(err));
+        res = false;
+    }
+
+    // Prefer the node memory (it falls back to the other nodes if the node
+    // is out of memory)
+    static constexpr int maxNodes = 1024;
+    if(memNode >= 0 && memNode < maxNodes)
+    {
+        unsigned long nodeMask[maxNodes / (8 * sizeof(unsigned long))] {};
+        nodeMask[memNode / (8 * sizeof(unsigned long))] |= 1UL << (memNode % (8 * sizeof(unsigned long)));
+        if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodeMask, maxNodes + 1) != 0)
+        {
+            ReportPlacementError("Failed to set thread memory policy (NUMA node " + std::to_string(memNode) +
+                                 ") because of: " + strerror(errno));
+            res = false;
+        }
+    }
+
+    return res;
+}
@@ -0,0 +1,39 @@
+//
+// cpuAffinity.h
+//
+#ifndef __CPU_AFFINITY_H__
+#define __CPU_AFFINITY_H__
+
+#include <string>
+#include <sched.h>      // cpu_set_t
+#include <sys/types.h>  // dev_t
+
+//
+// Helpers to place threads (and their memory) on CPUs and NUMA nodes.
+// NUMA topology comes from sysfs, so no libnuma is needed.
+//
+class CpuAffinity
+{
+public:
+    // Parse CPU list (i.e. "0-3,8,10-11" as in /sys/devices/system/node/node0/cpulist)
+    static bool ParseCpuList(const std::string& list, cpu_set_t& cpus);
+
+    // NUMA node of the block device the file system is on (-1 - unknown,
+    // i.e. a single node host or a virtual device)
+    static int GetDeviceNode(dev_t dev);
+
+    // NUMA node of the device the path (or its closest existing parent) is on
+    static int GetPathNode(const std::string& path);
+
+    // CPUs of the NUMA node
+    static bool GetNodeCpus(int node, cpu_set_t& cpus);
+
+    // Pin the calling thread to the CPUs (nullptr - any CPU) and allocate
+    // its memory on the NUMA node when possible (-1 - default policy).
+    // Note: Buffers are allocated by the threads that use them, so pinned
+    // threads get node local buffers. The first failure is reported to
+    // stderr, the copy goes on with the default placement.
+    static bool SetThreadPlacement(const cpu_set_t* cpus, int memNode);
+};
+
+#endif // __CPU_AFFINITY_H__
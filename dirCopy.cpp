@@ -2,105 +2,1796 @@
 // dirWriter.cpp
 //
 #include <filesystem>               // std::filesystem
-#include <sys/stat.h>               // stat()
+#include <sys/stat.h>               // stat(), mkdirat()
+#include <sys/resource.h>           // setrlimit()
+#include <fcntl.h>                  // AT_FDCWD
+#include <sys/ioctl.h>              // ioctl()
+#include <sys/mman.h>               // mmap(), mincore()
+#include <sys/syscall.h>            // syscall()
+#include <linux/fs.h>               // FS_IOC_FIEMAP
+#include <linux/fiemap.h>           // struct fiemap
+#include <algorithm>                // std::sort
 #include <string.h>                 // strerror()
 #include <limits.h>                 // PATH_MAX
 #include <libgen.h>                 // basename()
 #include <thread>                   // std::thread
-#include <iostream>                 // std::cout
 #include "fileReader.h"
 #include "fileWriter.h"
+#include "fileSplicer.h"
+#include "concurrencyController.h"
+#include "multiWriter.h"
+#include "dirWatcher.h"
 #include "dirCopy.h"
 
-bool DirCopy::Copy(const std::string& srcName, const std::string& destName, size_t sparseBlockSize /*=0*/)
+bool DirCopy::Copy(const std::string& srcName, const std::vector<std::string>& destNames, size_t sparseBlockSize /*=0*/)
 {
+    if(!BeginCopy(srcName, sparseBlockSize))
+        return false;
+
+    if(destNames.empty())
+    {
+        mErrMsg = "No destination to copy to";
+        return EndCopy(false);
+    }
+
     // Are we copying a file or a directory?
     struct stat st;
     if(stat(srcName.c_str(), &st) < 0)
     {
-        mErrMsg = "stat() failed for srcDir='" + srcName + "': " + strerror(errno);
+        mErrMsg = "stat() failed for srcDir='" + srcName + "': " + strerror(errno);
+        return EndCopy(false);
+    }
+
+//    std::cout << __func__ << ": From : '" << srcName << "'" << std::endl;
+//    std::cout << __func__ << ": To   : '" << destNames[0] << "'" << std::endl;
+//    std::cout << __func__ << ": Sparse Block : " << sparseBlockSize << " bytes" << std::endl;
+
+    StartWriters(destNames);
+
+    bool res = false;
+
+    if((st.st_mode & S_IFMT) == S_IFDIR)
+    {
+        // Make destination directories (if don't exist)
+        for(const std::string& destName : destNames)
+        {
+            std::error_code err;
+            std::filesystem::create_directories(destName, err);
+            if(err)
+            {
+                mErrMsg = "Failed to make '" + destName + "' directory - " + err.message();
+                break;
+            }
+        }
+
+        // Copy directory
+        if(mErrMsg.empty() && OpenJournal(destNames))
+            res = CopyDir(srcName, destNames);
+    }
+    else
+    {
+        char buf[PATH_MAX + 1] {};
+        strcpy(buf, srcName.c_str());
+        std::string srcDirName = dirname(buf);
+        strcpy(buf, srcName.c_str());
+        std::string srcBaseName = basename(buf);
+        strcpy(buf, destNames[0].c_str());
+        std::string destBaseName = basename(buf);
+
+        // Open source and destination file directories
+        DirFdPtr srcDir = OpenDir(AT_FDCWD, srcDirName.c_str(), srcDirName, mErrMsg);
+        std::vector<DirFdPtr> destDirs;
+        std::vector<std::string> fileDirNames;
+
+        for(size_t i = 0; i < destNames.size() && srcDir; i++)
+        {
+            // Make file directory (it doesn't exist)
+            strcpy(buf, destNames[i].c_str());
+            std::string fileDirName = dirname(buf);
+
+            // Note: The same file is written to all the destinations
+            strcpy(buf, destNames[i].c_str());
+            if(destBaseName != basename(buf))
+            {
+                mErrMsg = "Destination file names must be the same ('" + destNames[i] + "')";
+                break;
+            }
+
+            std::error_code err;
+            std::filesystem::create_directories(fileDirName, err);
+            if(err)
+            {
+                mErrMsg = "Failed to make '" + fileDirName + "' directory - " + err.message();
+                break;
+            }
+
+            DirFdPtr destDir = OpenDir(AT_FDCWD, fileDirName.c_str(), fileDirName, mErrMsg);
+            if(!destDir)
+                break;
+            destDirs.emplace_back(std::move(destDir));
+            fileDirNames.emplace_back(std::move(fileDirName));
+        }
+
+        // Copy file
+        if(destDirs.size() == destNames.size() && OpenJournal(fileDirNames))
+            res = CopyFile(srcDir, srcBaseName, destDirs, destBaseName, true /*updateProgress*/);
+    }
+
+    // Publish the rest of the files (before they are recorded in the journal)
+    StopWriters();
+
+    // Note: Files are published and directories metadata is set after
+    // they are copied, and either can fail
+    if(!mErrMsg.empty())
+        res = false;
+
+    if(mJournalOpen)
+    {
+        // Note: Flush the rest of the journal even if we failed
+        mJournalOpen = false;
+        if(!mJournal.Close())
+        {
+            SetError(mJournal.GetError());
+            res = false;
+        }
+    }
+
+    return EndCopy(res);
+}
+
+void DirCopy::StartWriters(const std::vector<std::string>& destNames)
+{
+    mDestName = destNames[0];
+
+    // Files are written under temporary names and published in batches
+    if(mPublishEnabled)
+        mPublisher = std::make_unique<FilePublisher>(mPublishDurability, mPublishBatchSize);
+
+    // Every extra destination is written by its own threads
+    for(size_t i = 1; i < destNames.size(); i++)
+    {
+        mDestPools.emplace_back(std::make_unique<ThreadPool>());
+        PlacePool(*mDestPools.back(), destNames[i]);
+        mDestPools.back()->Create(mThreadCount);
+    }
+
+    // So are large files (the first destination) when pipelined
+    if(mPipelineDepth > 0)
+    {
+        mWritePool = std::make_unique<ThreadPool>();
+        PlacePool(*mWritePool, destNames[0]);
+        mWritePool->Create(mThreadCount);
+    }
+}
+
+void DirCopy::PlacePool(ThreadPool& pool, const std::string& path)
+{
+    int node = -1;
+    cpu_set_t cpus = mCpus;
+
+    if(mNumaPlacement != NumaPlacement::None)
+    {
+        cpu_set_t nodeCpus;
+        node = CpuAffinity::GetPathNode(path);
+        if(node >= 0 && CpuAffinity::GetNodeCpus(node, nodeCpus))
+        {
+            // Node CPUs of the given ones (if any of them is on the node)
+            if(mHasCpus)
+                CPU_AND(&cpus, &mCpus, &nodeCpus);
+            if(!mHasCpus || CPU_COUNT(&cpus) == 0)
+                cpus = nodeCpus;
+        }
+        else
+        {
+            node = -1;
+        }
+    }
+
+    pool.SetPlacement((mHasCpus || node >= 0) ? &cpus : nullptr, node);
+}
+
+void DirCopy::StopWriters()
+{
+    mDestPools.clear(); // Wait for threads to exit
+    mWritePool.reset();
+
+    if(mPublisher)
+    {
+        mPublisher->Flush();
+        mPublisher.reset();
+    }
+}
+
+// Add up the metrics of the watch mode copies
+static void AddMetrics(DirCopy::Metrics& total, const DirCopy::Metrics& metrics)
+{
+    total.files += metrics.files;
+    total.bytes += metrics.bytes;
+    total.throttleSeconds += metrics.throttleSeconds;
+    total.skippedFiles += metrics.skippedFiles;
+    total.skippedBytes += metrics.skippedBytes;
+    total.cachedFiles += metrics.cachedFiles;
+    total.pipelinedFiles += metrics.pipelinedFiles;
+    total.retries += metrics.retries;
+    total.readStallSeconds += metrics.readStallSeconds;
+    total.writeStallSeconds += metrics.writeStallSeconds;
+    total.excludedFiles += metrics.excludedFiles;
+    total.prunedDirs += metrics.prunedDirs;
+    total.filterMatches.resize(metrics.filterMatches.size());
+    for(size_t i = 0; i < metrics.filterMatches.size(); i++)
+        total.filterMatches[i] += metrics.filterMatches[i];
+    total.threadDecisions.insert(total.threadDecisions.end(), metrics.threadDecisions.begin(), metrics.threadDecisions.end());
+}
+
+bool DirCopy::Watch(const std::string& srcDir, const std::vector<std::string>& destNames,
+                    size_t sparseBlockSize /*=0*/, int coalesceMs /*=500*/)
+{
+    // Watch the source before copying it, so changes made while copying
+    // are not missed (they may be copied twice though)
+    DirWatcher watcher;
+    if(!watcher.Open(srcDir, mPathFilter))
+    {
+        mErrMsg = watcher.GetError();
+        mFailures.clear();
+        return false;
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    bool res = Copy(srcDir, destNames, sparseBlockSize);
+    Metrics total;
+    AddMetrics(total, mMetrics);
+
+    // Note: Files we failed to copy don't stop the watch if we continue on
+    // errors, and failures of all the copies are reported
+    std::vector<Failure> failures = GetFailures();
+    auto keepGoing = [this]() { return (mContinueOnError && !mAbort && !mWasCancelled && !mFailures.empty()); };
+
+    // Note: The journal is only used by the initial copy
+    std::string journalFile;
+    std::swap(journalFile, mJournalFile);
+
+    while(res || keepGoing())
+    {
+        DirWatcher::Changes changes;
+        if(!watcher.WaitChanges(changes, coalesceMs, mCancelled))
+        {
+            mErrMsg = watcher.GetError();
+            res = false;
+            break;
+        }
+
+        if(mCancelled)
+        {
+            // Cancelled while waiting for changes
+            mCancelled = false;
+            mWasCancelled = true;
+            mErrMsg = "Copy cancelled";
+            res = false;
+            break;
+        }
+
+        if(changes.empty())
+            continue;
+
+        total.watchBatches++;
+        if(changes.rescan)
+            total.watchRescans++;
+
+        res = CopyChanges(srcDir, destNames, changes, sparseBlockSize);
+        AddMetrics(total, mMetrics);
+        std::vector<Failure> batchFailures = GetFailures();
+        failures.insert(failures.end(), batchFailures.begin(), batchFailures.end());
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mErrMsgMutex);
+        mFailures = std::move(failures);
+    }
+
+    std::swap(journalFile, mJournalFile);
+    total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    mMetrics = std::move(total);
+    return res;
+}
+
+// Is the file (or directory) changed since then?
+static bool IsChangedSince(int dirFd, const char* name, const struct timespec& since)
+{
+    // Note: ctime is set by both data and metadata changes (and renames)
+    struct stat st;
+    if(fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return (errno != ENOENT);   // Let the copy report the error (if it is gone, there is nothing to copy)
+    return (st.st_ctim.tv_sec > since.tv_sec ||
+           (st.st_ctim.tv_sec == since.tv_sec && st.st_ctim.tv_nsec >= since.tv_nsec));
+}
+
+DirCopy::ChangedDir* DirCopy::OpenChangedDir(const std::string& srcDir, const std::vector<std::string>& destNames,
+                                             const std::string& relPath, std::map<std::string, ChangedDir>& dirs)
+{
+    auto it = dirs.find(relPath);
+    if(it != dirs.end())
+        return &it->second;
+
+    // Note: The directory could be gone since it was changed
+    std::string srcPath = (relPath.empty() ? srcDir : srcDir + "/" + relPath);
+    struct stat st;
+    if(stat(srcPath.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+        return nullptr;
+
+    ChangedDir dir;
+    std::string errMsg;
+    dir.srcDir = OpenDir(AT_FDCWD, srcPath.c_str(), srcPath, errMsg);
+    if(!dir.srcDir)
+    {
+        int errNo = errno;
+        AbortOnFailure();
+        AddFailure(srcPath, errMsg, errNo);
+        return nullptr;
+    }
+
+    for(const std::string& destName : destNames)
+    {
+        std::string destPath = (relPath.empty() ? destName : destName + "/" + relPath);
+        std::error_code err;
+        std::filesystem::create_directories(destPath, err);
+        if(err)
+        {
+            AbortOnFailure();
+            AddFailure(srcPath, "Failed to make '" + destPath + "' directory - " + err.message(), err.value());
+            return nullptr;
+        }
+
+        DirFdPtr destDir = OpenDir(AT_FDCWD, destPath.c_str(), destPath, errMsg);
+        if(!destDir)
+        {
+            int errNo = errno;
+            AbortOnFailure();
+            AddFailure(srcPath, errMsg, errNo);
+            return nullptr;
+        }
+        dir.param.destDirs.emplace_back(std::move(destDir));
+    }
+
+    // Files changed in the directory change its times as well
+    if(mPreserveMetadata && !PreserveDirMetadata(dir.srcDir->GetFd(), srcPath, dir.param.destDirs, {}))
+    {
+        AbortOnFailure();
+        return nullptr;
+    }
+
+    return &(dirs[relPath] = std::move(dir));
+}
+
+// Get the parent directory of the relative path ("" - the root)
+static std::string GetParentPath(const std::string& relPath)
+{
+    size_t pos = relPath.rfind('/');
+    return (pos == std::string::npos ? std::string() : relPath.substr(0, pos));
+}
+
+// Is any of the path parent directories in the set?
+static bool HasParentIn(const std::set<std::string>& dirs, const std::string& path)
+{
+    for(size_t pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1))
+    {
+        if(dirs.count(path.substr(0, pos)))
+            return true;
+    }
+    return false;
+}
+
+bool DirCopy::CopyChanges(const std::string& srcDir, const std::vector<std::string>& destNames,
+                          const DirWatcher::Changes& changes, size_t sparseBlockSize)
+{
+    if(!BeginCopy(srcDir, sparseBlockSize))
+        return false;
+
+    StartWriters(destNames);
+
+    bool res = false;
+    {
+        // Directories of the changed files, open for the whole batch
+        std::map<std::string, ChangedDir> dirs;
+
+        res = RunCopyJob([&]()
+        {
+            // Events were lost, so read the whole tree, but only copy files
+            // changed since then (and directories made or moved in since then)
+            if(changes.rescan)
+            {
+                ChangedDir* root = OpenChangedDir(srcDir, destNames, "", dirs);
+                if(!root)
+                    return false;
+
+                mChangedSince = changes.since;
+                root->param.changedOnly = true;
+                return Read(srcDir, &root->param);
+            }
+
+            // New directories are copied with all their files
+            for(const std::string& relPath : changes.dirs)
+            {
+                if(HasParentIn(changes.dirs, relPath))
+                    continue;   // Copied with its parent
+
+                // Note: Its parent directory times are changed as well
+                if(mPreserveMetadata && !OpenChangedDir(srcDir, destNames, GetParentPath(relPath), dirs) && mAbort)
+                    return false;
+
+                ChangedDir* dir = OpenChangedDir(srcDir, destNames, relPath, dirs);
+                if(!dir && mAbort)
+                    return false;
+                if(dir && !ReadDir(dir->srcDir, &dir->param))
+                    return false;
+            }
+
+            for(const std::string& relPath : changes.files)
+            {
+                if(HasParentIn(changes.dirs, relPath))
+                    continue;   // Copied with its directory
+
+                std::string parentPath = GetParentPath(relPath);
+                std::string fileName = (parentPath.empty() ? relPath : relPath.substr(parentPath.size() + 1));
+                ChangedDir* dir = OpenChangedDir(srcDir, destNames, parentPath, dirs);
+                if(!dir && mAbort)
+                    return false;
+
+                // Note: The file could be gone (or replaced with a directory) since it was changed
+                struct stat st;
+                if(!dir || fstatat(dir->srcDir->GetFd(), fileName.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0 || S_ISDIR(st.st_mode))
+                    continue;
+
+                {
+                    std::unique_lock<std::mutex> lock(mProgressMutex);
+                    mTotalDirAndFiles++;
+                }
+                WaitQueueRoom();
+                PostCopyFile(GetQueueId(dir->srcDir, dir->param.destDirs), dir->srcDir, dir->param.destDirs, fileName);
+            }
+
+            // Directories with new attributes only need their metadata set
+            for(const std::string& relPath : changes.attrDirs)
+            {
+                if(mPreserveMetadata && !OpenChangedDir(srcDir, destNames, relPath, dirs) && mAbort)
+                    return false;
+            }
+
+            return true;
+        });
+
+        mChangedSince = {};
+    }
+
+    // Publish the rest of the files
+    StopWriters();
+
+    // Note: Files are published and directories metadata is set after
+    // they are copied, and either can fail
+    if(!mErrMsg.empty())
+        res = false;
+
+    return EndCopy(res);
+}
+
+// Get the name of the source directory (or file) in the archive (or on the receiver)
+static std::string GetRootName(const std::string& srcName)
+{
+    std::filesystem::path path = std::filesystem::path(srcName).lexically_normal();
+    std::string name = path.filename();
+    if(name.empty())
+        name = path.parent_path().filename(); // Trailing '/'
+    if(name.empty() || name == "..")
+        name = ".";
+    return name;
+}
+
+bool DirCopy::CopyToTar(const std::string& srcName, int tarFd, size_t sparseBlockSize /*=0*/)
+{
+    if(!BeginCopy(srcName, sparseBlockSize))
+        return false;
+
+    // Are we archiving a file or a directory?
+    struct stat st;
+    if(stat(srcName.c_str(), &st) < 0)
+    {
+        mErrMsg = "stat() failed for srcDir='" + srcName + "': " + strerror(errno);
+        return EndCopy(false);
+    }
+
+    TarStream tar(tarFd);
+    tar.Start();
+    mTar = &tar;
+
+    std::string tarPath = GetRootName(srcName);
+    bool res = false;
+
+    if((st.st_mode & S_IFMT) == S_IFDIR)
+    {
+        // Root directory entry goes first
+        DirReaderParam dirParam;
+        dirParam.relPath = tarPath;
+        if(PushTarEntry(st, tarPath))
+            res = CopyTree(srcName, dirParam);
+    }
+    else
+    {
+        char buf[PATH_MAX + 1] {};
+        strcpy(buf, srcName.c_str());
+        std::string srcDirName = dirname(buf);
+
+        DirFdPtr srcDir = OpenDir(AT_FDCWD, srcDirName.c_str(), srcDirName, mErrMsg);
+        if(srcDir)
+        {
+            strcpy(buf, srcName.c_str());
+            res = CopyFileToTar(srcDir, basename(buf), tarPath, tar.NextSeq(), true /*updateProgress*/);
+        }
+    }
+
+    // Write the rest of the archive (or give up on it)
+    if(!res || mCancelled)
+        tar.Abort();
+    if(!tar.Finish())
+    {
+        if(!tar.GetError().empty())
+            SetError(tar.GetError());
+        res = false;
+    }
+    mTar = nullptr;
+
+    return EndCopy(res);
+}
+
+bool DirCopy::CopyToRemote(const std::string& srcName, const std::string& address,
+                           int connectionCount /*=4*/, size_t sparseBlockSize /*=0*/)
+{
+    if(!BeginCopy(srcName, sparseBlockSize))
+        return false;
+
+    // Are we sending a file or a directory?
+    struct stat st;
+    if(stat(srcName.c_str(), &st) < 0)
+    {
+        mErrMsg = "stat() failed for srcDir='" + srcName + "': " + strerror(errno);
+        return EndCopy(false);
+    }
+
+    FileSender sender;
+    if(!sender.Connect(address, connectionCount))
+    {
+        mErrMsg = sender.GetError();
+        return EndCopy(false);
+    }
+    mSender = &sender;
+
+    std::string relPath = GetRootName(srcName);
+    bool res = false;
+
+    if((st.st_mode & S_IFMT) == S_IFDIR)
+    {
+        DirReaderParam dirParam;
+        dirParam.relPath = relPath;
+        if(sender.SendDir(relPath))
+            res = CopyTree(srcName, dirParam);
+        else
+            OnOutputAborted();
+    }
+    else
+    {
+        char buf[PATH_MAX + 1] {};
+        strcpy(buf, srcName.c_str());
+        std::string srcDirName = dirname(buf);
+
+        DirFdPtr srcDir = OpenDir(AT_FDCWD, srcDirName.c_str(), srcDirName, mErrMsg);
+        if(srcDir)
+        {
+            strcpy(buf, srcName.c_str());
+            res = CopyFileToRemote(srcDir, basename(buf), relPath, true /*updateProgress*/);
+        }
+    }
+
+    // Wait for the receiver to write all the files (or give up on them)
+    if(!res || mCancelled)
+        sender.Abort();
+    if(!sender.Finish())
+    {
+        if(!sender.GetError().empty())
+            SetError(sender.GetError());
+        res = false;
+    }
+    mSender = nullptr;
+
+    return EndCopy(res);
+}
+
+// Load the journal (resume mode) and start recording to it
+// Note: Destination directories must exist by now, so the journal can sync
+// their file systems before recording files as done.
+bool DirCopy::OpenJournal(const std::vector<std::string>& destDirs)
+{
+    if(mJournalFile.empty())
+        return true;
+
+    if(!mJournal.Open(mJournalFile, destDirs, mJournalResume))
+    {
+        mErrMsg = mJournal.GetError();
+        return false;
+    }
+
+    mJournalOpen = true;
+    return true;
+}
+
+bool DirCopy::BeginCopy(const std::string& srcName, size_t sparseBlockSize)
+{
+    // Reset errors
+    mErrMsg.clear();
+    mFailures.clear();
+    mWasCancelled = false;
+
+    if(mCancelled)
+    {
+        // Cancelled before we even started
+        mCancelled = false;
+        mWasCancelled = true;
+        mErrMsg = "Copy cancelled";
+        return false;
+    }
+    mAbort = false;
+    mBytesLimit.Resume();
+    mFilesLimit.Resume();
+    mSparseBlockSize = sparseBlockSize;
+    mSrcName = srcName;
+    mDestName.clear();
+    SetFilter(mPathFilter, srcName);
+
+    // Reset statistics
+    mMetrics = Metrics();
+    mCopiedFiles = 0;
+    mCopiedBytes = 0;
+    mSkippedFiles = 0;
+    mSkippedBytes = 0;
+    mCopyNanos = 0;
+    mThrottleNanos = 0;
+    mCachedFiles = 0;
+    mPipelinedFiles = 0;
+    mRetriedFiles = 0;
+    mReadStallNanos = 0;
+    mWriteStallNanos = 0;
+    mStartTime = std::chrono::steady_clock::now();
+
+    // Reset progress. 
+    // Note: If copying a directory, then set mProgress negative to block
+    // reporting progress until we get complete mTotalDirAndFiles
+    {
+        std::unique_lock<std::mutex> lock(mProgressMutex);
+        mProgress = -1;
+        mSavedDirAndFiles = 0;
+        mTotalDirAndFiles = 0;
+    }
+
+    return true;
+}
+
+bool DirCopy::EndCopy(bool res)
+{
+    mMetrics.files = mCopiedFiles;
+    mMetrics.bytes = mCopiedBytes;
+    mMetrics.skippedFiles = mSkippedFiles;
+    mMetrics.skippedBytes = mSkippedBytes;
+    mMetrics.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - mStartTime).count();
+    mMetrics.throttleSeconds = mThrottleNanos / 1e9;
+    mMetrics.cachedFiles = mCachedFiles;
+    mMetrics.pipelinedFiles = mPipelinedFiles;
+    mMetrics.retries = mRetriedFiles;
+    mMetrics.readStallSeconds = mReadStallNanos / 1e9;
+    mMetrics.writeStallSeconds = mWriteStallNanos / 1e9;
+    mMetrics.filterMatches = GetFilterMatches();
+    mMetrics.excludedFiles = GetExcludedFiles();
+    mMetrics.prunedDirs = GetPrunedDirs();
+
+    if(mCancelled)
+    {
+        mCancelled = false;
+        mWasCancelled = true;
+        SetError("Copy cancelled");
+        res = false;
+    }
+
+    return res;
+}
+
+void DirCopy::Cancel()
+{
+    mCancelled = true;
+    mAbort = true;      // Stop reading directories
+    unsigned long jobId = mJobId;
+    if(jobId)
+        mPool->StopJob(jobId); // Drop pending requests
+
+    // Drop files to retry (and let the scheduler and WaitRetries() know)
+    {
+        std::unique_lock<std::mutex> lock(mRetryMutex);
+        mRetries.clear();
+    }
+    mRetryCv.notify_all();
+
+    // Let threads waiting for the rate limits go
+    mBytesLimit.Cancel();
+    mFilesLimit.Cancel();
+
+    // Let threads waiting for the tar stream (or the receiver) go
+    if(TarStream* tar = mTar)
+        tar->Abort();
+    if(FileSender* sender = mSender)
+        sender->Abort();
+}
+
+void* DirCopy::OnDirectory(const DirFdPtr& dir, const char* baseName, void* param)
+{
+    DirReaderParam* parentDirParam = (DirReaderParam*)param;
+    if(mTar)
+        return OnTarDirectory(dir, baseName, parentDirParam->relPath + "/" + baseName);
+    if(mSender)
+        return OnRemoteDirectory(parentDirParam->relPath + "/" + baseName);
+
+//    std::cout << __func__ << ": srcDir=" << dir->GetPath() << "/" << baseName << "/" << std::endl;
+//    std::cout << __func__ << ": destDir=" << parentDirParam->destDirs[0]->GetPath() << "/" << baseName << "/" << std::endl;
+//    std::cout << std::endl;
+
+    // Update total Dir/Files count
+    {
+        std::unique_lock<std::mutex> lock(mProgressMutex);
+        mTotalDirAndFiles++;
+    }
+
+    // Make destination directories relative to their (already existing) parents.
+    // Note: We don't need create_directories() here since all the ancestors
+    // have been made by the time we get to a sub-directory.
+    std::vector<DirFdPtr> destDirs;
+    for(const DirFdPtr& parentDestDir : parentDirParam->destDirs)
+    {
+        std::string destPath = parentDestDir->GetPath() + "/" + baseName;
+        if(mkdirat(parentDestDir->GetFd(), baseName, 0770) != 0 && errno != EEXIST)
+        {
+            AbortOnFailure();
+            int errNo = errno;
+            AddFailure(dir->GetPath() + "/" + baseName, "Failed to make '" + destPath + "' directory - " + strerror(errNo), errNo);
+            return nullptr;
+        }
+
+        std::string errMsg;
+        DirFdPtr destDir = OpenDir(parentDestDir->GetFd(), baseName, destPath, errMsg);
+        if(!destDir)
+        {
+            int errNo = errno;
+            AbortOnFailure();
+            AddFailure(dir->GetPath() + "/" + baseName, errMsg, errNo);
+            return nullptr;
+        }
+        destDirs.emplace_back(std::move(destDir));
+    }
+
+    if(mPreserveMetadata)
+    {
+        std::string srcPath = dir->GetPath() + "/" + baseName;
+        int srcFd = openat(dir->GetFd(), baseName, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if(srcFd < 0)
+        {
+            AbortOnFailure();
+            int errNo = errno;
+            AddFailure(srcPath, std::string("Failed to open for metadata - ") + strerror(errNo), errNo);
+            return nullptr;
+        }
+
+        bool res = PreserveDirMetadata(srcFd, srcPath, destDirs, parentDirParam->destDirs);
+        close(srcFd);
+        if(!res)
+        {
+            AbortOnFailure();
+            return nullptr;
+        }
+    }
+
+    // Update saved Dir/Files count and report overall progress
+    UpdateProgress();
+
+    // We have new directory now. Create corresponding DirReaderParam
+    DirReaderParam* dirParam = new (std::nothrow) DirReaderParam;
+    if(!dirParam)
+    {
+        mAbort = true;
+        SetError("Out of memory creating DirReaderParam");
+        return nullptr;
+    }
+    dirParam->destDirs = std::move(destDirs);
+
+    // Rescan (watch mode): a directory changed since then could be moved
+    // in, so copy all of its files
+    dirParam->changedOnly = (parentDirParam->changedOnly && !IsChangedSince(dir->GetFd(), baseName, mChangedSince));
+
+    return dirParam;
+}
+
+void DirCopy::OnDirectoryEnd(const DirFdPtr& /*dir*/, void* param)
+{
+    if(param)
+        delete (DirReaderParam*)param;
+}
+
+bool DirCopy::OnDirectoryError(const std::string& path, const std::string& err, int errNo)
+{
+    // Note: Copy threads may be setting the error too
+    AddFailure(path, err, errNo);
+    return (mContinueOnError && !mTar && !mSender);
+}
+
+void DirCopy::OnFile(const DirFdPtr& dir, const char* baseName, void* param)
+{
+    DirReaderParam* dirParam = (DirReaderParam*)param;
+
+//    std::cout << __func__ << ": srcFile=" << dir->GetPath() << "/" << baseName << std::endl;
+//    std::cout << __func__ << ": destFile=" << dirParam->destDirs[0]->GetPath() << "/" << baseName << std::endl;
+//    std::cout << std::endl;
+
+    // Update total Dir/Files count
+    {
+        std::unique_lock<std::mutex> lock(mProgressMutex);
+        mTotalDirAndFiles++;
+    }
+
+    // Don't let the reader run too far ahead of copying threads
+    WaitQueueRoom();
+
+    // Archive entries are written in the order we find them
+    if(TarStream* tar = mTar)
+    {
+        PostCopyFileToTar(dir, baseName, dirParam->relPath + "/" + baseName, tar->NextSeq());
+        return;
+    }
+
+    // Remote files are sent as soon as we find them
+    if(mSender)
+    {
+        PostCopyFileToRemote(dir, baseName, dirParam->relPath + "/" + baseName);
+        return;
+    }
+
+    // Rescan (watch mode): skip files not changed since then
+    if(dirParam->changedOnly && !IsChangedSince(dir->GetFd(), baseName, mChangedSince))
+    {
+        UpdateProgress();
+        return;
+    }
+
+    // Are we ordering files by their physical layout?
+    if(mSchedule != Schedule::Fifo)
+    {
+        ScheduleFile(dir, dirParam->destDirs, baseName);
+        return;
+    }
+
+    PostCopyFile(GetQueueId(dir, dirParam->destDirs), dir, dirParam->destDirs, baseName);
+}
+
+// Failure of the file this thread is copying (see PostCopyFile)
+struct FileAttempt
+{
+    const DirCopy* copy{nullptr};
+    DirCopy::Failure* failure{nullptr};
+};
+static thread_local FileAttempt fileAttempt;
+
+// Can the same file copy succeed if we try it again later?
+static bool IsTransientError(int errNo)
+{
+    switch(errNo)
+    {
+    case EINTR:
+    case EAGAIN:
+    case EIO:
+    case EBUSY:
+    case ETIMEDOUT:
+    case ENOMEM:
+    case ENOBUFS:
+    case ESTALE:        // NFS
+    case ECONNRESET:    // Network file systems
+        return true;
+    default:
+        return false;
+    }
+}
+
+void DirCopy::PostCopyFile(unsigned long queueId, const DirFdPtr& srcDir, const std::vector<DirFdPtr>& destDirs, const std::string& fileName,
+                           int attempt /*=0*/)
+{
+    // Post copy file request to thread pool.
+    // Note: The request holds a reference to both source and destination
+    // directories, so they stay open until all their files are copied.
+    mPool->PostToJob(mJobId, queueId, [this, queueId, attempt](const DirFdPtr& srcDir, const std::vector<DirFdPtr>& destDirs, const std::string& fileName)
+    {
+        // Hold the file failure (if any) until we know if we try it again
+        Failure failure;
+        failure.path = srcDir->GetPath() + "/" + fileName;
+        failure.attempts = attempt + 1;
+        fileAttempt = FileAttempt { this, &failure };
+        bool res = CopyFile(srcDir, fileName, destDirs, fileName);
+        fileAttempt = FileAttempt();
+
+        if(!res && !failure.error.empty() && attempt < mRetryCount && IsTransientError(failure.errNo) && !mCancelled)
+        {
+            RetryCopyFile(queueId, srcDir, destDirs, fileName, attempt + 1);
+            return; // Not done yet
+        }
+
+        if(!failure.error.empty())
+            CommitFailure(failure);
+
+        if(!res && (!mContinueOnError || failure.error.empty()))
+        {
+            mAbort = true;          // Stop reading directories
+            mPool->StopJob(mJobId); // Force other threads to stop
+            if(mRetryCount > 0)
+            {
+                std::unique_lock<std::mutex> lock(mRetryMutex);
+                mRetries.clear(); // Drop files to retry
+                mRetryCv.notify_all();
+            }
+        }
+
+        // Update saved Dir/Files count and report overall progress
+        UpdateProgress();
+        
+    }, srcDir, destDirs, fileName);
+}
+
+// Wait for copying threads to catch up if the job has too many files
+// queued. Every queued file holds its source and destination directories
+// open (and some memory), so a fast scan of a wide tree could run out of
+// file descriptors otherwise.
+// Note: Only the directory reader (not pool threads) may wait here.
+void DirCopy::WaitQueueRoom()
+{
+    static constexpr unsigned long maxQueuedFiles = 16 * 1024;
+    mPool->WaitJobQueued(mJobId, maxQueuedFiles);
+}
+
+void DirCopy::RetryCopyFile(unsigned long queueId, const DirFdPtr& srcDir, const std::vector<DirFdPtr>& destDirs, const std::string& fileName,
+                            int attempt)
+{
+    // Note: The thread doesn't wait for the retry time, the retry scheduler
+    // posts the file back to the pool once it is time
+    static constexpr int maxRetryDelayMs = 60 * 1000;
+    int delayMs = mRetryDelayMs;
+    for(int i = 1; i < attempt && delayMs < maxRetryDelayMs; i++)
+        delayMs *= 2;
+    auto when = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::min(delayMs, maxRetryDelayMs));
+
+    mRetriedFiles++;
+    {
+        std::unique_lock<std::mutex> lock(mRetryMutex);
+        mRetries.emplace(when, [this, queueId, srcDir, destDirs, fileName, attempt]()
+        {
+            PostCopyFile(queueId, srcDir, destDirs, fileName, attempt);
+        });
+    }
+    mRetryCv.notify_all();
+}
+
+void DirCopy::RunRetryScheduler()
+{
+    std::unique_lock<std::mutex> lock(mRetryMutex);
+    while(!mRetryStop)
+    {
+        if(mRetries.empty())
+        {
+            mRetryCv.wait(lock);
+        }
+        else if(mCancelled || mAbort)
+        {
+            mRetries.clear(); // Nothing to copy anymore
+            mRetryCv.notify_all();
+        }
+        else if(std::chrono::steady_clock::now() < mRetries.begin()->first)
+        {
+            mRetryCv.wait_until(lock, mRetries.begin()->first);
+        }
+        else
+        {
+            // Note: It is posted before it is gone from mRetries (see WaitRetries)
+            mRetries.begin()->second();
+            mRetries.erase(mRetries.begin());
+            mRetriesPosted++;
+            mRetryCv.notify_all();
+        }
+    }
+}
+
+bool DirCopy::WaitRetries()
+{
+    // Wait for all the files to retry to be posted back to the pool
+    // Note: Files posted since the last call (even if the scheduler got to
+    // them before us) are not copied yet either
+    std::unique_lock<std::mutex> lock(mRetryMutex);
+    if(mRetries.empty() && mRetriesPosted == 0)
+        return false;
+
+    mRetryCv.wait(lock, [this]() { return mRetries.empty(); });
+    mRetriesPosted = 0;
+    return true;
+}
+
+unsigned long DirCopy::GetQueueId(const DirFdPtr& srcDir, const std::vector<DirFdPtr>& destDirs, bool cached /*=false*/)
+{
+    // Do we have a queue for this source/destination devices already?
+    // Note: Files in the page cache have their own queue, since they
+    // are not read from the source device
+    std::vector<dev_t> devs { srcDir->GetDev() };
+    for(const DirFdPtr& destDir : destDirs)
+        devs.push_back(destDir->GetDev());
+    if(cached)
+        devs.push_back((dev_t)-1);
+    auto it = mQueueIds.find(devs);
+    if(it != mQueueIds.end())
+        return it->second;
+
+    unsigned long queueId = mQueueIds.size() + 1;
+    mQueueIds[devs] = queueId;
+
+    // Use the smallest limit of all devices
+    int limit = mDeviceThreadCount;
+    if(limit == 0 && mSchedule != Schedule::Fifo)
+        limit = 2; // Default for layout ordered schedules
+
+    for(size_t i = (cached ? 1 : 0); i < devs.size(); i++)
+    {
+        auto devIt = mDeviceThreads.find(devs[i]);
+        if(devIt != mDeviceThreads.end() && devIt->second > 0 && (limit == 0 || devIt->second < limit))
+            limit = devIt->second;
+    }
+
+    mPool->SetJobQueueLimit(mJobId, queueId, limit);
+    return queueId;
+}
+
+// Get the physical offset of the file first extent (0 if file has no extents
+// or file system doesn't support FIEMAP)
+static uint64_t GetFirstExtent(int fd)
+{
+    union
+    {
+        struct fiemap fm;
+        char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } fiemapBuf {};
+
+    struct fiemap* fm = &fiemapBuf.fm;
+    fm->fm_start = 0;
+    fm->fm_length = FIEMAP_MAX_OFFSET;
+    fm->fm_extent_count = 1;
+
+    uint64_t physical = 0;
+    if(ioctl(fd, FS_IOC_FIEMAP, fm) == 0 && fm->fm_mapped_extents > 0)
+        physical = fm->fm_extents[0].fe_physical;
+
+    return physical;
+}
+
+static uint64_t GetFirstExtent(int dirFd, const char* fileName)
+{
+    int fd = openat(dirFd, fileName, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return 0;
+
+    uint64_t physical = GetFirstExtent(fd);
+    close(fd);
+    return physical;
+}
+
+// cachestat() (Linux 6.5+), in case the headers don't have it yet
+#ifndef __NR_cachestat
+#define __NR_cachestat 451
+#endif
+
+struct CacheStatRange
+{
+    uint64_t off;
+    uint64_t len;           // 0 - to the end of file
+};
+
+struct CacheStat
+{
+    uint64_t nr_cache;      // Pages in the page cache
+    uint64_t nr_dirty;
+    uint64_t nr_writeback;
+    uint64_t nr_evicted;
+    uint64_t nr_recently_evicted;
+};
+
+// Get the percentage of the file pages in the page cache. Use cachestat()
+// if the kernel has it (and lets us), otherwise map the file and ask mincore().
+// Note: mincore() only looks at the first mincoreMaxSize bytes of the file.
+static int GetCachedPercent(int fd, off_t size)
+{
+    static constexpr off_t mincoreMaxSize = 256 * 1024 * 1024; // 256MB
+    static std::atomic<bool> noCachestat{false};
+    static const long pageSize = sysconf(_SC_PAGESIZE);
+
+    if(size <= 0)
+        return 100; // Nothing to read
+
+    uint64_t pages = (size + pageSize - 1) / pageSize;
+    if(!noCachestat)
+    {
+        CacheStatRange range { 0, 0 };
+        CacheStat cs {};
+        if(syscall(__NR_cachestat, fd, &range, &cs, 0) == 0)
+            return (int)(100 * std::min(cs.nr_cache, pages) / pages);
+
+        // Note: Seccomp filters may fail it with EPERM (or another errno)
+        // rather than ENOSYS. Either way mincore() can still tell.
+        if(errno == ENOSYS || errno == EPERM)
+            noCachestat = true;
+    }
+
+    size_t len = std::min(size, mincoreMaxSize);
+    void* addr = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    if(addr == MAP_FAILED)
+        return 0;
+
+    pages = (len + pageSize - 1) / pageSize;
+    std::vector<unsigned char> vec(pages);
+    uint64_t cached = 0;
+    if(mincore(addr, len, vec.data()) == 0)
+    {
+        for(unsigned char page : vec)
+            cached += (page & 1);
+    }
+    munmap(addr, len);
+    return (int)(100 * cached / pages);
+}
+
+// Copy a file in the page cache right away, otherwise schedule it in the
+// layout order with the rest of them
+bool DirCopy::ScheduleCachedFile(const DirFdPtr& srcDir, const std::vector<DirFdPtr>& destDirs, const char* fileName)
+{
+    static constexpr int cachedMinPercent = 90;
+
+    int fd = openat(srcDir->GetFd(), fileName, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0)
+        return false; // Let the copy find out why
+
+    struct stat st;
+    bool cached = (fstat(fd, &st) == 0 && GetCachedPercent(fd, st.st_size) >= cachedMinPercent);
+    if(cached)
+    {
+        close(fd);
+        mCachedFiles++;
+        PostCopyFile(GetQueueId(srcDir, destDirs, true /*cached*/), srcDir, destDirs, fileName);
+        return true;
+    }
+
+    FileTask task;
+    task.key = GetFirstExtent(fd);
+    task.srcDir = srcDir;
+    task.destDirs = destDirs;
+    task.fileName = fileName;
+    close(fd);
+
+    AddScheduledTask(GetQueueId(srcDir, destDirs), std::move(task));
+    return true;
+}
+
+void DirCopy::ScheduleFile(const DirFdPtr& srcDir, const std::vector<DirFdPtr>& destDirs, const char* fileName)
+{
+    if(mSchedule == Schedule::Cache && ScheduleCachedFile(srcDir, destDirs, fileName))
+        return;
+
+    struct stat st;
+    if(fstatat(srcDir->GetFd(), fileName, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        AbortOnFailure();
+        int errNo = errno;
+        AddFailure(srcDir->GetPath() + "/" + fileName, std::string("Failed to stat - ") + strerror(errNo), errNo);
+        return;
+    }
+
+    FileTask task;
+    task.key = (mSchedule == Schedule::Extent ? GetFirstExtent(srcDir->GetFd(), fileName) : st.st_ino);
+    task.srcDir = srcDir;
+    task.destDirs = destDirs;
+    task.fileName = fileName;
+
+    AddScheduledTask(GetQueueId(srcDir, destDirs), std::move(task));
+}
+
+// Add the file to the batch sorted by layout, and copy the batch once it
+// has enough files (or pins enough directories open)
+// Note: Every scheduled file holds its source and destination directories
+// open, so we don't wait for the entire source tree to be read. It also
+// lets the copy start while the tree is still being read.
+void DirCopy::AddScheduledTask(unsigned long queueId, FileTask&& task)
+{
+    static constexpr size_t maxBatchFiles = 64 * 1024;
+    static constexpr size_t maxBatchDirs = 1024;
+
+    // Note: Directory files are found together (mostly), so count the
+    // directory changes rather than looking up every directory
+    if(task.srcDir.get() != mLastScheduledDir)
+    {
+        mLastScheduledDir = task.srcDir.get();
+        mScheduledDirs++;
+    }
+
+    mScheduledTasks[queueId].emplace_back(std::move(task));
+    if(++mScheduledFiles >= maxBatchFiles || mScheduledDirs >= maxBatchDirs)
+        DispatchScheduledFiles();
+}
+
+void DirCopy::DispatchScheduledFiles()
+{
+    for(auto& [queueId, tasks] : mScheduledTasks)
+    {
+        std::sort(tasks.begin(), tasks.end(), [](const FileTask& t1, const FileTask& t2)
+            { return t1.key < t2.key; });
+
+        // Post files in the layout order. The device queue copies them
+        // in the same order with no more than its limit at the same time,
+        // so files are read (mostly) sequentially.
+        for(FileTask& task : tasks)
+        {
+            WaitQueueRoom();
+            PostCopyFile(queueId, task.srcDir, task.destDirs, task.fileName);
+        }
+    }
+
+    mScheduledTasks.clear();
+    mScheduledFiles = 0;
+    mScheduledDirs = 0;
+    mLastScheduledDir = nullptr;
+}
+
+bool DirCopy::CopyDir(const std::string& srcDir, const std::vector<std::string>& destDirs)
+{
+    DirReaderParam dirParam;
+    for(const std::string& destDir : destDirs)
+    {
+        DirFdPtr dir = OpenDir(AT_FDCWD, destDir.c_str(), destDir, mErrMsg);
+        if(!dir)
+            return false;
+        dirParam.destDirs.emplace_back(std::move(dir));
+    }
+
+    if(mPreserveMetadata)
+    {
+        int srcFd = open(srcDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(srcFd < 0)
+        {
+            mErrMsg = "Failed to open '" + srcDir + "' for metadata - " + strerror(errno);
+            return false;
+        }
+
+        bool res = PreserveDirMetadata(srcFd, srcDir, dirParam.destDirs, {});
+        close(srcFd);
+        if(!res)
+            return false;
+    }
+
+    return CopyTree(srcDir, dirParam);
+}
+
+bool DirCopy::CopyTree(const std::string& srcDir, DirReaderParam& dirParam)
+{
+    return RunCopyJob([&]() { return Read(srcDir, &dirParam); });
+}
+
+bool DirCopy::RunCopyJob(const std::function<bool()>& readTree)
+{
+    // Every directory with pending file copy requests keeps its source and
+    // destination descriptors open, so allow as many open files as we can
+    struct rlimit rlim;
+    if(getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max)
+    {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+
+    // Start worker threads (unless we share threads with other copies).
+    // Note: With adaptive concurrency we start the max number of threads,
+    // but only let the current count of them process requests.
+    std::thread controller;
+    if(mPool == &mTpool)
+    {
+        PlacePool(mTpool, (mNumaPlacement == NumaPlacement::Dest && !mDestName.empty()) ? mDestName : mSrcName);
+
+        if(mMaxThreads > 0)
+        {
+            mTpool.Create(mMaxThreads);
+            mTpool.SetActiveCount(mThreadCount);
+
+            mControllerStop = false;
+            controller = std::thread(&DirCopy::RunConcurrencyController, this);
+        }
+        else
+        {
+            mTpool.Create(mThreadCount);
+        }
+    }
+
+    // Files failing with transient errors are posted again when it is time
+    std::thread retryScheduler;
+    if(mRetryCount > 0)
+    {
+        mRetryStop = false;
+        mRetriesPosted = 0;
+        retryScheduler = std::thread(&DirCopy::RunRetryScheduler, this);
+    }
+
+    mJobId = mPool->AddJob(mJobPriority, mJobWeight);
+    if(mCancelled)
+        mPool->StopJob(mJobId); // Cancelled while we were starting
+
+    // Read directory
+    if(!readTree())
+    {
+        mPool->StopJob(mJobId); // Force threads to stop
+    }
+    else
+    {
+        // Copy the last batch of files in the layout order
+        DispatchScheduledFiles();
+
+        // Done reading directory (mTotalDirAndFiles has a correct max value)
+        // Worker threads are still running, but we can start reporting a progress
+        std::unique_lock<std::mutex> lock(mProgressMutex);
+        mProgress = 0; // Unblock (start) reporting progress
+    }
+
+    // Wait for threads to complete (and files to retry to be copied)
+    // Note: Once threads are done, no more files are added to retry
+    mPool->WaitJob(mJobId);
+    while(WaitRetries())
+        mPool->WaitJob(mJobId);
+
+    if(retryScheduler.joinable())
+    {
+        {
+            std::unique_lock<std::mutex> lock(mRetryMutex);
+            mRetryStop = true;
+        }
+        mRetryCv.notify_all();
+        retryScheduler.join();
+    }
+
+    mPool->RemoveJob(mJobId);
+    mJobId = 0;
+    if(mPool == &mTpool)
+        mTpool.Destroy();
+    mQueueIds.clear();
+    mScheduledTasks.clear();
+    mScheduledFiles = 0;
+    mScheduledDirs = 0;
+    mLastScheduledDir = nullptr;
+
+    if(controller.joinable())
+    {
+        {
+            std::unique_lock<std::mutex> lock(mControllerMutex);
+            mControllerStop = true;
+        }
+        mControllerCv.notify_one();
+        controller.join();
+    }
+
+    // We should only have errors if we failed
+    return mErrMsg.empty();
+}
+
+bool DirCopy::CopyFile(const DirFdPtr& srcDir, const std::string& srcName,
+                       const std::vector<DirFdPtr>& destDirs, const std::string& destName, bool updateProgress/*=false*/)
+{
+    const DirFdPtr& destDir = destDirs[0];
+
+//    std::cout << __func__ << ": srcFile=" << srcDir->GetPath() << "/" << srcName << std::endl;
+//    std::cout << __func__ << ": destFile=" << destDir->GetPath() << "/" << destName << std::endl;
+//    std::cout << __func__ << ": sparseBlockSize=" << sparseBlockSize << std::endl;
+//    std::cout << std::endl;
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    // Wait for our turn if files rate is limited
+    double throttleSec = mFilesLimit.Consume(1);
+
+    // Have we copied the file (or some of it) before?
+    // Note: Only if it is the very same file, unchanged since (otherwise it
+    // is copied from scratch). The file status from before the copy goes
+    // to the journal, so changes made during the copy show up on resume.
+    std::string srcPath = srcDir->GetPath() + "/" + srcName;
+    struct stat srcStat;
+    bool journal = (mJournalOpen && fstatat(srcDir->GetFd(), srcName.c_str(), &srcStat, 0) == 0);
+    CopyJournal::Entry entry;
+    off_t resumeOffset = 0;
+    off_t resumeEndOffset = -1;
+    if(journal && mJournal.Find(srcPath, entry) && entry.IsSameFile(srcStat))
+    {
+        if(entry.done && entry.offset == srcStat.st_size)
+        {
+            mSkippedFiles++;
+            mSkippedBytes += srcStat.st_size;
+            return true;
+        }
+        else if(!entry.done && entry.offset <= srcStat.st_size && destDirs.size() == 1 && !mPublisher)
+        {
+            resumeOffset = entry.offset;
+            resumeEndOffset = srcStat.st_size; // Note: FileReader can't map past the end of file
+        }
+    }
+
+    // Write under the temporary name until published
+    std::string writeName = (mPublisher ? FilePublisher::GetTempName(destName) : destName);
+
+    // Continue from the checkpoint (if any), dropping whatever was written after it
+    FileWriter writer;
+    if(resumeOffset > 0)
+    {
+        if(!writer.OpenFile(destDir->GetFd(), destName, FileWriter::Mode::Keep) ||
+           writer.GetFileSize() < (size_t)resumeOffset || !writer.TruncateFile(resumeOffset))
+        {
+            writer.CloseFile();
+            resumeOffset = 0; // Start over
+            resumeEndOffset = -1;
+        }
+    }
+
+    if(resumeOffset == 0 && !writer.OpenFile(destDir->GetFd(), writeName))
+    {
+        AddFailure(srcPath, "FileWriter error '" + writer.GetError() + "' in '" + destDir->GetPath() + "'", writer.GetErrno());
+        return false;
+    }
+
+    // Data goes through this thread (FileReader), unless the kernel copies
+    // it (FileSplicer, single destination only)
+    bool fanOut = (destDirs.size() > 1);
+    bool splice = (mCopyEngine == CopyEngine::Splice && !fanOut);
+    FileReader reader;
+    FileSplicer splicer;
+    reader.SetReadStrategy(mPreadMaxSize, mMapWindowSize);
+    if(splice ? !splicer.OpenFile(srcDir->GetFd(), srcName, resumeOffset) :
+                !reader.OpenFile(srcDir->GetFd(), srcName, resumeOffset, resumeEndOffset))
+    {
+        AddFailure(srcPath, "FileReader error '" + (splice ? splicer.GetError() : reader.GetError()) + "'",
+                   (splice ? splicer.GetErrno() : reader.GetErrno()));
+        RemoveFailedFiles(destDirs, writeName);
+        return false;
+    }
+    reader.SetSparseBlockSize(mSparseBlockSize);
+
+    // The first destination is written by this thread, the rest (if any)
+    // by their own threads at the same time. Large files are pipelined:
+    // this thread only reads them, while the writer threads write the first
+    // destination too, mPipelineDepth chunks behind at most.
+    bool pipelined = (!splice && mWritePool && reader.GetFileSize() >= (off_t)mPipelineMinSize);
+    MultiWriter asyncWriter(pipelined ? mPipelineDepth : 8);
+    if(fanOut || pipelined)
+    {
+        std::vector<ThreadPool*> pools;
+        if(pipelined)
+            pools.push_back(mWritePool.get());
+        for(auto& pool : mDestPools)
+            pools.push_back(pool.get());
+
+        std::vector<DirFdPtr> dirs(destDirs.begin() + (pipelined ? 0 : 1), destDirs.end());
+        if(!asyncWriter.OpenFiles(dirs, writeName, pools, (resumeOffset > 0 ? FileWriter::Mode::Keep : FileWriter::Mode::Truncate)))
+        {
+            AddFailure(srcPath, "FileWriter error '" + asyncWriter.GetError() + "'", asyncWriter.GetErrno());
+            RemoveFailedFiles(destDirs, writeName);
+            return false;
+        }
+    }
+
+    // Read in maxReadSize chanks
+    //static constexpr int maxReadSize = 1024 * 1024 * 3; // 3MB
+    static constexpr int maxReadSize = 1024 * 128; // 128KB
+    static constexpr size_t maxSpliceSize = FileSplicer::pipeSize;
+    static constexpr size_t checkpointInterval = 64 * 1024 * 1024; // 64MB
+    off_t checkpointOffset = resumeOffset;
+    std::string buf;
+
+    while(splice ? splicer.HasMore() : reader.HasMore())
+    {
+        if(mCancelled)
+        {
+            RemoveFailedFiles(destDirs, writeName);
+            return false;
+        }
+
+        // Read source file (or splice it to the destination file)
+        off_t dataOffset = 0;
+        size_t dataSize = 0;
+        if(splice)
+        {
+            ssize_t spliced = splicer.SpliceFile(writer.GetFd(), maxSpliceSize, dataOffset);
+            if(spliced < 0 && (splicer.GetErrno() == EINVAL || splicer.GetErrno() == ENOSYS) &&
+               reader.OpenFile(srcDir->GetFd(), srcName, splicer.GetReadOffset(), resumeEndOffset))
+            {
+                // The file (or either file system) can't be spliced, so read
+                // and write the rest of it instead
+                reader.SetSparseBlockSize(mSparseBlockSize);
+                splicer.CloseFile();
+                splice = false;
+                continue;
+            }
+            else if(spliced < 0)
+            {
+                AddFailure(srcPath, "FileSplicer error '" + splicer.GetError() + "' in '" + destDir->GetPath() + "'", splicer.GetErrno());
+                RemoveFailedFiles(destDirs, writeName);
+                return false;
+            }
+            dataSize = spliced;
+        }
+        else
+        {
+            dataOffset = reader.ReadFile(buf, maxReadSize);
+            dataSize = buf.size();
+            if(!reader.IsValid())
+            {
+                AddFailure(srcPath, "FileReader error '" + reader.GetError() + "'", reader.GetErrno());
+                RemoveFailedFiles(destDirs, writeName);
+                return false;
+            }
+        }
+
+        // Wait for our turn if bytes rate is limited
+        throttleSec += mBytesLimit.Consume(dataSize);
+
+        // Hand the data over to the writer threads first.
+        // Note: It waits for the slowest of them to catch up if we have to.
+        std::shared_ptr<const std::string> data;
+        if(fanOut || pipelined)
+        {
+            data = std::make_shared<const std::string>(std::move(buf));
+            if(!asyncWriter.WriteFile(data, dataOffset))
+                break;
+        }
+
+        // Write destination file
+        if(!splice && !pipelined)
+            /*size_t written =*/ writer.WriteFile(fanOut ? *data : buf, dataOffset);
+        if(!writer.IsValid())
+        {
+            AddFailure(srcPath, "FileWriter error '" + writer.GetError() + "' in '" + destDir->GetPath() + "'", writer.GetErrno());
+            RemoveFailedFiles(destDirs, writeName);
+            return false;
+        }
+        mCopiedBytes += dataSize;
+
+        // Let the journal know how far we are with a large file
+        // Note: Extra destinations are written asynchronously, so there is
+        // nothing to checkpoint until the file is done
+        if(journal && !fanOut && !mPublisher)
+        {
+            off_t writtenEnd = (pipelined ? asyncWriter.GetWrittenEnd() : dataOffset + (off_t)dataSize);
+            if(writtenEnd - checkpointOffset >= (off_t)checkpointInterval)
+            {
+                checkpointOffset = writtenEnd;
+                mJournal.AddCheckpoint(srcPath, checkpointOffset, srcStat);
+            }
+        }
+
+//        std::cout << __func__ << ": Offset=" << dataOffset << ": read " << dataSize << ", written " << written << std::endl;
+
+        // Update file reading/writing progress
+        if(updateProgress)
+        {
+            std::unique_lock<std::mutex> lock(mProgressMutex);
+            if(splice)
+                mProgress = (int)(100 * splicer.GetReadSize() / splicer.GetFileSize());
+            else
+                mProgress = (int)(100 * reader.GetReadSize() / reader.GetFileSize());
+        }
+    }
+
+    //std::cout << __func__ << ": Read  total: " << reader.GetReadSize() << std::endl;
+    //std::cout << __func__ << ": Write total: " << writer.GetFileSize() << std::endl;
+
+    if((fanOut || pipelined) && !asyncWriter.CloseFiles())
+    {
+        AddFailure(srcPath, "FileWriter error '" + asyncWriter.GetError() + "'", asyncWriter.GetErrno());
+        RemoveFailedFiles(destDirs, writeName);
+        return false;
+    }
+
+    if(pipelined)
+    {
+        mPipelinedFiles++;
+        mReadStallNanos += asyncWriter.GetFullWaitNanos();
+        mWriteStallNanos += asyncWriter.GetEmptyWaitNanos();
+    }
+
+    // Spliced (or pipelined) data isn't written through the writer, so set
+    // the file size (it also extends the file over the hole at the end of it)
+    if((splice || pipelined) && !writer.TruncateFile(splice ? splicer.GetFileSize() : reader.GetFileSize()))
+    {
+        AddFailure(srcPath, "FileWriter error '" + writer.GetError() + "' in '" + destDir->GetPath() + "'", writer.GetErrno());
+        RemoveFailedFiles(destDirs, writeName);
         return false;
     }
 
-//    std::cout << __func__ << ": From : '" << srcName << "'" << std::endl;
-//    std::cout << __func__ << ": To   : '" << destName << "'" << std::endl;
-//    std::cout << __func__ << ": Sparse Block : " << sparseBlockSize << " bytes" << std::endl;
+    if(mPreserveMetadata && !CopyFileMetadata(splice ? splicer.GetFd() : reader.GetFd(), srcDir, srcName, writer, destDirs, writeName))
+    {
+        RemoveFailedFiles(destDirs, writeName);
+        return false;
+    }
 
-    mSparseBlockSize = sparseBlockSize;
-    bool res = false;
+    // Note: Throttling time is reported separately from the file copy time
+    uint64_t throttleNanos = throttleSec * 1e9;
+    uint64_t copyNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+    mThrottleNanos += throttleNanos;
+    mCopyNanos += (copyNanos > throttleNanos ? copyNanos - throttleNanos : 0);
+    mCopiedFiles++;
 
-    // Reset progress. 
-    // Note: If copying a directory, then set mProgress negative to block
-    // reporting progress until we get complete mTotalDirAndFiles
-    mProgress = -1;
+    if(mPublisher)
+    {
+        // The file is done once it is published in all the destinations
+        off_t fileSize = writer.GetFileSize();
+        writer.CloseFile();
+        PublishFile(srcPath, fileSize, (journal ? &srcStat : nullptr), destDirs, writeName, destName);
+    }
+    else if(journal)
+    {
+        mJournal.AddFile(srcPath, writer.GetFileSize(), srcStat);
+    }
+    return true;
+}
 
-    if((st.st_mode & S_IFMT) == S_IFDIR)
+void DirCopy::PublishFile(const std::string& srcPath, off_t size, const struct stat* srcStat, const std::vector<DirFdPtr>& destDirs,
+                          const std::string& tempName, const std::string& destName)
+{
+    struct PublishState
     {
-        // Make a destination directory (if doesn't exist)
-        std::error_code err;
-        std::filesystem::create_directories(destName, err);
-        if(err)
+        std::atomic<size_t> pending{0};   // Destinations not published yet
+        std::atomic<bool> failed{false};
+        struct stat srcStat;              // Source file status for the journal
+        bool journal{false};
+    };
+    auto state = std::make_shared<PublishState>();
+    state->pending = destDirs.size();
+    if(srcStat)
+    {
+        state->srcStat = *srcStat;
+        state->journal = true;
+    }
+
+    for(const DirFdPtr& destDir : destDirs)
+    {
+        mPublisher->Add(destDir, tempName, destName, [this, state, srcPath, size, destDir](const std::string& err)
         {
-            mErrMsg = "Failed to make '" + destName + "' directory - " + err.message();
-            return 1;
-        }
+            if(!err.empty())
+            {
+                AddFailure(srcPath, "Publish error '" + err + "' in '" + destDir->GetPath() + "'");
+                state->failed = true;
+            }
 
-        // Copy directory
-        res = CopyDir(srcName, destName);
+            if(--state->pending == 0 && !state->failed && state->journal)
+                mJournal.AddFile(srcPath, size, state->srcStat);
+        });
     }
-    else
+}
+
+bool DirCopy::CopyFileMetadata(int srcFd, const DirFdPtr& srcDir, const std::string& srcName,
+                               FileWriter& writer, const std::vector<DirFdPtr>& destDirs, const std::string& destName)
+{
+    std::string srcPath = srcDir->GetPath() + "/" + srcName;
+
+    // Note: Reader has no file open if there was nothing to read
+    FileMetadata metadata;
+    bool res = (srcFd >= 0 ? metadata.Read(srcFd) : false);
+    if(srcFd < 0 && (srcFd = openat(srcDir->GetFd(), srcName.c_str(), O_RDONLY | O_CLOEXEC)) >= 0)
     {
-        // Make file directory (it doesn't exist)
-        char buf[PATH_MAX + 1] {};
-        strcpy(buf, destName.c_str());
-        std::string fileDirName = dirname(buf);
+        res = metadata.Read(srcFd);
+        close(srcFd);
+    }
+    else if(srcFd < 0)
+    {
+        int errNo = errno;
+        AddFailure(srcPath, std::string("Failed to open for metadata - ") + strerror(errNo), errNo);
+        return false;
+    }
 
-        std::error_code err;
-        std::filesystem::create_directories(fileDirName, err);
-        if(err)
+    if(!res)
+    {
+        AddFailure(srcPath, metadata.GetError());
+        return false;
+    }
+
+    // The first destination is still open, the rest are closed by now
+    for(size_t i = 0; i < destDirs.size(); i++)
+    {
+        int destFd = (i == 0 ? writer.GetFd() : openat(destDirs[i]->GetFd(), destName.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+        res = (destFd >= 0 && metadata.Apply(destFd));
+        if(destFd < 0)
         {
-            mErrMsg = "Failed to make '" + fileDirName + "' directory - " + err.message();
-            return 1;
+            int errNo = errno;
+            AddFailure(srcPath, "Failed to open '" + destName + "' in '" + destDirs[i]->GetPath() + "' - " + strerror(errNo), errNo);
         }
-
-        // Copy file
-        res = CopyFile(srcName, destName, true /*updateProgress*/);
+        else if(!res)
+        {
+            AddFailure(srcPath, metadata.GetError() + " in '" + destDirs[i]->GetPath() + "'");
+        }
+        if(i > 0 && destFd >= 0)
+            close(destFd);
+        if(!res)
+            return false;
     }
 
-    return res;
+    return true;
 }
 
-void* DirCopy::OnDirectory(const char* dirName, const char* baseName, void* param)
+bool DirCopy::PreserveDirMetadata(int srcFd, const std::string& srcPath,
+                                  const std::vector<DirFdPtr>& destDirs, const std::vector<DirFdPtr>& parentDestDirs)
 {
-    DirReaderParam* parentDirParam = (DirReaderParam*)param;
-    std::string destDir = parentDirParam->destDir + "/" + baseName;
+    auto metadata = std::make_shared<FileMetadata>();
+    if(!metadata->Read(srcFd))
+    {
+        AddFailure(srcPath, metadata->GetError());
+        return false;
+    }
 
-//    std::cout << __func__ << ": srcDir=" << dirName << "/" << baseName << "/" << std::endl;
-//    std::cout << __func__ << ": destDir=" << destDir << "/" << std::endl;
-//    std::cout << std::endl;
+    // Set the directory metadata once nobody uses it any longer. Since
+    // every directory keeps its parent, parents are done after children.
+    // Note: Making or renaming files changes the directory times, and
+    // chmod() could leave us no write permission, so it has to be the last.
+    for(size_t i = 0; i < destDirs.size(); i++)
+    {
+        DirFdPtr parentDir = (i < parentDestDirs.size() ? parentDestDirs[i] : nullptr);
+        destDirs[i]->SetOnClose([this, metadata, srcPath, parentDir](const DirFd& dir)
+        {
+            if(!mCancelled && !metadata->Apply(dir.GetFd()))
+                AddFailure(srcPath, metadata->GetError() + " in '" + dir.GetPath() + "'");
+        });
+    }
+
+    return true;
+}
+
+// Remove what we have written of the file we failed to copy
+// Note: Without the publisher, the file is written under its real name.
+// We only remove it if the copy goes on without it (so a partly written
+// file doesn't pass for a copy), unless the journal can resume it.
+void DirCopy::RemoveFailedFiles(const std::vector<DirFdPtr>& destDirs, const std::string& writeName)
+{
+    if(!mPublisher && (!mContinueOnError || mJournalOpen))
+        return;
 
-    //std::cout << destDir << "/" << std::endl;
+    for(const DirFdPtr& destDir : destDirs)
+        unlinkat(destDir->GetFd(), writeName.c_str(), 0);
+}
 
+void* DirCopy::OnTarDirectory(const DirFdPtr& dir, const char* baseName, const std::string& tarPath)
+{
     // Update total Dir/Files count
     {
         std::unique_lock<std::mutex> lock(mProgressMutex);
         mTotalDirAndFiles++;
     }
 
-    // Make destination directory
-    std::error_code error;
-    std::filesystem::create_directories(destDir, error);
-    if(error)
+    struct stat st;
+    if(fstatat(dir->GetFd(), baseName, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        mAbort = true;
+        int errNo = errno;
+        AddFailure(dir->GetPath() + "/" + baseName, std::string("Failed to stat - ") + strerror(errNo), errNo);
+        return nullptr;
+    }
+
+    // Directory entry must go before its files, so write it right away
+    if(!PushTarEntry(st, tarPath))
     {
         mAbort = true;
-        SetError("Failed to make '" + destDir + "' directory - " + error.message());
         return nullptr;
     }
 
     // Update saved Dir/Files count and report overall progress
     UpdateProgress();
 
-    // We have new directory now. Create corresponding DirReaderParam
     DirReaderParam* dirParam = new (std::nothrow) DirReaderParam;
     if(!dirParam)
     {
@@ -108,130 +1799,347 @@ void* DirCopy::OnDirectory(const char* dirName, const char* baseName, void* para
         SetError("Out of memory creating DirReaderParam");
         return nullptr;
     }
-    dirParam->destDir = std::move(destDir);
+    dirParam->relPath = tarPath;
 
     return dirParam;
 }
 
-void DirCopy::OnDirectoryEnd(const char* /*dirName*/, void* param)
+bool DirCopy::PushTarEntry(const struct stat& st, const std::string& tarPath)
 {
-    if(param)
-        delete (DirReaderParam*)param;
+    TarStream* tar = mTar;
+
+    TarStream::Entry entry;
+    entry.name = tarPath;
+    entry.type = '5';
+    entry.mode = st.st_mode & 07777;
+    entry.uid = st.st_uid;
+    entry.gid = st.st_gid;
+    entry.mtime = st.st_mtime;
+
+    unsigned long seq = tar->NextSeq();
+    if(!tar->PushHeader(seq, entry) || !tar->PushEnd(seq, 0))
+        return OnOutputAborted();
+
+    return true;
 }
 
-void DirCopy::OnFile(const char* dirName, const char* baseName, void* param)
+void DirCopy::PostCopyFileToTar(const DirFdPtr& srcDir, const std::string& fileName, const std::string& tarPath, unsigned long seq)
 {
-    DirReaderParam* dirParam = (DirReaderParam*)param;
-    std::string srcFile = std::string(dirName) + "/" + baseName;
-    std::string destFile = dirParam->destDir + "/" + baseName;
+    // Note: All files go to the same (FIFO) queue, so they are started in
+    // the archive order, and the file being written is never waiting for
+    // the later ones to make room in the tar stream reorder buffer.
+    mPool->PostToJob(mJobId, 0, [this](const DirFdPtr& srcDir, const std::string& fileName, const std::string& tarPath, unsigned long seq)
+    {
+        if(!CopyFileToTar(srcDir, fileName, tarPath, seq))
+        {
+            mAbort = true;          // Stop reading directories
+            mPool->StopJob(mJobId); // Force other threads to stop
 
-//    std::cout << __func__ << ": srcFile=" << srcFile << std::endl;
-//    std::cout << __func__ << ": destFile=" << destFile << std::endl;
-//    std::cout << std::endl;
+            // Dropped files will never get to the tar stream
+            if(TarStream* tar = mTar)
+                tar->Abort();
+        }
 
-    // Update total Dir/Files count
+        // Update saved Dir/Files count and report overall progress
+        UpdateProgress();
+
+    }, srcDir, fileName, tarPath, seq);
+}
+
+bool DirCopy::CopyFileToTar(const DirFdPtr& srcDir, const std::string& srcName,
+                            const std::string& tarPath, unsigned long seq, bool updateProgress/*=false*/)
+{
+    auto startTime = std::chrono::steady_clock::now();
+    TarStream* tar = mTar;
+    std::string srcPath = srcDir->GetPath() + "/" + srcName;
+
+    // Wait for our turn if files rate is limited
+    double throttleSec = mFilesLimit.Consume(1);
+
+    struct stat st;
+    if(fstatat(srcDir->GetFd(), srcName.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0)
     {
-        std::unique_lock<std::mutex> lock(mProgressMutex);
-        mTotalDirAndFiles++;
+        int errNo = errno;
+        AddFailure(srcPath, std::string("Failed to stat - ") + strerror(errNo), errNo);
+        return false;
     }
 
-    // Post copy file request to thread pool
-    mTpool.Post([this](const std::string& srcFile, const std::string& destFile)
+    FileReader reader;
+    reader.SetReadStrategy(mPreadMaxSize, mMapWindowSize);
+    if(!reader.OpenFile(srcDir->GetFd(), srcName))
     {
-        if(!CopyFile(srcFile, destFile))
-            mTpool.Stop(); // Force other threads to stop
+        AddFailure(srcPath, "FileReader error '" + reader.GetError() + "'", reader.GetErrno());
+        return false;
+    }
+    reader.SetSparseBlockSize(mSparseBlockSize);
 
-        // Update saved Dir/Files count and report overall progress
-        UpdateProgress();
-        
-    }, srcFile, destFile);
+    TarStream::Entry entry;
+    entry.name = tarPath;
+    entry.type = '0';
+    entry.mode = st.st_mode & 07777;
+    entry.uid = st.st_uid;
+    entry.gid = st.st_gid;
+    entry.size = reader.GetFileSize(); // What we have mapped
+    entry.mtime = st.st_mtime;
+
+    static constexpr int maxReadSize = 1024 * 128; // 128KB
+    static constexpr size_t maxKeepSize = 1024 * 1024 * 8; // 8MB
+    std::string buf;
+    std::vector<std::string> segments; // Data found while making the sparse map
+    bool readAgain = (mSparseBlockSize == 0);
+
+    if(mSparseBlockSize > 0)
+    {
+        // Sparse map goes to the entry header, so find all the data segments
+        // first. Keep their data unless the file is large, then read it again.
+        auto& map = entry.sparseMap;
+        size_t keepSize = 0;
+        while(reader.HasMore())
+        {
+            if(mCancelled)
+                return false;
+
+            off_t dataOffset = reader.ReadFile(buf, maxReadSize);
+            if(!reader.IsValid())
+            {
+                AddFailure(srcPath, "FileReader error '" + reader.GetError() + "'", reader.GetErrno());
+                return false;
+            }
+            if(buf.empty())
+                continue; // Hole at the end of file
+
+            if(!map.empty() && map.back().first + map.back().second == dataOffset)
+                map.back().second += buf.size();
+            else
+                map.emplace_back(dataOffset, buf.size());
+
+            keepSize += buf.size();
+            if(readAgain || keepSize > maxKeepSize)
+            {
+                readAgain = true;
+                segments.clear();
+            }
+            else
+            {
+                segments.emplace_back(std::move(buf));
+            }
+        }
+
+        // File size is known from the last segment end, so a hole at the
+        // end of file must be stored as an empty segment
+        if(map.empty() || map.back().first + map.back().second < entry.size)
+            map.emplace_back(entry.size, 0);
+
+        if(readAgain && !reader.OpenFile(srcDir->GetFd(), srcName))
+        {
+            AddFailure(srcPath, "FileReader error '" + reader.GetError() + "'", reader.GetErrno());
+            return false;
+        }
+        reader.SetSparseBlockSize(mSparseBlockSize);
+    }
+
+    if(!tar->PushHeader(seq, entry))
+        return OnOutputAborted();
+
+    // Stream the file data
+    off_t size = 0;
+    for(std::string& segment : segments)
+    {
+        throttleSec += mBytesLimit.Consume(segment.size());
+        size += segment.size();
+        mCopiedBytes += segment.size();
+        if(!tar->PushData(seq, std::move(segment)))
+            return OnOutputAborted();
+    }
+
+    while(readAgain && reader.HasMore())
+    {
+        if(mCancelled)
+            return false;
+
+        reader.ReadFile(buf, maxReadSize);
+        if(!reader.IsValid())
+        {
+            AddFailure(srcPath, "FileReader error '" + reader.GetError() + "'", reader.GetErrno());
+            return false;
+        }
+        if(buf.empty())
+            continue;
+
+        // Wait for our turn if bytes rate is limited
+        throttleSec += mBytesLimit.Consume(buf.size());
+
+        size += buf.size();
+        mCopiedBytes += buf.size();
+        if(!tar->PushData(seq, std::move(buf)))
+            return OnOutputAborted();
+
+        // Update file reading progress
+        if(updateProgress)
+        {
+            std::unique_lock<std::mutex> lock(mProgressMutex);
+            mProgress = (int)(100 * reader.GetReadSize() / reader.GetFileSize());
+        }
+    }
+
+    // Data we pushed must match the header exactly, or the rest of
+    // the archive is garbage
+    off_t dataSize = TarStream::GetDataSize(entry);
+    off_t expectedSize = entry.size;
+    if(!entry.sparseMap.empty())
+    {
+        expectedSize = 0;
+        for(const auto& segment : entry.sparseMap)
+            expectedSize += segment.second;
+    }
+
+    if(size != expectedSize)
+    {
+        AddFailure(srcPath, "File changed while archiving");
+        return false;
+    }
+
+    if(!tar->PushEnd(seq, dataSize))
+        return OnOutputAborted();
+
+    // Note: Throttling time is reported separately from the file copy time
+    uint64_t throttleNanos = throttleSec * 1e9;
+    uint64_t copyNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+    mThrottleNanos += throttleNanos;
+    mCopyNanos += (copyNanos > throttleNanos ? copyNanos - throttleNanos : 0);
+    mCopiedFiles++;
+    return true;
 }
 
-bool DirCopy::CopyDir(const std::string& srcDir, const std::string& destDir)
+bool DirCopy::OnOutputAborted()
 {
-    // Start worker threads
-    mTpool.Create(mThreadCount);
+    std::string err;
+    if(TarStream* tar = mTar)
+        err = tar->GetError();
+    else if(FileSender* sender = mSender)
+        err = sender->GetError();
 
-    // Read directory
-    DirReaderParam dirParam { destDir };
-    if(!Read(srcDir, &dirParam))
+    // Note: Cancelled copy reports its own error
+    if(!mCancelled)
+        SetError(err.empty() ? "Output stream aborted" : err);
+    return false;
+}
+
+void* DirCopy::OnRemoteDirectory(const std::string& relPath)
+{
+    // Update total Dir/Files count
     {
-        mTpool.Stop(); // Force threads to stop
+        std::unique_lock<std::mutex> lock(mProgressMutex);
+        mTotalDirAndFiles++;
     }
-    else
+
+    // Note: The receiver makes file directories anyway, but not the empty ones
+    FileSender* sender = mSender;
+    if(!sender->SendDir(relPath))
     {
-        // Done reading directory (mTotalDirAndFiles has a correct max value)
-        // Worker threads are still running, but we can start reporting a progress
-        std::unique_lock<std::mutex> lock(mProgressMutex);
-        mProgress = 0; // Unblock (start) reporting progress
+        mAbort = true;
+        OnOutputAborted();
+        return nullptr;
     }
 
-    // Wait for threads to complete
-    mTpool.Wait();
-    mTpool.Destroy();
+    // Update saved Dir/Files count and report overall progress
+    UpdateProgress();
 
-    // We should only have errors if we failed
-    return mErrMsg.empty();
+    DirReaderParam* dirParam = new (std::nothrow) DirReaderParam;
+    if(!dirParam)
+    {
+        mAbort = true;
+        SetError("Out of memory creating DirReaderParam");
+        return nullptr;
+    }
+    dirParam->relPath = relPath;
+
+    return dirParam;
 }
 
-bool DirCopy::CopyFile(const std::string& srcFile, const std::string& destFile, bool updateProgress/*=false*/)
+void DirCopy::PostCopyFileToRemote(const DirFdPtr& srcDir, const std::string& fileName, const std::string& relPath)
 {
-//    std::cout << __func__ << ": srcFile=" << srcFile << std::endl;
-//    std::cout << __func__ << ": destFile=" << destFile << std::endl;
-//    std::cout << __func__ << ": sparseBlockSize=" << sparseBlockSize << std::endl;
-//    std::cout << std::endl;
+    mPool->PostToJob(mJobId, 0, [this](const DirFdPtr& srcDir, const std::string& fileName, const std::string& relPath)
+    {
+        if(!CopyFileToRemote(srcDir, fileName, relPath))
+        {
+            mAbort = true;          // Stop reading directories
+            mPool->StopJob(mJobId); // Force other threads to stop
+        }
+
+        // Update saved Dir/Files count and report overall progress
+        UpdateProgress();
+
+    }, srcDir, fileName, relPath);
+}
+
+bool DirCopy::CopyFileToRemote(const DirFdPtr& srcDir, const std::string& srcName,
+                               const std::string& relPath, bool updateProgress/*=false*/)
+{
+    auto startTime = std::chrono::steady_clock::now();
+    FileSender* sender = mSender;
+
+    // Wait for our turn if files rate is limited
+    double throttleSec = mFilesLimit.Consume(1);
 
     FileReader reader;
-    if(!reader.OpenFile(srcFile))
+    reader.SetReadStrategy(mPreadMaxSize, mMapWindowSize);
+    if(!reader.OpenFile(srcDir->GetFd(), srcName))
     {
-        SetError("FileReader error '" + reader.GetError() + "'");
+        AddFailure(srcDir->GetPath() + "/" + srcName, "FileReader error '" + reader.GetError() + "'", reader.GetErrno());
         return false;
     }
     reader.SetSparseBlockSize(mSparseBlockSize);
 
-    FileWriter writer;
-    if(!writer.OpenFile(destFile))
-    {
-        SetError("FileWriter error '" + writer.GetError() + "'");
-        return false;
-    }
+    uint32_t fileId = sender->NextFileId();
+    if(!sender->SendFileOpen(fileId, relPath))
+        return OnOutputAborted();
 
-    // Read in maxReadSize chanks
-    //static constexpr int maxReadSize = 1024 * 1024 * 3; // 3MB
+    // Note: With sparseBlockSize, ReadFile() skips holes, so only data
+    // goes on the wire (with its offset)
     static constexpr int maxReadSize = 1024 * 128; // 128KB
     std::string buf;
 
     while(reader.HasMore())
     {
-        // Read source file
-        off_t dataOffset = reader.ReadFile(buf, maxReadSize);
+        if(mCancelled)
+            return false;
 
-        // Write destination file
-        /*size_t written =*/ writer.WriteFile(buf, dataOffset);
-        if(!writer.IsValid())
+        off_t dataOffset = reader.ReadFile(buf, maxReadSize);
+        if(!reader.IsValid())
         {
-            SetError("FileWriter error '" + writer.GetError() + "'");
+            // Note: The receiver still has to close the file
+            AddFailure(srcDir->GetPath() + "/" + srcName, "FileReader error '" + reader.GetError() + "'", reader.GetErrno());
+            sender->SendFileEnd(fileId, reader.GetFileSize());
             return false;
         }
+        if(buf.empty())
+            continue; // Hole at the end of file
 
-//        std::cout << __func__ << ": Offset=" << dataOffset << ": read " << buf.size() << ", written " << written << std::endl;
+        // Wait for our turn if bytes rate is limited
+        throttleSec += mBytesLimit.Consume(buf.size());
 
-        // Update file reading/writing progress
+        if(!sender->SendFileData(fileId, dataOffset, buf))
+            return OnOutputAborted();
+        mCopiedBytes += buf.size();
+
+        // Update file reading progress
         if(updateProgress)
         {
-            int progress = (int)(100 * reader.GetReadSize() / reader.GetFileSize());
-            if(progress != mProgress)
-            {
-                mProgress = progress;
-//                std::cout << progress << '%' << (mProgress == 100 ? '\n' : ' ') << std::flush;
-                std::cout << '\r' << "Progress: " << progress << '%' << (mProgress == 100 ? '\n' : ' ') << std::flush;
-            }
+            std::unique_lock<std::mutex> lock(mProgressMutex);
+            mProgress = (int)(100 * reader.GetReadSize() / reader.GetFileSize());
         }
     }
 
-    //std::cout << __func__ << ": Read  total: " << reader.GetReadSize() << std::endl;
-    //std::cout << __func__ << ": Write total: " << writer.GetFileSize() << std::endl;
+    if(!sender->SendFileEnd(fileId, reader.GetFileSize()))
+        return OnOutputAborted();
 
+    // Note: Throttling time is reported separately from the file copy time
+    uint64_t throttleNanos = throttleSec * 1e9;
+    uint64_t copyNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+    mThrottleNanos += throttleNanos;
+    mCopyNanos += (copyNanos > throttleNanos ? copyNanos - throttleNanos : 0);
+    mCopiedFiles++;
     return true;
 }
 
@@ -244,14 +2152,112 @@ void DirCopy::UpdateProgress()
     if(mProgress < 0)
         return;
 
-    int progress = (int)(100 * mSavedDirAndFiles / mTotalDirAndFiles);
+    mProgress = (int)(100 * mSavedDirAndFiles / mTotalDirAndFiles);
+}
+
+DirCopy::Stats DirCopy::GetStats()
+{
+    Stats stats;
+    {
+        std::unique_lock<std::mutex> lock(mProgressMutex);
+        stats.found = mTotalDirAndFiles;
+        stats.done = mSavedDirAndFiles;
+        stats.progress = mProgress;
+        stats.scanDone = (mProgress >= 0);
+    }
+
+    stats.files = mCopiedFiles;
+    stats.bytes = mCopiedBytes;
+    stats.seconds = GetElapsedSeconds();
+    if(stats.seconds > 0)
+    {
+        stats.bytesPerSec = stats.bytes / stats.seconds;
+        stats.filesPerSec = stats.files / stats.seconds;
+    }
+    return stats;
+}
+
+std::vector<DirCopy::Failure> DirCopy::GetFailures()
+{
+    std::unique_lock<std::mutex> lock(mErrMsgMutex);
+    return mFailures;
+}
+
+void DirCopy::RunConcurrencyController()
+{
+    ConcurrencyController controller(mMinThreads, mMaxThreads, mThreadCount);
+    mTpool.SetActiveCount(controller.GetThreads());
+
+    size_t lastFiles = mCopiedFiles;
+    size_t lastBytes = mCopiedBytes;
+    uint64_t lastNanos = mCopyNanos;
+    auto lastTime = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(mControllerMutex);
+    while(!mControllerStop)
+    {
+        mControllerCv.wait_for(lock, std::chrono::milliseconds(mAdaptiveIntervalMs));
+        if(mControllerStop)
+            break;
+
+        // Measure the last interval
+        size_t files = mCopiedFiles;
+        size_t bytes = mCopiedBytes;
+        uint64_t nanos = mCopyNanos;
+        auto now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - lastTime).count();
+
+        Metrics::ThreadDecision decision;
+        decision.time = std::chrono::duration<double>(now - mStartTime).count();
+        decision.bytesPerSec = (bytes - lastBytes) / seconds;
+        decision.filesPerSec = (files - lastFiles) / seconds;
+        decision.latencyMs = (files > lastFiles ? (nanos - lastNanos) / 1e6 / (files - lastFiles) : 0);
+
+        int threads = controller.GetThreads();
+        decision.threads = controller.Update(decision.bytesPerSec, decision.filesPerSec, decision.latencyMs);
+        if(decision.threads != threads)
+            mTpool.SetActiveCount(decision.threads);
+
+        // Note: mMetrics is only read once the copy is done
+        mMetrics.threadDecisions.push_back(decision);
+
+        lastFiles = files;
+        lastBytes = bytes;
+        lastNanos = nanos;
+        lastTime = now;
+    }
+}
+
+void DirCopy::AddFailure(const std::string& path, const std::string& err, int errNo /*=0*/)
+{
+    // Failure of the file this thread is copying is held until we know
+    // if it is retried (only the first one counts)
+    // Note: Other failures (i.e. of other files published by this thread)
+    // are added right away
+    if(fileAttempt.copy == this && fileAttempt.failure->path == path)
+    {
+        if(fileAttempt.failure->error.empty())
+        {
+            fileAttempt.failure->error = err;
+            fileAttempt.failure->errNo = errNo;
+        }
+        return;
+    }
+
+    Failure failure;
+    failure.path = path;
+    failure.error = err;
+    failure.errNo = errNo;
+    CommitFailure(failure);
+}
 
-    if(progress != mProgress)
+void DirCopy::CommitFailure(const Failure& failure)
+{
     {
-        mProgress = progress;
-//        std::cout << progress << '%' << (mProgress == 100 ? '\n' : ' ') << std::flush;
-        std::cout << '\r' << "Progress: " << progress << '%' << (mProgress == 100 ? '\n' : ' ') << std::flush;
+        std::unique_lock<std::mutex> lock(mErrMsgMutex);
+        mFailures.push_back(failure);
     }
+    SetError(failure.error + " (" + failure.path + ")");
 }
 
 void DirCopy::SetError(const std::string& err)
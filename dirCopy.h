@@ -6,7 +6,25 @@
 
 #include "dirReader.h"
 #include "threadPool.h"
+#include "tokenBucket.h"
+#include "tarStream.h"
+#include "fileSender.h"
+#include "copyJournal.h"
+#include "filePublisher.h"
+#include "fileMetadata.h"
+#include "fileReader.h"
+#include "fileWriter.h"
+#include "dirWatcher.h"
 #include <mutex>
+#include <vector>
+#include <map>
+#include <set>
+#include <functional>   // std::function
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <sys/types.h>  // dev_t
+#include <sys/stat.h>   // struct stat
 
 class DirCopy : public DirReader
 {
@@ -14,21 +32,338 @@ public:
     DirCopy(int threadCount=4) : mThreadCount(threadCount) {}
     virtual ~DirCopy() = default;
 
-    bool Copy(const std::string& srcDir, const std::string& destDir, size_t sparseBlockSize=0);
+    // Live copy statistics (can be polled while copying)
+    struct Stats
+    {
+        size_t found{0};        // Directories and files found so far
+        size_t done{0};         // Directories and files done so far
+        bool scanDone{false};   // Done reading the source tree (found is final)
+        int progress{-1};       // Percentage done (-1 until known)
+        size_t files{0};        // Files copied
+        size_t bytes{0};        // Bytes copied (excluding sparse holes)
+        double seconds{0};      // Time since the copy start
+        double bytesPerSec{0};  // Average rates since the copy start
+        double filesPerSec{0};
+    };
+
+    // File (or directory) we failed to copy
+    struct Failure
+    {
+        std::string path;       // Source path
+        std::string error;
+        int errNo{0};           // System error (0 - not a system call error)
+        int attempts{1};        // Times we tried to copy the file
+    };
+
+    // Copy statistics
+    struct Metrics
+    {
+        size_t files{0};        // Files copied
+        size_t bytes{0};        // Bytes copied (excluding sparse holes)
+        double seconds{0};      // Total copy time
+        double throttleSeconds{0}; // Time all threads spent waiting for rate limits
+        size_t skippedFiles{0}; // Files copied before (resume mode)
+        size_t skippedBytes{0};
+        std::vector<size_t> filterMatches;  // Matches of every filter rule...
+        size_t excludedFiles{0};        // ...files skipped by the filter...
+        size_t prunedDirs{0};           // ...and directories not read at all
+        size_t watchBatches{0};         // Watch mode: copies of the changed files...
+        size_t watchRescans{0};         // ...of them after events were lost
+        size_t cachedFiles{0};          // Found in the page cache (Cache schedule)
+        size_t pipelinedFiles{0};       // Large files read and written at the same time...
+        double readStallSeconds{0};     // ...time reads waited for writes to catch up
+        double writeStallSeconds{0};    // ...time writes waited for data to be read
+        size_t retries{0};              // File copies retried after transient errors
+
+        // Adaptive concurrency controller decisions
+        struct ThreadDecision
+        {
+            double time{0};         // Seconds since the copy start
+            int threads{0};         // New active threads count
+            double bytesPerSec{0};  // Measured over the last interval...
+            double filesPerSec{0};
+            double latencyMs{0};    // ...average file copy time
+        };
+        std::vector<ThreadDecision> threadDecisions;
+    };
+
+    bool Copy(const std::string& srcDir, const std::string& destDir, size_t sparseBlockSize=0)
+    {
+        return Copy(srcDir, std::vector<std::string> { destDir }, sparseBlockSize);
+    }
+
+    // Copy to several destinations at once. Source is read only once, and
+    // all the destinations are written at the same time (as fast as the
+    // slowest of them). When copying a file, destinations must have the
+    // same file name.
+    bool Copy(const std::string& srcDir, const std::vector<std::string>& destDirs, size_t sparseBlockSize=0);
+
+    // Write the source directory (or file) as a single POSIX tar (pax) stream
+    // to tarFd (i.e. a pipe) instead of copying it. Files are still read by
+    // all the threads, but written in the directory reader order.
+    // With sparseBlockSize, only file data (non-zero blocks) is stored.
+    // Note: Schedule is ignored, since entries are written as they are found.
+    bool CopyToTar(const std::string& srcName, int tarFd, size_t sparseBlockSize=0);
+
+    // Send the source directory (or file) to the receiver (see fileReceiver.h)
+    // at address ("host:port" or "unix:<path>") over connectionCount connections.
+    // With sparseBlockSize, holes (zero blocks) are not sent.
+    // Note: Schedule is ignored, files are sent as they are found.
+    bool CopyToRemote(const std::string& srcName, const std::string& address,
+                      int connectionCount=4, size_t sparseBlockSize=0);
+
+    // Skip source files and directories the filter excludes (see pathFilter.h)
+    // Note: The filter must stay alive until the copy is done.
+    void SetPathFilter(const PathFilter* filter) { mPathFilter = filter; }
+
+    // Mirror srcDir to destDirs: copy it, then keep copying files and
+    // directories changed in srcDir (see dirWatcher.h) in batches of changes
+    // coalesced over coalesceMs, until cancelled (or failed).
+    // Note: Files removed from srcDir are not removed from destDirs, and the
+    // journal (if any) is only used for the initial copy.
+    bool Watch(const std::string& srcDir, const std::vector<std::string>& destDirs,
+               size_t sparseBlockSize=0, int coalesceMs=500);
+
+    // Record copied files (and how far large files got) in the journal file,
+    // so a copy that was cancelled (or died) can be resumed. In resume mode,
+    // files the journal has as copied (with the same size) are skipped and
+    // partially copied files continue from their last checkpoint.
+    // Note: Only Copy() uses the journal, not CopyToTar() or CopyToRemote().
+    void SetJournal(const std::string& journalFile, bool resume)
+    {
+        mJournalFile = journalFile;
+        mJournalResume = resume;
+    }
+
+    // Write files under temporary names and rename them in place in batches
+    // of batchSize files, once the batch data is on disk (see filePublisher.h),
+    // so files are never seen half-written.
+    // Note: Only Copy() publishes files, and a journal has no checkpoints then.
+    void SetAtomicPublish(bool enable, FilePublisher::Durability durability=FilePublisher::Durability::Syncfs, size_t batchSize=256)
+    {
+        mPublishEnabled = enable;
+        mPublishDurability = durability;
+        mPublishBatchSize = batchSize;
+    }
+
+    // Preserve files and directories mode, ownership, timestamps and
+    // extended attributes (including ACLs). File metadata is set right after
+    // the file data is written, and directory metadata once everything in
+    // the directory (including its sub-directories) is done.
+    // Note: Only Copy() preserves metadata.
+    void SetPreserveMetadata(bool preserve) { mPreserveMetadata = preserve; }
+
+    // Read files up to preadMaxSize bytes at once, and map larger files
+    // mapWindowSize bytes at a time (see FileReader::SetReadStrategy)
+    void SetReadStrategy(size_t preadMaxSize, size_t mapWindowSize)
+    {
+        mPreadMaxSize = preadMaxSize;
+        mMapWindowSize = mapWindowSize;
+    }
+
+    // Read and write files of minSize bytes or more at the same time: the
+    // copy thread reads them, and writer threads write them (up to depth
+    // chunks behind). Depth 0 disables it (default).
+    // Note: The splice engine doesn't use it.
+    void SetPipeline(size_t depth, size_t minSize=8*1024*1024)
+    {
+        mPipelineDepth = depth;
+        mPipelineMinSize = minSize;
+    }
+
+    // How file data is copied
+    enum class CopyEngine
+    {
+        User,   // Read (FileReader) and written (FileWriter) by the copy threads (default)
+        Splice  // Spliced by the kernel through a pipe (FileSplicer), holes are kept.
+                // Note: Used for a single destination only.
+    };
+    void SetCopyEngine(CopyEngine engine) { mCopyEngine = engine; }
+
+    // Run own threads on the given CPUs only (nullptr - any CPU)
+    void SetCpuAffinity(const cpu_set_t* cpus)
+    {
+        mHasCpus = (cpus != nullptr);
+        if(cpus)
+            mCpus = *cpus;
+    }
+
+    // Where own threads run (and allocate their buffers) on a NUMA host
+    enum class NumaPlacement
+    {
+        None,   // Anywhere (default)
+        Source, // On the node of the source device
+        Dest    // On the node of the (first) destination device
+    };
+    // Note: Threads writing destinations (extra destinations and pipelined
+    // files) always run on the node of their destination device. If the
+    // device node is not known, threads run anywhere (on the CPU affinity).
+    void SetNumaPlacement(NumaPlacement placement) { mNumaPlacement = placement; }
+
+    // By default, the first file (or directory) we fail to copy stops the
+    // copy. With continueOnError, the copy goes on, and all the failures are
+    // reported once it is done (see GetFailures). Files failing with a
+    // transient error (i.e. EIO or EAGAIN) are copied again up to retryCount
+    // times, retryDelayMs later (doubled every time), and copy threads go on
+    // with other files in the meantime.
+    // Note: Only Copy() and Watch(), not CopyToTar() or CopyToRemote().
+    void SetErrorPolicy(bool continueOnError, int retryCount=0, int retryDelayMs=100)
+    {
+        mContinueOnError = continueOnError;
+        mRetryCount = retryCount;
+        mRetryDelayMs = retryDelayMs;
+    }
+
+    // Cancel the current (or the next) Copy(). It can be called by any thread.
+    void Cancel();
+    bool WasCancelled() { return mWasCancelled; } // Was the last Copy() cancelled?
+
+    // Order in which files are scheduled for copying
+    enum class Schedule
+    {
+        Fifo,   // As soon as they are found by the directory reader (default)
+        Inode,  // By inode number (in batches of files as the source tree is read)
+        Extent, // By first physical extent (FIEMAP, in batches as Inode)
+        Cache   // Files in the page cache as soon as they are found (through their own
+                // queue), the rest by first physical extent (as Extent)
+    };
+
+    // Files are copied through a separate queue per source/destination
+    // devices pair, and each queue copies up to deviceThreadCount files at
+    // the same time (0 - default, no limit for Fifo and 2 for Inode and Extent)
+    void SetSchedule(Schedule schedule, int deviceThreadCount=0)
+    {
+        mSchedule = schedule;
+        mDeviceThreadCount = deviceThreadCount;
+    }
+
+    // Override the number of files copied at the same time from/to the
+    // given device (i.e. to keep a slow HDD from being overloaded)
+    void SetDeviceThreads(dev_t dev, int threadCount) { mDeviceThreads[dev] = threadCount; }
+
+    // Copy with (already created) threads of the pool shared with other
+    // copies instead of own threads. Files of a higher priority copy are
+    // copied first, and copies of the same priority share threads in
+    // proportion to their weights.
+    // Note: Adaptive concurrency is not supported with a shared pool.
+    void SetThreadPool(ThreadPool* sharedPool, int priority=0, int weight=1)
+    {
+        mPool = (sharedPool ? sharedPool : &mTpool);
+        mJobPriority = priority;
+        mJobWeight = weight;
+    }
+
+    // Let the adaptive concurrency controller pick the number of active
+    // threads (between minThreads and maxThreads) based on the throughput
+    // and latency measured every intervalMs. Thread count passed to the
+    // constructor is used as a starting point.
+    void SetAdaptiveThreads(int minThreads, int maxThreads, int intervalMs=1000)
+    {
+        mMinThreads = minThreads;
+        mMaxThreads = maxThreads;
+        mAdaptiveIntervalMs = intervalMs;
+    }
+
+    // Limit copy bytes and files rates (per second, 0 - no limit).
+    // Note: It can be called at any time, including while copying.
+    void SetRateLimits(double bytesPerSec, double filesPerSec)
+    {
+        mBytesLimit.SetRate(bytesPerSec);
+        mFilesLimit.SetRate(filesPerSec);
+    }
+    double GetBytesRateLimit() { return mBytesLimit.GetRate(); }
+    double GetFilesRateLimit() { return mFilesLimit.GetRate(); }
+
+    // Average copy rates (per second) since the copy start
+    double GetCurrentBytesRate() { return mCopiedBytes / GetElapsedSeconds(); }
+    double GetCurrentFilesRate() { return mCopiedFiles / GetElapsedSeconds(); }
+
+    const Metrics& GetMetrics() { return mMetrics; }
+    Stats GetStats();
+    std::vector<Failure> GetFailures();
 
 private:
-    virtual void* OnDirectory(const char* dirName, const char* baseName, void* param) override;
-    virtual void OnDirectoryEnd(const char* /*dirName*/, void* param) override;
-    virtual void OnFile(const char* dirName, const char* baseName, void* param) override;
+    virtual void* OnDirectory(const DirFdPtr& dir, const char* baseName, void* param) override;
+    virtual void OnDirectoryEnd(const DirFdPtr& /*dir*/, void* param) override;
+    virtual void OnFile(const DirFdPtr& dir, const char* baseName, void* param) override;
+    virtual bool OnDirectoryError(const std::string& path, const std::string& err, int errNo) override;
 
-    bool CopyDir(const std::string& srcDir, const std::string& destDir);
-    bool CopyFile(const std::string& srcFile, const std::string& destFile, bool updateProgress=false);
+    struct DirReaderParam;
+    bool BeginCopy(const std::string& srcName, size_t sparseBlockSize);
+    bool EndCopy(bool res);
+    bool OpenJournal(const std::vector<std::string>& destDirs);
+    bool CopyDir(const std::string& srcDir, const std::vector<std::string>& destDirs);
+    bool CopyTree(const std::string& srcDir, DirReaderParam& dirParam);
+    bool RunCopyJob(const std::function<bool()>& readTree);
+    void StartWriters(const std::vector<std::string>& destNames);
+    void PlacePool(ThreadPool& pool, const std::string& path);
+    void StopWriters();
+    struct ChangedDir;
+    bool CopyChanges(const std::string& srcDir, const std::vector<std::string>& destNames,
+                     const DirWatcher::Changes& changes, size_t sparseBlockSize);
+    ChangedDir* OpenChangedDir(const std::string& srcDir, const std::vector<std::string>& destNames,
+                               const std::string& relPath, std::map<std::string, ChangedDir>& dirs);
+    bool CopyFile(const DirFdPtr& srcDir, const std::string& srcName,
+                  const std::vector<DirFdPtr>& destDirs, const std::string& destName, bool updateProgress=false);
+    void PublishFile(const std::string& srcPath, off_t size, const struct stat* srcStat, const std::vector<DirFdPtr>& destDirs,
+                     const std::string& tempName, const std::string& destName);
+    void RemoveFailedFiles(const std::vector<DirFdPtr>& destDirs, const std::string& writeName);
+    bool CopyFileMetadata(int srcFd, const DirFdPtr& srcDir, const std::string& srcName,
+                          FileWriter& writer, const std::vector<DirFdPtr>& destDirs, const std::string& destName);
+    bool PreserveDirMetadata(int srcFd, const std::string& srcPath,
+                             const std::vector<DirFdPtr>& destDirs, const std::vector<DirFdPtr>& parentDestDirs);
+    void PostCopyFile(unsigned long queueId, const DirFdPtr& srcDir, const std::vector<DirFdPtr>& destDirs, const std::string& fileName,
+                      int attempt=0);
+    void WaitQueueRoom();
+    void RetryCopyFile(unsigned long queueId, const DirFdPtr& srcDir, const std::vector<DirFdPtr>& destDirs, const std::string& fileName,
+                       int attempt);
+    void RunRetryScheduler();
+    bool WaitRetries();
+    void* OnTarDirectory(const DirFdPtr& dir, const char* baseName, const std::string& tarPath);
+    bool PushTarEntry(const struct stat& st, const std::string& tarPath);
+    bool CopyFileToTar(const DirFdPtr& srcDir, const std::string& srcName,
+                       const std::string& tarPath, unsigned long seq, bool updateProgress=false);
+    void PostCopyFileToTar(const DirFdPtr& srcDir, const std::string& fileName, const std::string& tarPath, unsigned long seq);
+    void* OnRemoteDirectory(const std::string& relPath);
+    void PostCopyFileToRemote(const DirFdPtr& srcDir, const std::string& fileName, const std::string& relPath);
+    bool CopyFileToRemote(const DirFdPtr& srcDir, const std::string& srcName,
+                          const std::string& relPath, bool updateProgress=false);
+    bool OnOutputAborted();
+    unsigned long GetQueueId(const DirFdPtr& srcDir, const std::vector<DirFdPtr>& destDirs, bool cached=false);
+    void ScheduleFile(const DirFdPtr& srcDir, const std::vector<DirFdPtr>& destDirs, const char* fileName);
+    bool ScheduleCachedFile(const DirFdPtr& srcDir, const std::vector<DirFdPtr>& destDirs, const char* fileName);
+    struct FileTask;
+    void AddScheduledTask(unsigned long queueId, FileTask&& task);
+    void DispatchScheduledFiles();
     void UpdateProgress();
+    void AddFailure(const std::string& path, const std::string& err, int errNo=0);
+    void CommitFailure(const Failure& failure);
+    void AbortOnFailure() { if(!mContinueOnError) mAbort = true; } // Stop reading directories
+    void RunConcurrencyController();
+    double GetElapsedSeconds() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - mStartTime).count(); }
     inline void SetError(const std::string& err);
 
     struct DirReaderParam
     {
-        std::string destDir;
+        std::vector<DirFdPtr> destDirs;
+        std::string relPath;    // Directory path in the archive (tar mode) or on the receiver (remote mode)
+        bool changedOnly{false};// Only copy files changed since mChangedSince (watch mode rescan)
+    };
+
+    // Source directory with changed files and its destination directories (watch mode)
+    struct ChangedDir
+    {
+        DirFdPtr srcDir;
+        DirReaderParam param;
+    };
+
+    // File copy request ordered by its physical layout on the source device
+    struct FileTask
+    {
+        uint64_t key{0};        // Inode number or physical offset of the first extent
+        DirFdPtr srcDir;
+        std::vector<DirFdPtr> destDirs;
+        std::string fileName;
     };
 
 private:
@@ -38,8 +373,84 @@ private:
     int mProgress{-1};
     std::mutex mProgressMutex;
     std::mutex mErrMsgMutex;
-    ThreadPool mTpool;
+    std::vector<Failure> mFailures;
+    std::atomic<bool> mCancelled{false};
+    bool mWasCancelled{false};
+    ThreadPool mTpool;                      // Own threads
+    ThreadPool* mPool{&mTpool};             // Own or shared threads
+    std::vector<std::unique_ptr<ThreadPool>> mDestPools; // Extra destinations writers threads
+    std::unique_ptr<ThreadPool> mWritePool; // Pipelined files writers threads
+    std::atomic<unsigned long> mJobId{0};   // Our job in mPool (0 - none)
+    int mJobPriority{0};
+    int mJobWeight{1};
     int mThreadCount{0};
+    std::atomic<TarStream*> mTar{nullptr};  // Tar stream we write to (tar mode)
+    std::atomic<FileSender*> mSender{nullptr}; // Receiver we send to (remote mode)
+    std::string mJournalFile;               // Empty - no journal
+    bool mJournalResume{false};
+    CopyJournal mJournal;
+    bool mJournalOpen{false};
+    bool mPublishEnabled{false};
+    FilePublisher::Durability mPublishDurability{FilePublisher::Durability::Syncfs};
+    size_t mPublishBatchSize{256};
+    std::unique_ptr<FilePublisher> mPublisher; // Publishes written files (atomic publish mode)
+    bool mPreserveMetadata{false};
+    size_t mPreadMaxSize{FileReader::defaultPreadMaxSize};
+    size_t mMapWindowSize{FileReader::defaultMapWindowSize};
+    CopyEngine mCopyEngine{CopyEngine::User};
+    size_t mPipelineDepth{0};
+    size_t mPipelineMinSize{0};
+    const PathFilter* mPathFilter{nullptr};
+    cpu_set_t mCpus{};
+    bool mHasCpus{false};
+    NumaPlacement mNumaPlacement{NumaPlacement::None};
+    std::string mSrcName;                   // Copy source and the (first) destination
+    std::string mDestName;                  // (where own threads are placed)
+    struct timespec mChangedSince{};        // Watch mode rescan: files changed since then
+    bool mContinueOnError{false};
+    int mRetryCount{0};
+    int mRetryDelayMs{100};
+    std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> mRetries; // Files to copy again (when)
+    std::mutex mRetryMutex;
+    std::condition_variable mRetryCv;
+    bool mRetryStop{false};
+    size_t mRetriesPosted{0};   // Posted back to the pool (not waited for yet)
+    std::atomic<size_t> mRetriedFiles{0};
+
+    Schedule mSchedule{Schedule::Fifo};
+    int mDeviceThreadCount{0};
+    std::map<dev_t, int> mDeviceThreads;                            // Per device threads count overrides
+    std::map<std::vector<dev_t>, unsigned long> mQueueIds;          // Source/destination devices to queue
+    std::map<unsigned long, std::vector<FileTask>> mScheduledTasks; // Per queue files in layout order
+    size_t mScheduledFiles{0};                                      // Files in the current batch...
+    size_t mScheduledDirs{0};                                       // ...and their directories
+    const DirFd* mLastScheduledDir{nullptr};
+
+    // Copy statistics
+    Metrics mMetrics;
+    std::chrono::steady_clock::time_point mStartTime;
+    std::atomic<size_t> mCopiedFiles{0};
+    std::atomic<size_t> mCopiedBytes{0};
+    std::atomic<size_t> mSkippedFiles{0};
+    std::atomic<size_t> mSkippedBytes{0};
+    std::atomic<uint64_t> mCopyNanos{0};    // Sum of all files copy time (excluding throttling)
+    std::atomic<uint64_t> mThrottleNanos{0};
+    std::atomic<size_t> mCachedFiles{0};
+    std::atomic<size_t> mPipelinedFiles{0};
+    std::atomic<uint64_t> mReadStallNanos{0};  // Pipelined files stall times
+    std::atomic<uint64_t> mWriteStallNanos{0};
+
+    // I/O throttling shared by all threads
+    TokenBucket mBytesLimit;
+    TokenBucket mFilesLimit;
+
+    // Adaptive concurrency
+    int mMinThreads{0};
+    int mMaxThreads{0};                     // 0 - adaptive concurrency is disabled
+    int mAdaptiveIntervalMs{1000};
+    bool mControllerStop{false};
+    std::mutex mControllerMutex;
+    std::condition_variable mControllerCv;
 };
 
 #endif // __DIR_COPY_H__
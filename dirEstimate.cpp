@@ -0,0 +1,330 @@
+//
+// dirEstimate.cpp
+//
+#include "dirEstimate.h"
+#include <fcntl.h>          // openat(), posix_fadvise()
+#include <sys/stat.h>       // statx()
+#include <unistd.h>         // read(), write(), fdatasync()
+#include <string.h>         // strerror()
+#include <stdint.h>         // UINT64_MAX
+#include <chrono>
+#include <filesystem>       // std::filesystem
+
+// Files are stat'ed in batches of the same directory files
+static constexpr size_t batchSize = 256;
+
+static double GetSeconds(std::chrono::steady_clock::time_point startTime)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+bool DirEstimate::Estimate(const std::string& srcName, const std::string& destDir, bool calibrate /*=true*/,
+                           size_t calibrationSize /*=64MB*/)
+{
+    mErrMsg.clear();
+    mAbort = false;
+    mResult = Result();
+    mLargestDir.reset();
+    mLargestName.clear();
+    mLargestSize = 0;
+
+    // Files up to 0, 4K, 16K, ... 1G and the rest
+    mResult.histogram.push_back(SizeBucket());
+    for(uint64_t maxSize = 4096; maxSize <= 1024 * 1024 * 1024; maxSize *= 4)
+        mResult.histogram.push_back(SizeBucket { maxSize, 0, 0 });
+    mResult.histogram.push_back(SizeBucket { UINT64_MAX, 0, 0 });
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    // Are we estimating a file or a directory?
+    struct statx stx;
+    if(statx(AT_FDCWD, srcName.c_str(), 0, STATX_TYPE, &stx) != 0)
+    {
+        mErrMsg = "statx() failed for '" + srcName + "': " + strerror(errno);
+        return false;
+    }
+
+    if(S_ISDIR(stx.stx_mode))
+    {
+        mResult.dirs = 1; // The source directory itself
+        mPool.Create(mThreadCount);
+
+        Batch root;
+        SetFilter(mPathFilter, srcName);
+        if(Read(srcName, &root))
+            PostBatch(root);
+
+        mPool.Wait();
+        mPool.Destroy();
+    }
+    else
+    {
+        std::filesystem::path path(srcName);
+        std::string dirName = (path.has_parent_path() ? path.parent_path().string() : ".");
+        DirFdPtr dir = OpenDir(AT_FDCWD, dirName.c_str(), dirName, mErrMsg);
+        if(dir)
+            StatFiles(dir, { path.filename().string() });
+    }
+
+    mResult.scanSeconds = GetSeconds(startTime);
+    if(!mErrMsg.empty())
+        return false;
+
+    if(calibrate && !Calibrate(destDir, calibrationSize))
+        return false;
+
+    // Files are made concurrently by all the threads, but the data is
+    // (at best) as fast as the slower of the source and destination.
+    // Note: Calibration is single threaded, so it is rather pessimistic.
+    double bytesPerSec = mResult.readBytesPerSec;
+    if(bytesPerSec <= 0 || (mResult.writeBytesPerSec > 0 && mResult.writeBytesPerSec < bytesPerSec))
+        bytesPerSec = mResult.writeBytesPerSec;
+    if(bytesPerSec > 0)
+        mResult.seconds = mResult.bytes / bytesPerSec;
+    mResult.seconds += mResult.fileSeconds * mResult.files / mThreadCount;
+
+    return true;
+}
+
+void* DirEstimate::OnDirectory(const DirFdPtr& /*dir*/, const char* /*baseName*/, void* /*param*/)
+{
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mResult.dirs++;
+    }
+
+    return new (std::nothrow) Batch;
+}
+
+void DirEstimate::OnDirectoryEnd(const DirFdPtr& /*dir*/, void* param)
+{
+    if(!param)
+        return;
+
+    // Stat the rest of the directory files
+    Batch* batch = (Batch*)param;
+    PostBatch(*batch);
+    delete batch;
+}
+
+void DirEstimate::OnFile(const DirFdPtr& dir, const char* baseName, void* param)
+{
+    Batch* batch = (Batch*)param;
+    if(!batch)
+        return;
+
+    batch->dir = dir;
+    batch->names.emplace_back(baseName);
+    if(batch->names.size() >= batchSize)
+        PostBatch(*batch);
+}
+
+void DirEstimate::PostBatch(Batch& batch)
+{
+    if(batch.names.empty())
+        return;
+
+    mPool.Post([this](const DirFdPtr& dir, const std::vector<std::string>& names)
+    {
+        StatFiles(dir, names);
+    }, std::move(batch.dir), std::move(batch.names));
+
+    batch.dir.reset();
+    batch.names.clear();
+}
+
+void DirEstimate::StatFiles(const DirFdPtr& dir, const std::vector<std::string>& names)
+{
+    // Collect the batch results locally and merge them once
+    Result result;
+    result.histogram = std::vector<SizeBucket>(mResult.histogram.size());
+    for(size_t i = 0; i < result.histogram.size(); i++)
+        result.histogram[i].maxSize = mResult.histogram[i].maxSize;
+
+    const std::string* largestName = nullptr;
+    uint64_t largestSize = 0;
+
+    for(const std::string& name : names)
+    {
+        // Note: Don't make a network file system fetch what we don't need
+        struct statx stx;
+        if(statx(dir->GetFd(), name.c_str(), AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                 STATX_TYPE | STATX_SIZE | STATX_BLOCKS, &stx) != 0 || !S_ISREG(stx.stx_mode))
+        {
+            continue; // Gone or not a regular file
+        }
+
+        // Note: Holes are blocks that are not allocated, not the block rounding
+        uint64_t allocated = stx.stx_blocks * 512;
+        AddFile(stx.stx_size, allocated, result);
+        if(allocated + stx.stx_blksize <= stx.stx_size)
+        {
+            result.sparseFiles++;
+            result.sparseBytes += stx.stx_size - allocated;
+        }
+
+        if(stx.stx_size > largestSize)
+        {
+            largestName = &name;
+            largestSize = stx.stx_size;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mResult.files += result.files;
+    mResult.bytes += result.bytes;
+    mResult.allocatedBytes += result.allocatedBytes;
+    mResult.sparseFiles += result.sparseFiles;
+    mResult.sparseBytes += result.sparseBytes;
+    for(size_t i = 0; i < result.histogram.size(); i++)
+    {
+        mResult.histogram[i].files += result.histogram[i].files;
+        mResult.histogram[i].bytes += result.histogram[i].bytes;
+    }
+
+    if(largestName && largestSize > mLargestSize)
+    {
+        mLargestDir = dir;
+        mLargestName = *largestName;
+        mLargestSize = largestSize;
+    }
+}
+
+void DirEstimate::AddFile(uint64_t size, uint64_t allocated, Result& result)
+{
+    result.files++;
+    result.bytes += size;
+    result.allocatedBytes += allocated;
+
+    for(SizeBucket& bucket : result.histogram)
+    {
+        if(size <= bucket.maxSize)
+        {
+            bucket.files++;
+            bucket.bytes += size;
+            break;
+        }
+    }
+}
+
+bool DirEstimate::Calibrate(const std::string& destDir, size_t calibrationSize)
+{
+    if(!CalibrateRead(calibrationSize))
+        return false;
+
+    // Destination doesn't have to exist yet, then write to where it is going to be
+    std::error_code err;
+    std::filesystem::path path = std::filesystem::absolute(destDir, err);
+    while(!std::filesystem::is_directory(path, err) && path.has_relative_path())
+        path = path.parent_path();
+
+    int destFd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(destFd < 0)
+    {
+        mErrMsg = "Could not open '" + path.string() + "' because of: " + strerror(errno);
+        return false;
+    }
+
+    bool res = CalibrateWrite(destFd, path.string(), calibrationSize);
+    close(destFd);
+    return res;
+}
+
+bool DirEstimate::CalibrateRead(size_t calibrationSize)
+{
+    if(!mLargestDir)
+        return true; // Nothing to read
+
+    int fd = openat(mLargestDir->GetFd(), mLargestName.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        mErrMsg = "Could not open '" + mLargestDir->GetPath() + "/" + mLargestName + "' because of: " + strerror(errno);
+        return false;
+    }
+
+    // Note: Drop what is cached (if we can), we want the device speed
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    std::vector<char> buf(1024 * 1024);
+    size_t total = 0;
+    auto startTime = std::chrono::steady_clock::now();
+    while(total < calibrationSize)
+    {
+        ssize_t got = read(fd, buf.data(), buf.size());
+        if(got < 0 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            break;
+        total += got;
+    }
+    double seconds = GetSeconds(startTime);
+    close(fd);
+
+    if(total > 0 && seconds > 0)
+        mResult.readBytesPerSec = total / seconds;
+    return true;
+}
+
+bool DirEstimate::CalibrateWrite(int destFd, const std::string& destDir, size_t calibrationSize)
+{
+    // Write (and sync) the temporary file
+    static const char* tempName = ".dircpy-estimate.tmp";
+    int fd = openat(destFd, tempName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0660);
+    if(fd < 0)
+    {
+        mErrMsg = "Could not make a file in '" + destDir + "' because of: " + strerror(errno);
+        return false;
+    }
+
+    // Note: Not zeros, in case the file system compresses them away
+    std::vector<char> buf(1024 * 1024);
+    for(size_t i = 0; i < buf.size(); i++)
+        buf[i] = (char)(i * 7 + 1);
+
+    size_t total = 0;
+    bool res = true;
+    auto startTime = std::chrono::steady_clock::now();
+    while(total < calibrationSize && res)
+    {
+        ssize_t wrote = write(fd, buf.data(), std::min(buf.size(), calibrationSize - total));
+        if(wrote < 0 && errno == EINTR)
+            continue;
+        if(wrote <= 0)
+            res = false;
+        else
+            total += wrote;
+    }
+    if(res && fdatasync(fd) != 0)
+        res = false;
+    double seconds = GetSeconds(startTime);
+
+    if(!res)
+        mErrMsg = "Failed to write to '" + destDir + "' because of: " + strerror(errno);
+    close(fd);
+    unlinkat(destFd, tempName, 0);
+    if(!res)
+        return false;
+
+    if(seconds > 0)
+        mResult.writeBytesPerSec = total / seconds;
+
+    // Make (and remove) small files to find out the per file cost
+    static constexpr int fileCount = 100;
+    startTime = std::chrono::steady_clock::now();
+    for(int i = 0; i < fileCount; i++)
+    {
+        std::string name = ".dircpy-estimate-" + std::to_string(i) + ".tmp";
+        fd = openat(destFd, name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0660);
+        if(fd >= 0)
+            close(fd);
+    }
+    mResult.fileSeconds = GetSeconds(startTime) / fileCount;
+
+    for(int i = 0; i < fileCount; i++)
+    {
+        std::string name = ".dircpy-estimate-" + std::to_string(i) + ".tmp";
+        unlinkat(destFd, name.c_str(), 0);
+    }
+
+    return true;
+}
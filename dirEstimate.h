@@ -0,0 +1,93 @@
+//
+// dirEstimate.h
+//
+#ifndef __DIR_ESTIMATE_H__
+#define __DIR_ESTIMATE_H__
+
+#include "dirReader.h"
+#include "threadPool.h"
+#include <mutex>
+#include <vector>
+#include <stdint.h>     // uint64_t
+
+//
+// Dry run: find out how much there is to copy and roughly how long it
+// takes, without copying. The source tree is read the same way DirCopy
+// reads it, and files are stat'ed (statx) by pool threads in batches.
+// The time estimate is based on a short calibration: reading the largest
+// source file, writing a temporary file to the destination and making
+// (and removing) small destination files.
+// Note: Calibration I/O is small (calibrationSize bytes), so the estimate
+// is rough, especially for a destination with a large write-back cache.
+//
+class DirEstimate : public DirReader
+{
+public:
+    DirEstimate(int threadCount=4) : mThreadCount(threadCount) {}
+    virtual ~DirEstimate() = default;
+
+    // Files count and size for the files up to maxSize bytes
+    struct SizeBucket
+    {
+        uint64_t maxSize{0};    // UINT64_MAX for the last bucket
+        size_t files{0};
+        uint64_t bytes{0};
+    };
+
+    struct Result
+    {
+        size_t dirs{0};
+        size_t files{0};
+        uint64_t bytes{0};          // Apparent size (what is read and written)
+        uint64_t allocatedBytes{0}; // Allocated on disk
+        size_t sparseFiles{0};      // Files with fewer bytes allocated than their size
+        uint64_t sparseBytes{0};    // Bytes not allocated (holes) of sparse files
+        std::vector<SizeBucket> histogram;
+        double scanSeconds{0};
+
+        // Calibration (0 - not calibrated)
+        double readBytesPerSec{0};
+        double writeBytesPerSec{0};
+        double fileSeconds{0};      // Time to make an empty file
+        double seconds{0};          // Estimated copy time
+    };
+
+    // Note: Files and directories the filter excludes are not counted
+    void SetPathFilter(const PathFilter* filter) { mPathFilter = filter; }
+
+    bool Estimate(const std::string& srcName, const std::string& destDir, bool calibrate=true,
+                  size_t calibrationSize=64 * 1024 * 1024);
+    const Result& GetResult() { return mResult; }
+
+private:
+    virtual void* OnDirectory(const DirFdPtr& dir, const char* baseName, void* param) override;
+    virtual void OnDirectoryEnd(const DirFdPtr& dir, void* param) override;
+    virtual void OnFile(const DirFdPtr& dir, const char* baseName, void* param) override;
+
+    // Files of the same directory to stat together
+    struct Batch
+    {
+        DirFdPtr dir;
+        std::vector<std::string> names;
+    };
+
+    void PostBatch(Batch& batch);
+    void StatFiles(const DirFdPtr& dir, const std::vector<std::string>& names);
+    void AddFile(uint64_t size, uint64_t allocated, Result& result);
+    bool Calibrate(const std::string& destDir, size_t calibrationSize);
+    bool CalibrateRead(size_t calibrationSize);
+    bool CalibrateWrite(int destFd, const std::string& destDir, size_t calibrationSize);
+
+    int mThreadCount{4};
+    const PathFilter* mPathFilter{nullptr};
+    ThreadPool mPool;
+    std::mutex mMutex;
+    Result mResult;
+
+    // The largest file found (to calibrate reading)
+    DirFdPtr mLargestDir;
+    std::string mLargestName;
+    uint64_t mLargestSize{0};
+};
+
+#endif // __DIR_ESTIMATE_H__
@@ -0,0 +1,54 @@
+//
+// dirFd.h
+//
+#ifndef __DIR_FD_H__
+#define __DIR_FD_H__
+
+#include <string>
+#include <memory>               // std::shared_ptr
+#include <functional>           // std::function
+#include <unistd.h>             // close()
+#include <sys/types.h>          // dev_t
+
+//
+// Open directory descriptor shared (refcounted) by the directory reader
+// and by all copy requests for the directory files. Files and sub-directories
+// are accessed relative to it with openat()/mkdirat()/fstatat(), so the kernel
+// never has to resolve the full path again. The descriptor is closed once
+// the last reference is gone (i.e. once all the directory files are done).
+// Note: The path is only kept for error reporting.
+//
+// SetOnClose() lets the owner do the last thing with the directory once
+// it is done (i.e. set the destination directory times).
+//
+class DirFd
+{
+public:
+    DirFd(int fd, const std::string& path, dev_t dev) : mFd(fd), mPath(path), mDev(dev) {}
+    ~DirFd()
+    {
+        if(mOnClose)
+            mOnClose(*this);
+        if(mFd >= 0)
+            close(mFd);
+    }
+
+    DirFd(const DirFd&) = delete;
+    DirFd& operator=(const DirFd&) = delete;
+
+    int GetFd() const { return mFd; }
+    const std::string& GetPath() const { return mPath; }
+    dev_t GetDev() const { return mDev; }   // Device of the file system the directory is on
+    void SetOnClose(std::function<void(const DirFd&)>&& onClose) { mOnClose = std::move(onClose); }
+
+private:
+    int mFd{-1};
+    std::string mPath;
+    dev_t mDev{0};
+    std::function<void(const DirFd&)> mOnClose;
+};
+
+using DirFdPtr = std::shared_ptr<DirFd>;
+
+#endif // __DIR_FD_H__
+
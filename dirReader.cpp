@@ -7,22 +7,57 @@
 // DirReader implementation
 //
 #include <dirent.h>
-#include <string.h>     // strerror
+#include <fcntl.h>          // openat()
+#include <sys/stat.h>       // fstat(), fstatat()
+#include <sys/syscall.h>    // SYS_getdents64
+#include <unistd.h>         // syscall()
+#include <string.h>         // strerror
+#include <algorithm>        // std::sort
 
-static int dirsort(const struct dirent** dir1, const struct dirent** dir2)
+// Directory entry as returned by getdents64()
+struct linux_dirent64
 {
-    return -alphasort(dir1, dir2); // Alphabetic order
-}
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+// Large enough to read directories with millions of entries in few calls
+static constexpr size_t dirBufSize = 1024 * 1024; // 1MB
 
-static int dirfilter(const struct dirent* dir)
+static bool IsDotOrDotDot(const char* name)
 {
     // Ignore "." and ".."
-    if(dir->d_name[0] == '.' && dir->d_name[1] == '\0')
-        return 0; // Ignore
-    else if(dir->d_name[0] == '.' && dir->d_name[1] == '.' && dir->d_name[2] == '\0')
-        return 0; // Ignore
-    else
-        return 1; // Keep
+    return (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')));
+}
+
+DirFdPtr DirReader::OpenDir(int parentFd, const char* dirName, const std::string& path, std::string& errMsg)
+{
+    int fd = openat(parentFd, dirName, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        int errNo = errno;
+        errMsg = "Could not open directory '" + path + "' because of: ";
+        errMsg += strerror(errNo);
+        errno = errNo;
+        return nullptr;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        int errNo = errno;
+        errMsg = "Could not stat directory '" + path + "' because of: ";
+        errMsg += strerror(errNo);
+        close(fd);
+        errno = errNo;
+        return nullptr;
+    }
+
+    DirFdPtr dir = std::make_shared<DirFd>(fd, path, st.st_dev);
+    return dir;
 }
 
 bool DirReader::Read(const char* dirName, void* param)
@@ -30,44 +65,169 @@ bool DirReader::Read(const char* dirName, void* param)
     if(mAbort)
         return false;
 
-    struct dirent** dirlist{nullptr};
+    DirFdPtr dir = OpenDir(AT_FDCWD, dirName, dirName, mErrMsg);
+    if(!dir)
+        return false;
 
-    int n = scandir(dirName, &dirlist, dirfilter, dirsort);
-    if(n < 0)
-    {
-        mErrMsg = std::string("Could not scandir '") + dirName + "' because of: ";
-        mErrMsg += strerror(errno);
+    return ReadDir(dir, param);
+}
+
+bool DirReader::ReadDir(const DirFdPtr& dir, void* param)
+{
+    if(mAbort)
         return false;
-    }
 
-    while(!mAbort && n--)
-    {
-        struct dirent* dir = dirlist[n];
+    if(mBuf.empty())
+        mBuf.resize(dirBufSize);
 
-        if(dir->d_type == DT_DIR)
+    // Entries we can't dispatch right away: all of them if we have to sort,
+    // otherwise sub-directories only. Files are dispatched as they come, and
+    // sub-directories are read once we are done with this directory (so the
+    // getdents64() buffer can be re-used while going down the tree).
+    std::vector<Entry> entries;
+    Entry entry;
+
+    while(!mAbort)
+    {
+        long n = syscall(SYS_getdents64, dir->GetFd(), mBuf.data(), mBuf.size());
+        if(n < 0)
         {
-            // Got sub-directory to read
-            void* subDirParam = OnDirectory(dirName, dir->d_name, param);
-            Read(std::string(dirName) + "/" + dir->d_name, subDirParam);
-            OnDirectoryEnd(dirName, subDirParam);
+            if(errno == EINTR)
+                continue;
+            int errNo = errno;
+            if(!OnDirectoryError(dir->GetPath(), "Could not read directory '" + dir->GetPath() + "' because of: " + strerror(errNo), errNo))
+                mAbort = true;
+            return false;
         }
-//        else if(dir->d_type == DT_LNK)
-//        {
-//            // TODO: support for links
-//        }
-        else
+        else if(n == 0)
+        {
+            break; // End of directory
+        }
+
+        for(long pos = 0; pos < n && !mAbort; )
         {
-            // Got file
-            OnFile(dirName, dir->d_name, param);
+            const linux_dirent64* dirent = (const linux_dirent64*)(mBuf.data() + pos);
+            pos += dirent->d_reclen;
+
+            if(IsDotOrDotDot(dirent->d_name))
+                continue;
+
+            // Some file systems don't fill in d_type
+            unsigned char type = dirent->d_type;
+            if(type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if(fstatat(dir->GetFd(), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+                    type = DT_DIR;
+            }
+
+            // Note: Excluded directories are never read
+            if(mFilter && IsExcluded(dir->GetFd(), dir->GetPath(), dirent->d_name, type == DT_DIR))
+                continue;
+
+            entry.name = dirent->d_name;
+            entry.ino = dirent->d_ino;
+            entry.isDir = (type == DT_DIR);
+
+            if(mOrder == Order::None && !entry.isDir)
+                OnEntry(dir, entry, param); // Got file, dispatch it right away
+            else
+                entries.emplace_back(std::move(entry));
         }
+    }
 
-        free(dir);
+    if(mOrder == Order::Name)
+    {
+        std::sort(entries.begin(), entries.end(), [](const Entry& e1, const Entry& e2)
+            { return strcmp(e1.name.c_str(), e2.name.c_str()) < 0; });
+    }
+    else if(mOrder == Order::Inode)
+    {
+        std::sort(entries.begin(), entries.end(), [](const Entry& e1, const Entry& e2)
+            { return e1.ino < e2.ino; });
     }
 
-    free(dirlist);
+    for(auto it = entries.begin(); it != entries.end() && !mAbort; ++it)
+        OnEntry(dir, *it, param);
 
     return !mAbort;
 }
 
+void DirReader::SetFilter(const PathFilter* filter, const std::string& rootDir)
+{
+    mFilter = (filter && !filter->IsEmpty() ? filter : nullptr);
+    mFilterRoot = rootDir;
+    mFilterMatches.assign(filter ? filter->GetRuleCount() : 0, 0);
+    mExcludedFiles = 0;
+    mPrunedDirs = 0;
+}
+
+bool DirReader::IsExcluded(int dirFd, const std::string& dirPath, const char* name, bool isDir)
+{
+    if(!mFilter)
+        return false;
+
+    // Path relative to the root (only if there are path rules)
+    std::string relPath;
+    if(mFilter->NeedsPath())
+    {
+        if(dirPath.size() > mFilterRoot.size() && dirPath.compare(0, mFilterRoot.size(), mFilterRoot) == 0 &&
+           dirPath[mFilterRoot.size()] == '/')
+        {
+            relPath = dirPath.substr(mFilterRoot.size() + 1) + "/" + name;
+        }
+        else
+        {
+            relPath = name;
+        }
+    }
+
+    int rule = mFilter->Match(name, relPath, isDir);
+    if(rule >= 0)
+        mFilterMatches[rule]++;
+
+    bool excluded = (rule >= 0 && mFilter->GetAction(rule) == PathFilter::Action::Exclude);
+
+    // Note: If we can't stat the file, let the caller find out why
+    struct stat st;
+    if(!excluded && !isDir && mFilter->NeedsStat() &&
+       (dirFd == AT_FDCWD ? lstat((dirPath + "/" + name).c_str(), &st) : fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW)) == 0)
+    {
+        excluded = !mFilter->MatchStat(st);
+    }
+
+    if(excluded)
+        (isDir ? mPrunedDirs : mExcludedFiles)++;
+    return excluded;
+}
 
+void DirReader::OnEntry(const DirFdPtr& dir, const Entry& entry, void* param)
+{
+    if(entry.isDir)
+    {
+        // Got sub-directory to read
+        void* subDirParam = OnDirectory(dir, entry.name.c_str(), param);
+        if(!mAbort && subDirParam)
+        {
+            std::string path = dir->GetPath() + "/" + entry.name;
+            std::string err;
+            DirFdPtr subDir = OpenDir(dir->GetFd(), entry.name.c_str(), path, err);
+            int errNo = errno;
+            if(subDir)
+                ReadDir(subDir, subDirParam);
+            else if(!OnDirectoryError(path, err, errNo))
+                mAbort = true;
+        }
+        OnDirectoryEnd(dir, subDirParam);
+    }
+//    else if(entry is DT_LNK)
+//    {
+//        // TODO: support for links
+//    }
+    else
+    {
+        // Got file
+        OnFile(dir, entry.name.c_str(), param);
+    }
+}
 
@@ -5,6 +5,10 @@
 #define __DIR_READER_H__
 
 #include <string>
+#include <vector>
+#include <atomic>
+#include "dirFd.h"
+#include "pathFilter.h"
 
 class DirReader
 {
@@ -12,19 +16,77 @@ public:
     DirReader() = default;
     virtual ~DirReader() = default;
 
+    // Order in which directory entries are dispatched
+    enum class Order
+    {
+        None,   // As they come from getdents64() (streaming, no sorting)
+        Name,   // By name (byte-wise, not locale-aware)
+        Inode   // By inode number (better locality on spinning disks)
+    };
+
     bool Read(const char* dirName, void* param);
     bool Read(const std::string& dirName, void* param) { return Read(dirName.c_str(), param); }
     void Abort(const std::string& errMsg) { mAbort = true; mErrMsg = errMsg; }
     const std::string& GetError() { return mErrMsg; }
+    void SetOrder(Order order) { mOrder = order; }
+
+    // Skip entries the filter excludes (nullptr - none). Excluded directories
+    // are not read at all. Path rules are matched against the path relative
+    // to rootDir. It also resets the filter counts.
+    void SetFilter(const PathFilter* filter, const std::string& rootDir);
+
+    // Filter counts: matches of every rule, files excluded and directories
+    // pruned (with everything in them)
+    const std::vector<size_t>& GetFilterMatches() { return mFilterMatches; }
+    size_t GetExcludedFiles() { return mExcludedFiles; }
+    size_t GetPrunedDirs() { return mPrunedDirs; }
+
+    // Open directory (or its sub-directory when parentFd is not AT_FDCWD).
+    // On error, errno is of the failed call.
+    static DirFdPtr OpenDir(int parentFd, const char* dirName, const std::string& path, std::string& errMsg);
+
+    // For derived class to override.
+    // Note: Directory entries are passed as a base name relative to the
+    // open parent directory descriptor (see dirFd.h). The sub-directory
+    // is not read if OnDirectory() returns nullptr.
+    virtual void* OnDirectory(const DirFdPtr& dir, const char* baseName, void* param) = 0;
+    virtual void OnDirectoryEnd(const DirFdPtr& dir, void* param) = 0;
+    virtual void OnFile(const DirFdPtr& dir, const char* baseName, void* param) = 0;
 
-    // For derived class to override
-    virtual void* OnDirectory(const char* dirName, const char* baseName, void* param) = 0;
-    virtual void OnDirectoryEnd(const char* dirName, void* param) = 0;
-    virtual void OnFile(const char* dirName, const char* baseName, void* param) = 0;
+    // Sub-directory (path) can't be opened or read (errNo of the failed call).
+    // Return true to go on without it, false (default) to stop reading.
+    virtual bool OnDirectoryError(const std::string& /*path*/, const std::string& err, int /*errNo*/)
+    {
+        mErrMsg = err;
+        return false;
+    }
 
 protected:
-    bool mAbort{false};
+    bool ReadDir(const DirFdPtr& dir, void* param);
+
+    // Is the entry (name in dirPath, open as dirFd or AT_FDCWD) excluded by the filter?
+    bool IsExcluded(int dirFd, const std::string& dirPath, const char* name, bool isDir);
+
+    std::atomic<bool> mAbort{false};    // Can be set by any thread
     std::string mErrMsg;
+
+private:
+    struct Entry
+    {
+        std::string name;
+        ino_t ino{0};
+        bool isDir{false};
+    };
+
+    void OnEntry(const DirFdPtr& dir, const Entry& entry, void* param);
+
+    Order mOrder{Order::None};
+    const PathFilter* mFilter{nullptr};
+    std::string mFilterRoot;
+    std::vector<size_t> mFilterMatches;
+    size_t mExcludedFiles{0};
+    size_t mPrunedDirs{0};
+    std::vector<char> mBuf; // getdents64() buffer, re-used by all directories
 };
 
 
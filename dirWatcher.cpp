@@ -0,0 +1,261 @@
+//
+// dirWatcher.cpp
+//
+#include "dirWatcher.h"
+#include <sys/inotify.h>    // inotify_init1(), inotify_add_watch()
+#include <sys/stat.h>       // stat()
+#include <poll.h>           // poll()
+#include <fcntl.h>          // AT_FDCWD
+#include <string.h>         // strerror()
+#include <unistd.h>         // read(), close()
+#include <chrono>
+
+// Directory events we are interested in.
+// Note: Files are reported once they are written (closed), not created,
+// so a file being written is not copied over and over again.
+static constexpr uint32_t watchMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB | IN_CREATE |
+                                      IN_MOVED_FROM | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+bool DirWatcher::Open(const std::string& dirName, const PathFilter* filter /*=nullptr*/)
+{
+    Close();
+
+    mFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(mFd < 0)
+    {
+        mErrMsg = std::string("inotify_init1() failed: ") + strerror(errno);
+        return false;
+    }
+
+    mDirName = dirName;
+    SetFilter(filter, dirName);
+    mEventBuf.resize(64 * 1024);
+    clock_gettime(CLOCK_REALTIME, &mSyncTime);
+    return AddTree("");
+}
+
+void DirWatcher::Close()
+{
+    if(mFd >= 0)
+    {
+        close(mFd);
+        mFd = -1;
+    }
+
+    mWatches.clear();
+    mErrMsg.clear();
+}
+
+bool DirWatcher::AddWatch(const std::string& path, const std::string& relPath)
+{
+    int wd = inotify_add_watch(mFd, path.c_str(), watchMask);
+    if(wd < 0)
+    {
+        // Note: The directory could be gone (or replaced with a file) already
+        if(errno == ENOENT || errno == ENOTDIR)
+            return true;
+
+        int errNo = errno;
+        mWatchFailed = true;
+        mErrMsg = "Failed to watch '" + path + "' because of: ";
+        mErrMsg += strerror(errNo);
+        if(errNo == ENOSPC)
+            mErrMsg += " (see fs.inotify.max_user_watches)";
+        return false;
+    }
+
+    mWatches[wd] = relPath;
+    return true;
+}
+
+bool DirWatcher::AddTree(const std::string& relPath)
+{
+    std::string path = (relPath.empty() ? mDirName : mDirName + "/" + relPath);
+
+    // Note: Sub-directories can be removed while we are reading the tree,
+    // then read it again (directories already watched keep their watches)
+    for(int attempt = 0; attempt < 3; attempt++)
+    {
+        mAbort = false;
+        mWatchFailed = false;
+        mErrMsg.clear();
+
+        if(!AddWatch(path, relPath))
+            return false;
+
+        std::string rootPath = relPath;
+        if(Read(path, &rootPath))
+            return true;
+
+        if(mWatchFailed)
+            return false;
+
+        // The directory itself is gone
+        struct stat st;
+        if(stat(path.c_str(), &st) != 0 && errno == ENOENT && !relPath.empty())
+        {
+            mErrMsg.clear();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void* DirWatcher::OnDirectory(const DirFdPtr& dir, const char* baseName, void* param)
+{
+    const std::string& parentPath = *(const std::string*)param;
+    std::string* relPath = new std::string(parentPath.empty() ? baseName : parentPath + "/" + baseName);
+
+    if(!AddWatch(dir->GetPath() + "/" + baseName, *relPath))
+        mAbort = true;
+    return relPath;
+}
+
+void DirWatcher::OnDirectoryEnd(const DirFdPtr& /*dir*/, void* param)
+{
+    delete (std::string*)param;
+}
+
+bool DirWatcher::WaitChanges(Changes& changes, int coalesceMs, const std::atomic<bool>& stop)
+{
+    changes = Changes();
+
+    // Wait for the first event (checking if we should stop every now and then)
+    struct pollfd pfd { mFd, POLLIN, 0 };
+    while(!stop)
+    {
+        int n = poll(&pfd, 1, 200);
+        if(n > 0)
+            break;
+        if(n < 0 && errno != EINTR)
+        {
+            mErrMsg = std::string("poll() failed: ") + strerror(errno);
+            return false;
+        }
+    }
+
+    // Collect events until the coalescing window is over
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(coalesceMs);
+    while(!stop)
+    {
+        // Note: Once all the events are read, none of them were lost
+        // before readTime (or the queue overflow is reported)
+        struct timespec readTime;
+        clock_gettime(CLOCK_REALTIME, &readTime);
+        if(!ReadEvents(changes))
+            return false;
+        mSyncTime = readTime;
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if(remaining <= 0)
+            break;
+        if(poll(&pfd, 1, remaining) < 0 && errno != EINTR)
+        {
+            mErrMsg = std::string("poll() failed: ") + strerror(errno);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool DirWatcher::ReadEvents(Changes& changes)
+{
+    while(true)
+    {
+        ssize_t n = read(mFd, mEventBuf.data(), mEventBuf.size());
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                return true; // No more events
+            mErrMsg = std::string("Failed to read inotify events: ") + strerror(errno);
+            return false;
+        }
+
+        for(ssize_t pos = 0; pos < n; )
+        {
+            const struct inotify_event* event = (const struct inotify_event*)(mEventBuf.data() + pos);
+            pos += sizeof(struct inotify_event) + event->len;
+
+            // Events were lost, so rescan the tree for whatever changed since
+            // the last time we read all the events (with a second to spare for
+            // the file system timestamps granularity), and watch directories
+            // we don't know about yet
+            if(event->mask & IN_Q_OVERFLOW)
+            {
+                if(!changes.rescan)
+                {
+                    changes.rescan = true;
+                    changes.since = mSyncTime;
+                    changes.since.tv_sec -= 1;
+                }
+                if(!AddTree(""))
+                    return false;
+                continue;
+            }
+
+            auto it = mWatches.find(event->wd);
+            if(it == mWatches.end())
+                continue;
+
+            // Watch is gone (directory removed or moved away)
+            if(event->mask & IN_IGNORED)
+            {
+                mWatches.erase(it);
+                continue;
+            }
+
+            const std::string& dirPath = it->second;
+            std::string relPath = (event->len == 0 || !event->name[0] ? dirPath :
+                                   dirPath.empty() ? std::string(event->name) : dirPath + "/" + event->name);
+
+            // Note: Directories moved away are not filtered, so their watches are dropped
+            bool isDir = (event->mask & IN_ISDIR);
+            if(event->len > 0 && event->name[0] && !(event->mask & IN_MOVED_FROM) &&
+               IsExcluded(AT_FDCWD, dirPath.empty() ? mDirName : mDirName + "/" + dirPath, event->name, isDir))
+            {
+                continue;
+            }
+
+            if(!isDir)
+            {
+                if(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB))
+                    changes.files.insert(relPath);
+            }
+            else if(event->mask & (IN_CREATE | IN_MOVED_TO))
+            {
+                // Watch the new directory (and its sub-directories) right
+                // away, then copy all of it
+                if(!AddTree(relPath))
+                    return false;
+                changes.dirs.insert(relPath);
+            }
+            else if(event->mask & IN_MOVED_FROM)
+            {
+                // Directory moved away, drop its watches (its sub-directories
+                // paths aren't right anymore)
+                for(auto watch = mWatches.begin(); watch != mWatches.end(); )
+                {
+                    const std::string& path = watch->second;
+                    if(path == relPath || (path.size() > relPath.size() && path[relPath.size()] == '/' &&
+                                           path.compare(0, relPath.size(), relPath) == 0))
+                    {
+                        inotify_rm_watch(mFd, watch->first);
+                        watch = mWatches.erase(watch);
+                    }
+                    else
+                    {
+                        ++watch;
+                    }
+                }
+            }
+            else if(event->mask & IN_ATTRIB)
+            {
+                changes.attrDirs.insert(relPath);
+            }
+        }
+    }
+}
@@ -0,0 +1,71 @@
+//
+// dirWatcher.h
+//
+#ifndef __DIR_WATCHER_H__
+#define __DIR_WATCHER_H__
+
+#include "dirReader.h"
+#include <set>
+#include <map>
+#include <atomic>
+#include <time.h>       // struct timespec
+
+//
+// Watch a directory tree for changes (inotify). Every directory of the tree
+// has its own watch, and watches are added for new directories as soon as
+// they are reported. Changes are reported as paths relative to the watched
+// directory, coalesced over a short window, so a file written several times
+// is reported once.
+// Note: If the kernel event queue overflows, the changes since the last
+// WaitChanges() are lost, so the caller has to rescan the tree for files
+// changed since Changes::since.
+//
+class DirWatcher : public DirReader
+{
+public:
+    DirWatcher() = default;
+    virtual ~DirWatcher() { Close(); }
+
+    DirWatcher(const DirWatcher&) = delete;
+    DirWatcher& operator=(const DirWatcher&) = delete;
+
+    struct Changes
+    {
+        std::set<std::string> files;    // Files written, moved in or with new attributes
+        std::set<std::string> dirs;     // Directories made or moved in (copy them all)
+        std::set<std::string> attrDirs; // Directories with new attributes
+        bool rescan{false};             // Events were lost (queue overflow)...
+        struct timespec since{};        // ...rescan files changed since then
+
+        bool empty() const { return files.empty() && dirs.empty() && attrDirs.empty() && !rescan; }
+    };
+
+    // Note: Directories (and files) the filter excludes are not watched (reported)
+    bool Open(const std::string& dirName, const PathFilter* filter=nullptr);
+    void Close();
+
+    // Wait for changes, then collect them for coalesceMs more.
+    // Note: It returns with no changes if stop is set.
+    bool WaitChanges(Changes& changes, int coalesceMs, const std::atomic<bool>& stop);
+
+    size_t GetWatchCount() { return mWatches.size(); }
+    bool IsValid() { return mErrMsg.empty(); }
+
+private:
+    virtual void* OnDirectory(const DirFdPtr& dir, const char* baseName, void* param) override;
+    virtual void OnDirectoryEnd(const DirFdPtr& dir, void* param) override;
+    virtual void OnFile(const DirFdPtr& /*dir*/, const char* /*baseName*/, void* /*param*/) override {}
+
+    bool AddWatch(const std::string& path, const std::string& relPath);
+    bool AddTree(const std::string& relPath);
+    bool ReadEvents(Changes& changes);
+
+    int mFd{-1};
+    std::string mDirName;
+    std::map<int, std::string> mWatches;    // Watch descriptor to directory relative path ("" - the root)
+    struct timespec mSyncTime{};            // No events were lost before then
+    bool mWatchFailed{false};               // Failed to add a watch (not just a directory gone)
+    std::vector<char> mEventBuf;
+};
+
+#endif // __DIR_WATCHER_H__
@@ -0,0 +1,114 @@
+//
+// fileMetadata.cpp
+//
+#include "fileMetadata.h"
+#include <unistd.h>         // fchown()
+#include <fcntl.h>          // AT_FDCWD
+#include <string.h>         // strerror(), strlen()
+#include <sys/xattr.h>      // flistxattr(), fgetxattr(), fsetxattr()
+
+// Can we live without setting it (not privileged or not supported)?
+static bool IsIgnorable(int errNo)
+{
+    return (errNo == EPERM || errNo == ENOTSUP || errNo == EACCES);
+}
+
+bool FileMetadata::Read(int fd)
+{
+    mXattrs.clear();
+    mErrMsg.clear();
+
+    if(fstat(fd, &mStat) != 0)
+    {
+        mErrMsg = std::string("Failed to stat because of: ") + strerror(errno);
+        return false;
+    }
+
+    // Get extended attributes names (the list can change between the calls)
+    std::vector<char> names;
+    while(true)
+    {
+        ssize_t size = flistxattr(fd, nullptr, 0);
+        if(size < 0 && IsIgnorable(errno))
+            return true; // No extended attributes support
+        if(size <= 0)
+            break;
+
+        names.resize(size);
+        size = flistxattr(fd, names.data(), names.size());
+        if(size >= 0)
+        {
+            names.resize(size);
+            break;
+        }
+        if(errno != ERANGE)
+        {
+            mErrMsg = std::string("Failed to list extended attributes because of: ") + strerror(errno);
+            return false;
+        }
+    }
+
+    // Get their values
+    for(size_t pos = 0; pos < names.size(); pos += strlen(names.data() + pos) + 1)
+    {
+        const char* name = names.data() + pos;
+        std::string value;
+        while(true)
+        {
+            ssize_t size = fgetxattr(fd, name, nullptr, 0);
+            if(size < 0)
+                break;  // Gone since listed (or not readable)
+
+            value.resize(size);
+            size = fgetxattr(fd, name, value.data(), value.size());
+            if(size >= 0)
+            {
+                value.resize(size);
+                mXattrs.emplace_back(name, std::move(value));
+                break;
+            }
+            if(errno != ERANGE)
+                break;
+        }
+    }
+
+    return true;
+}
+
+bool FileMetadata::Apply(int fd)
+{
+    mErrMsg.clear();
+
+    // Note: ACLs are set first, then chmod() sets the same mode (and ACL mask)
+    for(const auto& [name, value] : mXattrs)
+    {
+        if(fsetxattr(fd, name.c_str(), value.data(), value.size(), 0) != 0 && !IsIgnorable(errno))
+        {
+            mErrMsg = "Failed to set extended attribute '" + name + "' because of: " + strerror(errno);
+            return false;
+        }
+    }
+
+    // Note: chown() clears set-user-ID and set-group-ID bits, so it goes before chmod()
+    if(fchown(fd, mStat.st_uid, mStat.st_gid) != 0 && !IsIgnorable(errno))
+    {
+        mErrMsg = std::string("Failed to chown because of: ") + strerror(errno);
+        return false;
+    }
+
+    if(fchmod(fd, mStat.st_mode & 07777) != 0)
+    {
+        mErrMsg = std::string("Failed to chmod because of: ") + strerror(errno);
+        return false;
+    }
+
+    // Note: Must be the last, any write changes the modification time
+    struct timespec times[2] { mStat.st_atim, mStat.st_mtim };
+    if(futimens(fd, times) != 0)
+    {
+        mErrMsg = std::string("Failed to set times because of: ") + strerror(errno);
+        return false;
+    }
+
+    return true;
+}
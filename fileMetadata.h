@@ -0,0 +1,38 @@
+//
+// fileMetadata.h
+//
+#ifndef __FILE_METADATA_H__
+#define __FILE_METADATA_H__
+
+#include <string>
+#include <vector>
+#include <utility>              // std::pair
+#include <sys/stat.h>           // struct stat
+
+//
+// Helper class to copy file (or directory) metadata: mode, ownership,
+// timestamps and extended attributes. ACLs are extended attributes
+// (system.posix_acl_*) and are copied with them.
+// Both Read() and Apply() work on open descriptors, so no path is resolved.
+// Note: Ownership (and attributes of namespaces other than "user") can only
+// be set by a privileged user, so these failures are silently ignored.
+//
+class FileMetadata
+{
+public:
+    FileMetadata() = default;
+    ~FileMetadata() = default;
+
+    bool Read(int fd);
+    bool Apply(int fd);
+
+    const struct stat& GetStat() { return mStat; }
+    const std::string& GetError() { return mErrMsg; }
+
+private:
+    struct stat mStat {};
+    std::vector<std::pair<std::string, std::string>> mXattrs; // Names and values
+    std::string mErrMsg;
+};
+
+#endif // __FILE_METADATA_H__
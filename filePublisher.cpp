@@ -0,0 +1,123 @@
+//
+// filePublisher.cpp
+//
+#include "filePublisher.h"
+#include <fcntl.h>      // openat(), renameat(), sync_file_range()
+#include <unistd.h>     // fsync(), syncfs(), unlinkat()
+#include <string.h>     // strerror()
+#include <set>
+#include <map>
+
+void FilePublisher::Add(const DirFdPtr& dir, const std::string& tempName, const std::string& fileName,
+                        std::function<void(const std::string& err)>&& onDone)
+{
+    File file;
+    file.dir = dir;
+    file.tempName = tempName;
+    file.fileName = fileName;
+    file.onDone = std::move(onDone);
+
+    // Start writing the file data out now, so there is less to wait for at the flush
+    if(mDurability == Durability::FileRange)
+    {
+        file.fd = openat(dir->GetFd(), tempName.c_str(), O_RDONLY | O_CLOEXEC);
+        if(file.fd >= 0)
+            sync_file_range(file.fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        else
+            file.openErrNo = errno;
+    }
+
+    std::vector<File> batch;
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mBatch.emplace_back(std::move(file));
+        if(mBatch.size() < mBatchSize)
+            return;
+        batch.swap(mBatch);
+    }
+
+    // Note: Other threads keep adding files to the next batch meanwhile
+    Flush(batch);
+}
+
+void FilePublisher::Flush()
+{
+    std::vector<File> batch;
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        batch.swap(mBatch);
+    }
+
+    if(!batch.empty())
+        Flush(batch);
+}
+
+void FilePublisher::Flush(std::vector<File>& batch)
+{
+    std::vector<std::string> errors(batch.size());
+
+    // Make the data durable first
+    if(mDurability == Durability::Syncfs)
+    {
+        // Note: A failed syncfs() fails all the files of its file system
+        std::map<dev_t, std::string> devErrors;
+        for(size_t i = 0; i < batch.size(); i++)
+        {
+            auto [it, inserted] = devErrors.emplace(batch[i].dir->GetDev(), std::string());
+            if(inserted && syncfs(batch[i].dir->GetFd()) != 0)
+                it->second = std::string("Failed to sync file system because of: ") + strerror(errno);
+            errors[i] = it->second;
+        }
+    }
+    else if(mDurability == Durability::FileRange)
+    {
+        for(size_t i = 0; i < batch.size(); i++)
+        {
+            File& file = batch[i];
+            if(file.fd < 0)
+            {
+                errors[i] = std::string("Failed to open for sync because of: ") + strerror(file.openErrNo);
+                continue;
+            }
+
+            if(sync_file_range(file.fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+                errors[i] = std::string("Failed to sync because of: ") + strerror(errno);
+            close(file.fd);
+            file.fd = -1;
+        }
+    }
+
+    // Rename files in place, then make the names durable
+    std::set<DirFd*> dirs;
+    for(size_t i = 0; i < batch.size(); i++)
+    {
+        File& file = batch[i];
+        int dirFd = file.dir->GetFd();
+        if(errors[i].empty() && renameat(dirFd, file.tempName.c_str(), dirFd, file.fileName.c_str()) != 0)
+            errors[i] = "Failed to rename '" + file.tempName + "' because of: " + strerror(errno);
+
+        if(!errors[i].empty())
+            unlinkat(dirFd, file.tempName.c_str(), 0);
+        else if(mDurability != Durability::None)
+            dirs.insert(file.dir.get());
+    }
+
+    for(DirFd* dir : dirs)
+    {
+        if(fsync(dir->GetFd()) != 0)
+        {
+            std::string err = "Failed to sync '" + dir->GetPath() + "' directory because of: " + strerror(errno);
+            for(size_t i = 0; i < batch.size(); i++)
+            {
+                if(batch[i].dir.get() == dir && errors[i].empty())
+                    errors[i] = err;
+            }
+        }
+    }
+
+    for(size_t i = 0; i < batch.size(); i++)
+    {
+        if(batch[i].onDone)
+            batch[i].onDone(errors[i]);
+    }
+}
@@ -0,0 +1,77 @@
+//
+// filePublisher.h
+//
+#ifndef __FILE_PUBLISHER_H__
+#define __FILE_PUBLISHER_H__
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include "dirFd.h"
+
+//
+// Helper class to publish files written under temporary names. Files are
+// renamed to their names in batches, once the batch data is on disk, so
+// nobody ever sees a half-written file, and the cost of making data durable
+// is shared by all the batch files:
+//
+//   None       Just rename (atomic, but not durable)
+//   FileRange  Start the file writeback when added (sync_file_range), wait
+//              for all of them at the batch flush
+//   Syncfs     One syncfs() per file system at the batch flush
+//
+// With FileRange or Syncfs, the directories of the renamed files are fsynced
+// as well, so the names are durable too.
+// Note: sync_file_range() doesn't write file metadata (i.e. the size of a
+// file that was extended), Syncfs is the safe choice.
+//
+class FilePublisher
+{
+public:
+    enum class Durability
+    {
+        None,
+        FileRange,
+        Syncfs
+    };
+
+    FilePublisher(Durability durability=Durability::None, size_t batchSize=256)
+        : mDurability(durability), mBatchSize(batchSize) {}
+    ~FilePublisher() { Flush(); }
+
+    FilePublisher(const FilePublisher&) = delete;
+    FilePublisher& operator=(const FilePublisher&) = delete;
+
+    // Temporary (hidden) name to write the file to
+    static std::string GetTempName(const std::string& fileName) { return "." + fileName + ".dircpy-tmp"; }
+
+    // Queue the written temporary file to be renamed to fileName. The batch
+    // is flushed by the thread that fills it up. Once the file is published
+    // (or failed to), onDone is called with the error (empty if published).
+    void Add(const DirFdPtr& dir, const std::string& tempName, const std::string& fileName,
+             std::function<void(const std::string& err)>&& onDone);
+
+    // Publish all the queued files
+    void Flush();
+
+private:
+    struct File
+    {
+        DirFdPtr dir;
+        std::string tempName;
+        std::string fileName;
+        int fd{-1};             // Open file (FileRange only)
+        int openErrNo{0};       // Of the failed open (FileRange only)
+        std::function<void(const std::string& err)> onDone;
+    };
+
+    void Flush(std::vector<File>& batch);
+
+    Durability mDurability{Durability::None};
+    size_t mBatchSize{256};
+    std::vector<File> mBatch;
+    std::mutex mMutex;
+};
+
+#endif // __FILE_PUBLISHER_H__
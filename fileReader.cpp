@@ -4,16 +4,22 @@
 #include "fileReader.h"
 #include <unistd.h>
 #include <string.h>         // strerror()
-#include <fcntl.h>          // open()
+#include <fcntl.h>          // openat()
 #include <sys/stat.h>       // fstat()
 #include <sys/mman.h>       // mmap()
 #include <assert.h>         // assert()
 #include <iostream>         // std::cout, std::cerr
+#include <algorithm>        // std::min(), std::max()
+
+// Buffers for small files, re-used by the same thread
+static thread_local std::vector<std::unique_ptr<std::vector<char>>> bufferPool;
+static constexpr size_t maxPooledBuffers = 4;
 
 //
 // Log reader implementation
 //
-bool FileReader::OpenFile(const std::string& fileName,
+bool FileReader::OpenFile(int dirFd,
+                          const std::string& fileName,
                           off_t readBeginOffset,
                           off_t readEndOffset /* -1 for EOF */)
 {
@@ -40,10 +46,11 @@ bool FileReader::OpenFile(const std::string& fileName,
         return false;
     }
 
-    int fd = open(mFileName.c_str(), O_RDONLY);
+    int fd = openat(dirFd, mFileName.c_str(), O_RDONLY | O_CLOEXEC);
     if(fd < 0)
     {
         int errNo = errno;
+        mErrNo = errNo;
         mErrMsg = "Could not open '" + mFileName + "' because of: ";
         mErrMsg += strerror(errNo);
         return false;
@@ -54,6 +61,7 @@ bool FileReader::OpenFile(const std::string& fileName,
     if(fstat(fd, &fileStats) != 0)
     {
         int errNo = errno;
+        mErrNo = errNo;
         mErrMsg = "Could not fstat'" + mFileName + "' because of: ";
         mErrMsg += strerror(errNo);
         close(fd);
@@ -61,6 +69,8 @@ bool FileReader::OpenFile(const std::string& fileName,
     }
 
     // Remember file size & mode
+    // Note: The file is kept open (for its metadata) until CloseFile()
+    mFd = fd;
     mFileSize = fileStats.st_size;
     mFileMode = fileStats.st_mode;
 
@@ -74,6 +84,7 @@ bool FileReader::OpenFile(const std::string& fileName,
         mErrMsg = "Read end offset " + std::to_string(mReadEndOffset) + " is greater than file size "
                   + std::to_string(mFileSize) + " of the file '" + fileName + "'";
         close(fd);
+        mFd = -1;
         return false;
     }
 
@@ -81,43 +92,103 @@ bool FileReader::OpenFile(const std::string& fileName,
     if(mReadEndOffset < 0)
         mReadEndOffset = mFileSize;
 
-    // Offset for mmap() must be page aligned
-    off_t alignedOffset = mReadBeginOffset & ~(sysconf(_SC_PAGE_SIZE) - 1);
+    size_t readMaxSize = mReadEndOffset - mReadBeginOffset;
+    if(readMaxSize == 0)
+        return true; // Nothing to read
 
-    // Get the length of mapping
-    size_t mapLength = mReadEndOffset - alignedOffset;
+    // Small files are read at once into the buffer, since their mapping
+    // setup, page faults and unmapping (TLB shootdown) cost more than the
+    // copy itself, and all threads mmap() and munmap() under the same lock
+    if(readMaxSize <= mPreadMaxSize)
+        return ReadIntoBuffer();
 
-    // Map in the file.
-    void* addr = mmap(NULL, mapLength, PROT_READ, MAP_PRIVATE, fd, alignedOffset);
-    close(fd); // Can close file now, no longer need it
+    // Large files are mapped in windows (see GetReadAddr)
+    return (GetReadAddr(0, 0) != nullptr);
+}
 
-    // Validate mmap() result
-    if(addr == MAP_FAILED)
+bool FileReader::ReadIntoBuffer()
+{
+    if(!bufferPool.empty())
+    {
+        mBuffer = std::move(bufferPool.back());
+        bufferPool.pop_back();
+    }
+    else
+    {
+        mBuffer = std::make_unique<std::vector<char>>();
+    }
+
+    size_t readMaxSize = mReadEndOffset - mReadBeginOffset;
+    mBuffer->resize(readMaxSize);
+
+    size_t total = 0;
+    while(total < readMaxSize)
     {
-//        std::cout << "### '" << fileName << "'"
-//                << ": fd=" << fd
-//                << ": readBeginOffset=" << mReadBeginOffset
-//                << ", readEndOffset=" << mReadEndOffset
-//                << ", mapLength=" << mapLength
-//                << ", alignedOffset=" << alignedOffset << std::endl;
+        ssize_t got = pread(mFd, mBuffer->data() + total, readMaxSize - total, mReadBeginOffset + total);
+        if(got < 0 && errno == EINTR)
+            continue;
+
+        if(got <= 0)
+        {
+            int errNo = errno;
+            mErrNo = (got < 0 ? errNo : 0);
+            mErrMsg = "Could not read '" + mFileName + "' because of: ";
+            mErrMsg += (got < 0 ? strerror(errNo) : "file was truncated");
+            return false;
+        }
+        total += got;
+    }
+
+    return true;
+}
+
+// Get the address of size bytes at pos (relative to the read begin offset)
+const char* FileReader::GetReadAddr(size_t pos, size_t size)
+{
+    if(mBuffer)
+        return mBuffer->data() + pos;
+
+    // Is it in the current window?
+    off_t offset = mReadBeginOffset + pos;
+    if(mMapAddr && offset >= mMapOffset && offset + (off_t)size <= mMapOffset + (off_t)mMapLength)
+        return (const char*)mMapAddr + (offset - mMapOffset);
+
+    if(mMapAddr && munmap(mMapAddr, mMapLength) != 0)
+        std::cerr << "Failed to unmap '" + mFileName + "' because of: " + strerror(errno) << std::endl;
+    mMapAddr = nullptr;
+    mMapLength = 0;
 
+    // Offset for mmap() must be page aligned. Map the next window (or more,
+    // if that much is needed at once), but not past the read end offset.
+    static const off_t pageSize = sysconf(_SC_PAGE_SIZE);
+    off_t alignedOffset = offset & ~(pageSize - 1);
+    size_t mapLength = std::max(mMapWindowSize, (size_t)(offset - alignedOffset) + size);
+    if(alignedOffset + (off_t)mapLength > mReadEndOffset)
+        mapLength = mReadEndOffset - alignedOffset;
+
+    // Note: The window is read in at once (MAP_POPULATE) rather than page
+    // fault by page fault, and the kernel is told to read ahead of it
+    void* addr = mmap(NULL, mapLength, PROT_READ, MAP_PRIVATE | MAP_POPULATE, mFd, alignedOffset);
+    if(addr == MAP_FAILED)
+    {
         int errNo = errno;
+        mErrNo = errNo;
         mErrMsg = "Could not map '" + mFileName + "' because of: ";
         mErrMsg += strerror(errNo);
-        return false;
+        return nullptr;
     }
+    madvise(addr, mapLength, MADV_SEQUENTIAL);
+
     mMapAddr = addr;
     mMapLength = mapLength;
-
-    // Get the actual file read address
-    mReadAddr = (unsigned char*)mMapAddr + mReadBeginOffset - alignedOffset;
-
-    return true;
+    mMapOffset = alignedOffset;
+    return (const char*)mMapAddr + (offset - mMapOffset);
 }
 
 void FileReader::CloseFile()
 {
     mErrMsg.clear();
+    mErrNo = 0;
     mFileName.clear();
     mFileMode = 0;
 
@@ -130,7 +201,19 @@ void FileReader::CloseFile()
     mMapAddr = nullptr;
     mMapLength = 0;
 
-    mReadAddr = nullptr;
+    if(mFd >= 0)
+    {
+        close(mFd);
+        mFd = -1;
+    }
+
+    mMapOffset = 0;
+
+    // Give the buffer back to the pool
+    if(mBuffer && bufferPool.size() < maxPooledBuffers)
+        bufferPool.emplace_back(std::move(mBuffer));
+    mBuffer.reset();
+
     mReadSize = 0;
     mReadBeginOffset = 0;
     mReadEndOffset = 0;
@@ -152,19 +235,21 @@ off_t FileReader::ReadRegularFile(/*out*/ std::string& buf,
     {
         // Nothing left to read
     }
-    else if(maxSize < 0)
-    {
-        // Read all at once
-        buf.assign((char*)mReadAddr, readMaxSize);
-        mReadSize = readMaxSize;
-    }
     else
     {
+        // Read all at once (maxSize < 0) or up to maxSize
         assert(mReadSize < readMaxSize);
-        ssize_t remainingSize = (readMaxSize - mReadSize);
-        size_t toRead = (remainingSize > maxSize ? maxSize : remainingSize);
+        size_t remainingSize = (readMaxSize - mReadSize);
+        size_t toRead = (maxSize < 0 || remainingSize < (size_t)maxSize ? remainingSize : maxSize);
+
+        const char* readAddr = GetReadAddr(mReadSize, toRead);
+        if(!readAddr)
+        {
+            mReadSize = readMaxSize; // Can't read any further
+            return readOffset;
+        }
 
-        buf.assign((char*)mReadAddr + mReadSize, toRead);
+        buf.assign(readAddr, toRead);
         mReadSize += toRead;
     }
 
@@ -188,14 +273,16 @@ off_t FileReader::ReadSparseFile(/*out*/ std::string& buf,
 
     // If maxSize is smaller than mMaxSparseBlockSize, then don't check
     // for sparseness and just read normally
+    // Note: Not ReadFile(), it would come right back here
     if((size_t)maxSize < mMaxSparseBlockSize)
     {
-        return ReadFile(buf, maxSize);
+        return ReadRegularFile(buf, maxSize);
     }
 
     size_t remainingSize = readMaxSize - mReadSize;
     size_t sparseBlockSize = 0;
-    void* readAddr = nullptr;
+    const char* readAddr = nullptr;
+    size_t dataPos = 0;
 
     // Skip sparse blocks
     while(remainingSize > 0)
@@ -206,7 +293,14 @@ off_t FileReader::ReadSparseFile(/*out*/ std::string& buf,
 //                << ", mMaxSparseBlockSize=" << mMaxSparseBlockSize
 //                << ", remainingSize=" << remainingSize << std::endl;
 
-        readAddr = (unsigned char*)mReadAddr + mReadSize;
+        dataPos = mReadSize;
+        readAddr = GetReadAddr(mReadSize, sparseBlockSize);
+        if(!readAddr)
+        {
+            mReadSize = readMaxSize; // Can't read any further
+            return (mReadBeginOffset + mReadSize);
+        }
+
         mReadSize += sparseBlockSize; // Consider this block read
         if(!IsSparse(readAddr, sparseBlockSize))
             break;
@@ -221,8 +315,14 @@ off_t FileReader::ReadSparseFile(/*out*/ std::string& buf,
         return (mReadBeginOffset + mReadSize);
     }
 
-    // We found un-sparse block (valid data)
-    void* beginDataAddr = readAddr;
+    // We found un-sparse block (valid data).
+    // Note: Make sure all the data we can get is mapped at once.
+    const char* beginDataAddr = GetReadAddr(dataPos, std::min((size_t)maxSize, readMaxSize - dataPos));
+    if(!beginDataAddr)
+    {
+        mReadSize = readMaxSize; // Can't read any further
+        return (mReadBeginOffset + mReadSize);
+    }
     size_t dataSize = sparseBlockSize;
     remainingSize -= sparseBlockSize;
     assert(mReadSize < readMaxSize || remainingSize == 0);
@@ -239,10 +339,13 @@ off_t FileReader::ReadSparseFile(/*out*/ std::string& buf,
         if(dataSize + sparseBlockSize > (size_t)maxSize)
             break; // No more room for data
 
-        readAddr = (unsigned char*)mReadAddr + mReadSize;
-        mReadSize += sparseBlockSize; // Consider this block read
+        // Note: The sparse block is left for the next read to skip, so a
+        // file ending with it is read up to the end (with no data), and the
+        // caller knows to extend the file over it
+        readAddr = beginDataAddr + (mReadSize - dataPos);
         if(IsSparse(readAddr, sparseBlockSize))
             break;
+        mReadSize += sparseBlockSize; // Consider this block read
 
         // Go to the next block
         dataSize += sparseBlockSize;
@@ -251,14 +354,14 @@ off_t FileReader::ReadSparseFile(/*out*/ std::string& buf,
 
     // Get all the data
     assert(dataSize <= (size_t)maxSize);
-    buf.assign((char*)beginDataAddr, dataSize);
+    buf.assign(beginDataAddr, dataSize);
 
-    // Get data offset
-    return ((unsigned char*)beginDataAddr - (unsigned char*)mReadAddr);
+    // Get data offset (in the file, not in the read range)
+    return mReadBeginOffset + dataPos;
 }
 
 // Preserve sparseness support
-bool FileReader::IsSparse(void* addr, size_t size)
+bool FileReader::IsSparse(const void* addr, size_t size)
 {
     // Treat input bytes as array of longs for a faster performance
     const long* lbuf  = reinterpret_cast<const long*>(addr);
@@ -275,7 +378,7 @@ bool FileReader::IsSparse(void* addr, size_t size)
     if(rest == 0)
         return true; // No  remaining bytes
 
-    const char* buf = reinterpret_cast<char*>(addr) + size - rest;
+    const char* buf = reinterpret_cast<const char*>(addr) + size - rest;
 
     for(size_t i = 0; i < rest; i++)
     {
@@ -296,9 +399,11 @@ size_t FileReader::Checksum(const std::string& fileName)
     if(reader.mFileSize == 0)
         return 0; // The file is empty, nothing to checksum
 
-    assert(reader.mReadAddr != nullptr);
+    const char* addr = reader.GetReadAddr(0, reader.mFileSize);
+    if(!addr)
+        return 0;  // Failed to map
 
     std::hash<std::string_view> hash;
-    return hash(std::string_view((char*)reader.mReadAddr, reader.mFileSize));
+    return hash(std::string_view(addr, reader.mFileSize));
 }
 
@@ -5,6 +5,9 @@
 #define __FILE_READER_H__
 
 #include <string>
+#include <vector>
+#include <memory>           // std::unique_ptr
+#include <fcntl.h>          // AT_FDCWD
 
 //
 // Helper class to read file
@@ -13,12 +16,17 @@ class FileReader
 {
 public:
     FileReader() = default;
-    ~FileReader() { if(IsValid()) { CloseFile(); } }
+    ~FileReader() { CloseFile(); }
 
     //
     // Note: Only single ReadFile() per OpenFile() supported
     //
-    bool OpenFile(const std::string& fileName, off_t readBeginOffset, off_t readEndOffset /* -1 for EOF */);
+    bool OpenFile(int dirFd, const std::string& fileName, off_t readBeginOffset, off_t readEndOffset /* -1 for EOF */);
+    bool OpenFile(const std::string& fileName, off_t readBeginOffset, off_t readEndOffset /* -1 for EOF */)
+    {
+        return OpenFile(AT_FDCWD, fileName, readBeginOffset, readEndOffset);
+    }
+    bool OpenFile(int dirFd, const std::string& fileName) { return OpenFile(dirFd, fileName, 0, -1); } // Relative to dirFd
     bool OpenFile(const std::string& fileName) { return OpenFile(fileName, 0, -1); } // To read entire file
     void CloseFile();
 
@@ -31,38 +39,59 @@ public:
     const std::string& GetFileName() { return mFileName; }
     off_t GetFileSize() { return mFileSize; }
     mode_t GetFileMode() { return mFileMode; }
+    int GetFd() { return mFd; }     // -1 if nothing to read
     const std::string& GetError() { return mErrMsg; }
+    int GetErrno() { return mErrNo; } // Of the error (0 - not a system call error)
     void SetError(const std::string& err) { mErrMsg = err; };
     bool HasMore() { return (mFileSize > 0 && mReadSize < (size_t)(mReadEndOffset - mReadBeginOffset)); }
 
     // Get the hash value of the entire file
     static size_t Checksum(const std::string& fileName);
 
-    //void * GetReadBeginAddr() { return mReadAddr; }     // Read address corresponding to begin offset
     //size_t GetReadMaxSize() { return (mReadEndOffset - mReadBeginOffset); } // Max size to read
     size_t GetReadSize() { return mReadSize; }          // Current read size
 
     // Preserve sparseness support
     void  SetSparseBlockSize(size_t sparseBlockSize) { mMaxSparseBlockSize = sparseBlockSize; }
 
+    // How to read the file (must be set before OpenFile). Files (read ranges)
+    // up to preadMaxSize bytes are read at once into a buffer pooled by the
+    // thread, larger ones are mapped mapWindowSize bytes at a time.
+    static constexpr size_t defaultPreadMaxSize = 256 * 1024;           // 256KB
+    static constexpr size_t defaultMapWindowSize = 64 * 1024 * 1024;    // 64MB
+    void SetReadStrategy(size_t preadMaxSize, size_t mapWindowSize)
+    {
+        mPreadMaxSize = preadMaxSize;
+        mMapWindowSize = (mapWindowSize > 0 ? mapWindowSize : defaultMapWindowSize);
+    }
+
 private:
     off_t ReadRegularFile(/*out*/ std::string& buf, ssize_t maxSize /* -1 for all */);
 
     // Preserve sparseness support
     off_t ReadSparseFile(/*out*/ std::string& buf, ssize_t maxSize /* -1 for all */);
-    bool IsSparse(void* addr, size_t size);
+    bool IsSparse(const void* addr, size_t size);
+
+    bool ReadIntoBuffer();
+    const char* GetReadAddr(size_t pos, size_t size);
 
 protected:
     // Class data
     std::string mErrMsg;
+    int mErrNo{0};
     std::string mFileName;
     off_t mFileSize{0};
     mode_t mFileMode{0};
+    int mFd{-1};
 
+    // Read buffer (small files) or the current mapping window (large files)
+    std::unique_ptr<std::vector<char>> mBuffer;
     void* mMapAddr{nullptr};
     size_t mMapLength{0};
+    off_t mMapOffset{0};
+    size_t mPreadMaxSize{defaultPreadMaxSize};
+    size_t mMapWindowSize{defaultMapWindowSize};
 
-    void* mReadAddr{nullptr};
     size_t mReadSize{0};
     off_t mReadBeginOffset{0};
     off_t mReadEndOffset{0};
@@ -0,0 +1,430 @@
+//
+// fileReceiver.cpp
+//
+#include "fileReceiver.h"
+#include "dirReader.h"
+#include <filesystem>       // std::filesystem
+#include <thread>           // std::thread
+#include <sys/socket.h>     // accept4(), shutdown()
+#include <sys/stat.h>       // mkdirat()
+#include <fcntl.h>          // AT_FDCWD
+#include <string.h>         // strerror()
+#include <iostream>         // std::cerr
+
+FileReceiver::~FileReceiver()
+{
+    Stop();
+    if(mListenFd >= 0)
+        close(mListenFd);
+}
+
+bool FileReceiver::Listen(const std::string& address)
+{
+    mListenFd = TransferProtocol::Listen(address, mErrMsg);
+    return (mListenFd >= 0);
+}
+
+bool FileReceiver::Run(const std::string& destDir)
+{
+    if(mListenFd < 0)
+    {
+        mErrMsg = "Not listening";
+        return false;
+    }
+
+    // Make a destination directory (if doesn't exist)
+    std::error_code err;
+    std::filesystem::create_directories(destDir, err);
+    if(err)
+    {
+        mErrMsg = "Failed to make '" + destDir + "' directory - " + err.message();
+        return false;
+    }
+
+    mDestDir = DirReader::OpenDir(AT_FDCWD, destDir.c_str(), destDir, mErrMsg);
+    if(!mDestDir)
+        return false;
+
+    mTpool.Create(mThreadCount);
+
+    while(true)
+    {
+        int fd = accept4(mListenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if(fd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            std::unique_lock<std::mutex> lock(mMutex);
+            if(!mStop)
+                mErrMsg = std::string("Failed to accept connection because of: ") + strerror(errno);
+            break;
+        }
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        if(mStop)
+        {
+            close(fd);
+            break;
+        }
+
+        // Connection threads are counted by mConnectionFds
+        mConnectionFds.insert(fd);
+        mStats.connections++;
+        std::thread(&FileReceiver::HandleConnection, this, fd).detach();
+    }
+
+    // Wait for all connections to be done (and their files written)
+    Stop();
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while(!mConnectionFds.empty())
+            mCv.wait(lock);
+    }
+
+    mTpool.Destroy();
+    mDestDir.reset();
+    return mErrMsg.empty();
+}
+
+void FileReceiver::Stop()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStop = true;
+
+    // Wake up threads blocked on accept() and read()
+    if(mListenFd >= 0)
+        shutdown(mListenFd, SHUT_RDWR);
+    for(int fd : mConnectionFds)
+        shutdown(fd, SHUT_RDWR);
+
+    mCv.notify_all();
+}
+
+FileReceiver::Stats FileReceiver::GetStats()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+void FileReceiver::HandleConnection(int fd)
+{
+    Connection conn;
+    conn.fd = fd;
+
+    std::string error;
+    std::string payload;
+    bool hello = false;
+
+    while(error.empty())
+    {
+        char buf[TransferProtocol::headerSize];
+        if(!TransferProtocol::ReadAll(fd, buf, sizeof(buf)))
+            break; // Connection closed
+
+        TransferProtocol::Header header = TransferProtocol::UnpackHeader(buf);
+        if(header.size > TransferProtocol::maxPayloadSize)
+        {
+            error = "Invalid message size " + std::to_string(header.size);
+            break;
+        }
+
+        payload.resize(header.size);
+        if(!TransferProtocol::ReadAll(fd, payload.data(), payload.size()))
+            break;
+
+        // Make sure we talk to the sender first
+        if(!hello)
+        {
+            hello = (header.type == MsgType::Hello && payload == TransferProtocol::helloText);
+            if(!hello)
+                error = "Unexpected sender greeting";
+            continue;
+        }
+
+        error = HandleMessage(conn, header, payload);
+    }
+
+    // Drop files still in progress (connection is lost).
+    // Note: Files we haven't got the end of are not going anywhere.
+    std::vector<File*> lostFiles;
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for(auto& [id, file] : conn.files)
+        {
+            if(!file->ended)
+                lostFiles.push_back(file.get());
+        }
+    }
+    for(File* file : lostFiles)
+        AddChunk(file, Chunk { MsgType::End, -1, std::string() });
+
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while(!conn.files.empty())
+            mCv.wait(lock);
+
+        if(!error.empty())
+        {
+            // Note: Nobody to report it to, but the receiver log
+            std::cerr << "Dropped connection because of: " << error << std::endl;
+            mStats.failures++;
+        }
+
+        close(fd);
+        mConnectionFds.erase(fd);
+        mCv.notify_all();
+    }
+}
+
+std::string FileReceiver::HandleMessage(Connection& conn, const TransferProtocol::Header& header, std::string& payload)
+{
+    switch(header.type)
+    {
+    case MsgType::Dir:
+    {
+        std::string errMsg;
+        if(!IsValidPath(payload))
+            return "Invalid directory path '" + payload + "'";
+
+        if(!MakeDirs(payload, errMsg))
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            conn.failedFiles++;
+            mStats.failures++;
+            if(conn.firstError.empty())
+                conn.firstError = errMsg;
+        }
+        return "";
+    }
+
+    case MsgType::Open:
+    {
+        if(!IsValidPath(payload))
+            return "Invalid file path '" + payload + "'";
+
+        auto file = std::make_unique<File>();
+        file->id = header.id;
+        file->path = payload;
+        file->conn = &conn;
+        File* filePtr = file.get();
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            if(!conn.files.emplace(header.id, std::move(file)).second)
+                return "Duplicate file id " + std::to_string(header.id);
+        }
+
+        // Note: Files are opened by the pool threads too
+        AddChunk(filePtr, Chunk { MsgType::Open, 0, std::string() });
+        return "";
+    }
+
+    case MsgType::Data:
+    case MsgType::End:
+    {
+        if(payload.size() < 8)
+            return "Invalid message size " + std::to_string(payload.size());
+
+        File* file = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            auto it = conn.files.find(header.id);
+            if(it != conn.files.end())
+                file = it->second.get();
+        }
+        if(!file)
+            return "Unknown file id " + std::to_string(header.id);
+
+        if(file->ended)
+            return "Message after the end of file " + std::to_string(header.id);
+
+        Chunk chunk;
+        chunk.type = header.type;
+        chunk.offset = TransferProtocol::UnpackUint64(payload.data());
+        if(header.type == MsgType::Data)
+        {
+            payload.erase(0, 8);
+            chunk.data = std::move(payload);
+        }
+        else
+        {
+            file->ended = true;
+        }
+
+        AddChunk(file, std::move(chunk));
+        return "";
+    }
+
+    case MsgType::Done:
+    {
+        // Wait for all connection files to be written, then let the sender know
+        uint32_t failedFiles;
+        std::string firstError;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            while(!conn.files.empty())
+                mCv.wait(lock);
+
+            failedFiles = conn.failedFiles;
+            firstError = conn.firstError;
+            conn.failedFiles = 0;
+            conn.firstError.clear();
+        }
+
+        char buf[TransferProtocol::headerSize + 4];
+        uint32_t failed = htobe32(failedFiles);
+        TransferProtocol::PackHeader(buf, MsgType::Status, 0, 4 + firstError.size());
+        memcpy(buf + TransferProtocol::headerSize, &failed, 4);
+
+        struct iovec iov[2] = { { buf, sizeof(buf) }, { firstError.data(), firstError.size() } };
+        if(!TransferProtocol::WriteAll(conn.fd, iov, 2))
+            return std::string("Failed to send status because of: ") + strerror(errno);
+        return "";
+    }
+
+    default:
+        return "Unexpected message type " + std::to_string((int)header.type);
+    }
+}
+
+void FileReceiver::AddChunk(File* file, Chunk&& chunk)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    // Wait for writers to catch up
+    while(!mStop && mBufferSize > 0 && mBufferSize + chunk.data.size() > mMaxBufferSize)
+        mCv.wait(lock);
+
+    mBufferSize += chunk.data.size();
+    file->chunks.emplace_back(std::move(chunk));
+    if(file->busy)
+        return; // Pool thread will get to it
+
+    file->busy = true;
+    lock.unlock();
+    mTpool.Post([this](File* file) { WriteChunks(file); }, file);
+}
+
+void FileReceiver::WriteChunks(File* file)
+{
+    while(true)
+    {
+        Chunk chunk;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            if(file->chunks.empty())
+            {
+                file->busy = false;
+                return;
+            }
+            chunk = std::move(file->chunks.front());
+            file->chunks.pop_front();
+        }
+
+        // Note: Once the file failed, we just drop the rest of its data
+        if(file->error.empty())
+            WriteChunk(*file, chunk);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mBufferSize -= chunk.data.size();
+        mStats.bytes += (file->error.empty() ? chunk.data.size() : 0);
+        mCv.notify_all();
+
+        if(chunk.type == MsgType::End)
+        {
+            file->writer.CloseFile();
+
+            Connection* conn = file->conn;
+            if(!file->error.empty())
+            {
+                conn->failedFiles++;
+                mStats.failures++;
+                if(conn->firstError.empty())
+                    conn->firstError = file->error + " (" + file->path + ")";
+            }
+            else
+            {
+                mStats.files++;
+            }
+
+            // Note: The file is gone now
+            conn->files.erase(file->id);
+            return;
+        }
+    }
+}
+
+void FileReceiver::WriteChunk(File& file, const Chunk& chunk)
+{
+    FileWriter& writer = file.writer;
+
+    if(chunk.type == MsgType::Open)
+    {
+        if(!writer.OpenFile(mDestDir->GetFd(), file.path))
+        {
+            // Make the file directories if they are not there yet
+            // (directory messages could come through another connection)
+            std::string errMsg = writer.GetError();
+            writer.CloseFile();
+
+            size_t slash = file.path.rfind('/');
+            if(slash == std::string::npos || !MakeDirs(file.path.substr(0, slash), errMsg) ||
+               !writer.OpenFile(mDestDir->GetFd(), file.path))
+            {
+                file.error = (writer.GetError().empty() ? errMsg : writer.GetError());
+                return;
+            }
+        }
+    }
+    else if(chunk.type == MsgType::Data)
+    {
+        writer.WriteFile(chunk.data, chunk.offset);
+        if(!writer.IsValid())
+            file.error = writer.GetError();
+    }
+    else if(chunk.offset < 0)
+    {
+        file.error = "Connection closed before the end of file";
+    }
+    else if(!writer.TruncateFile(chunk.offset))
+    {
+        // Note: Truncate to set the size if the file ends with a hole
+        file.error = writer.GetError();
+    }
+}
+
+bool FileReceiver::MakeDirs(const std::string& path, std::string& errMsg)
+{
+    // Make every directory of the path relative to the destination directory
+    size_t pos = 0;
+    while(pos != std::string::npos)
+    {
+        pos = path.find('/', pos + 1);
+        std::string dir = path.substr(0, pos);
+        if(mkdirat(mDestDir->GetFd(), dir.c_str(), 0770) != 0 && errno != EEXIST)
+        {
+            errMsg = "Failed to make '" + mDestDir->GetPath() + "/" + dir + "' directory - " + strerror(errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FileReceiver::IsValidPath(const std::string& path)
+{
+    // Must stay inside the destination directory
+    if(path.empty() || path[0] == '/')
+        return false;
+
+    size_t pos = 0;
+    while(pos <= path.size())
+    {
+        size_t end = path.find('/', pos);
+        if(end == std::string::npos)
+            end = path.size();
+        if(path.compare(pos, end - pos, "..") == 0)
+            return false;
+        pos = end + 1;
+    }
+    return true;
+}
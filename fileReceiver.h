@@ -0,0 +1,114 @@
+//
+// fileReceiver.h
+//
+#ifndef __FILE_RECEIVER_H__
+#define __FILE_RECEIVER_H__
+
+#include <string>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <memory>       // std::unique_ptr
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <stdint.h>     // uint32_t
+#include "dirFd.h"
+#include "fileWriter.h"
+#include "threadPool.h"
+#include "transferProtocol.h"
+
+//
+// Class FileReceiver to receive directories and files sent by FileSender
+// (see fileSender.h) and write them into the destination directory.
+// Every connection is read by its own thread, and files are written by the
+// pool threads in parallel (data of the same file in order). Data waiting
+// to be written is limited to maxBufferSize bytes, then connection threads
+// stop reading (and senders stop sending).
+//
+class FileReceiver
+{
+public:
+    FileReceiver(int threadCount=4, size_t maxBufferSize=64*1024*1024)
+        : mThreadCount(threadCount), mMaxBufferSize(maxBufferSize) {}
+    ~FileReceiver();
+
+    FileReceiver(const FileReceiver&) = delete;
+    FileReceiver& operator=(const FileReceiver&) = delete;
+
+    bool Listen(const std::string& address);
+
+    // Receive files into destDir until Stop() is called
+    bool Run(const std::string& destDir);
+
+    // Stop receiving (can be called by any thread)
+    void Stop();
+
+    struct Stats
+    {
+        size_t connections{0};  // Connections accepted
+        size_t files{0};        // Files written
+        size_t bytes{0};        // Bytes written (excluding holes)
+        size_t failures{0};     // Files (or directories) we failed to write
+    };
+    Stats GetStats();
+
+    const std::string& GetError() { return mErrMsg; }
+
+private:
+    using MsgType = TransferProtocol::MsgType;
+
+    struct File;
+
+    struct Connection
+    {
+        int fd{-1};
+        std::map<uint32_t, std::unique_ptr<File>> files;    // Files in progress (by id)
+        uint32_t failedFiles{0};
+        std::string firstError;
+    };
+
+    struct Chunk
+    {
+        MsgType type{MsgType::Data};
+        off_t offset{0};        // Data offset or file size (End, -1 if connection is lost)
+        std::string data;
+    };
+
+    struct File
+    {
+        uint32_t id{0};
+        std::string path;       // Relative to the destination directory
+        Connection* conn{nullptr};
+        FileWriter writer;
+        std::deque<Chunk> chunks;   // Waiting to be written
+        bool busy{false};           // Pool thread is writing chunks
+        bool ended{false};          // Got the end of file (connection thread only)
+        std::string error;
+    };
+
+    void HandleConnection(int fd);
+    std::string HandleMessage(Connection& conn, const TransferProtocol::Header& header, std::string& payload);
+    void AddChunk(File* file, Chunk&& chunk);
+    void WriteChunks(File* file);
+    void WriteChunk(File& file, const Chunk& chunk);
+    bool MakeDirs(const std::string& path, std::string& errMsg);
+    static bool IsValidPath(const std::string& path);
+
+    int mThreadCount{0};
+    size_t mMaxBufferSize{0};
+    int mListenFd{-1};
+    DirFdPtr mDestDir;
+    ThreadPool mTpool;
+
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    bool mStop{false};
+    std::set<int> mConnectionFds;
+    size_t mBufferSize{0};
+    Stats mStats;
+    std::string mErrMsg;
+};
+
+#endif // __FILE_RECEIVER_H__
@@ -0,0 +1,182 @@
+//
+// fileSender.cpp
+//
+#include "fileSender.h"
+#include <sys/socket.h>     // shutdown()
+
+bool FileSender::Connect(const std::string& address, int connectionCount)
+{
+    Close();
+
+    for(int i = 0; i < (connectionCount > 0 ? connectionCount : 1); i++)
+    {
+        std::string errMsg;
+        int fd = TransferProtocol::Connect(address, errMsg);
+        if(fd < 0)
+        {
+            SetError(errMsg);
+            Close();
+            return false;
+        }
+
+        mConnections.emplace_back(std::make_unique<Connection>());
+        mConnections.back()->fd = fd;
+
+        // Let the receiver know who we are
+        std::string hello(TransferProtocol::helloText);
+        if(!Send(i, MsgType::Hello, nullptr, 0, hello))
+        {
+            Close();
+            return false;
+        }
+    }
+
+    mAborted = false;
+    return true;
+}
+
+bool FileSender::SendDir(const std::string& path)
+{
+    // Note: Directories go through the first connection
+    return Send(0, MsgType::Dir, nullptr, 0, path);
+}
+
+bool FileSender::SendFileOpen(uint32_t fileId, const std::string& path)
+{
+    return Send(fileId, MsgType::Open, nullptr, 0, path);
+}
+
+bool FileSender::SendFileData(uint32_t fileId, off_t offset, const std::string& data)
+{
+    char prefix[8];
+    TransferProtocol::PackUint64(prefix, offset);
+    return Send(fileId, MsgType::Data, prefix, sizeof(prefix), data);
+}
+
+bool FileSender::SendFileEnd(uint32_t fileId, off_t fileSize)
+{
+    char prefix[8];
+    TransferProtocol::PackUint64(prefix, fileSize);
+    return Send(fileId, MsgType::End, prefix, sizeof(prefix), std::string());
+}
+
+bool FileSender::Send(uint32_t fileId, MsgType type, const char* prefix, size_t prefixSize, const std::string& data)
+{
+    if(mAborted)
+        return false;
+
+    if(prefixSize + data.size() > TransferProtocol::maxPayloadSize)
+    {
+        SetError("Message is too large (" + std::to_string(prefixSize + data.size()) + " bytes)");
+        return false;
+    }
+
+    char header[TransferProtocol::headerSize];
+    TransferProtocol::PackHeader(header, type, fileId, prefixSize + data.size());
+
+    struct iovec iov[3];
+    int iovCount = 0;
+    iov[iovCount++] = { header, sizeof(header) };
+    if(prefixSize > 0)
+        iov[iovCount++] = { (void*)prefix, prefixSize };
+    if(!data.empty())
+        iov[iovCount++] = { (void*)data.data(), data.size() };
+
+    Connection& conn = GetConnection(fileId);
+    std::unique_lock<std::mutex> lock(conn.mutex);
+    if(!TransferProtocol::WriteAll(conn.fd, iov, iovCount))
+    {
+        if(!mAborted)
+            SetError(std::string("Failed to send to the receiver because of: ") + strerror(errno));
+        mAborted = true;
+        return false;
+    }
+
+    return true;
+}
+
+bool FileSender::Finish()
+{
+    if(mConnections.empty())
+        return false;
+
+    // Let the receiver know we are done with all connections first, so it
+    // waits for their files in parallel
+    for(size_t i = 0; i < mConnections.size() && !mAborted; i++)
+        Send(i, MsgType::Done, nullptr, 0, std::string());
+
+    // Then wait for every connection status
+    uint32_t failedFiles = 0;
+    std::string firstError;
+    for(size_t i = 0; i < mConnections.size() && !mAborted; i++)
+    {
+        char header[TransferProtocol::headerSize];
+        TransferProtocol::Header status;
+        std::string payload;
+
+        int fd = mConnections[i]->fd;
+        bool res = TransferProtocol::ReadAll(fd, header, sizeof(header));
+        if(res)
+        {
+            status = TransferProtocol::UnpackHeader(header);
+            res = (status.type == MsgType::Status && status.size >= 4 && status.size <= TransferProtocol::maxPayloadSize);
+        }
+        if(res)
+        {
+            payload.resize(status.size);
+            res = TransferProtocol::ReadAll(fd, payload.data(), payload.size());
+        }
+        if(!res)
+        {
+            SetError("Failed to get the receiver status");
+            mAborted = true;
+            break;
+        }
+
+        uint32_t failed;
+        memcpy(&failed, payload.data(), 4);
+        failedFiles += be32toh(failed);
+        if(firstError.empty())
+            firstError = payload.substr(4);
+    }
+
+    if(failedFiles > 0)
+        SetError("Receiver failed to write " + std::to_string(failedFiles) + " file(s): " + firstError);
+
+    bool res = (!mAborted && failedFiles == 0);
+    Close();
+    return res;
+}
+
+void FileSender::Abort()
+{
+    mAborted = true;
+
+    // Wake up threads blocked sending to (or receiving from) the receiver.
+    // Note: Descriptors are closed later by Close(), once nobody uses them.
+    std::unique_lock<std::mutex> lock(mConnectionsMutex);
+    for(auto& conn : mConnections)
+        shutdown(conn->fd, SHUT_RDWR);
+}
+
+void FileSender::Close()
+{
+    std::unique_lock<std::mutex> lock(mConnectionsMutex);
+    for(auto& conn : mConnections)
+        close(conn->fd);
+    mConnections.clear();
+}
+
+std::string FileSender::GetError()
+{
+    std::unique_lock<std::mutex> lock(mErrMsgMutex);
+    return mErrMsg;
+}
+
+void FileSender::SetError(const std::string& err)
+{
+    // Note: we only set the first error as most relevant
+    std::unique_lock<std::mutex> lock(mErrMsgMutex);
+    if(mErrMsg.empty())
+        mErrMsg = err;
+}
@@ -0,0 +1,74 @@
+//
+// fileSender.h
+//
+#ifndef __FILE_SENDER_H__
+#define __FILE_SENDER_H__
+
+#include <string>
+#include <vector>
+#include <memory>       // std::unique_ptr
+#include <mutex>
+#include <atomic>
+#include <stdint.h>     // uint32_t
+#include <sys/types.h>  // off_t
+#include "transferProtocol.h"
+
+//
+// Class FileSender to send directories and files to the receiver (see
+// fileReceiver.h) over a few connections shared by all the copy threads.
+// Every file goes through one connection (picked by file id), but files
+// sent by different threads are multiplexed on the same connection.
+//
+class FileSender
+{
+public:
+    FileSender() = default;
+    ~FileSender() { Close(); }
+
+    FileSender(const FileSender&) = delete;
+    FileSender& operator=(const FileSender&) = delete;
+
+    bool Connect(const std::string& address, int connectionCount);
+
+    // Every file needs its own id to send it
+    uint32_t NextFileId() { return mNextFileId++; }
+
+    // Paths are relative to the receiver destination directory.
+    // Return false if failed (see GetError) or aborted.
+    bool SendDir(const std::string& path);
+    bool SendFileOpen(uint32_t fileId, const std::string& path);
+    bool SendFileData(uint32_t fileId, off_t offset, const std::string& data);
+    bool SendFileEnd(uint32_t fileId, off_t fileSize);
+
+    // Wait for the receiver to write all the files we sent and get its status
+    bool Finish();
+
+    // Stop sending (can be called by any thread)
+    void Abort();
+    bool IsAborted() { return mAborted; }
+
+    std::string GetError();
+
+private:
+    struct Connection
+    {
+        int fd{-1};
+        std::mutex mutex;   // Messages are written as a whole
+    };
+
+    using MsgType = TransferProtocol::MsgType;
+
+    bool Send(uint32_t fileId, MsgType type, const char* prefix, size_t prefixSize, const std::string& data);
+    Connection& GetConnection(uint32_t fileId) { return *mConnections[fileId % mConnections.size()]; }
+    void SetError(const std::string& err);
+    void Close();
+
+    std::vector<std::unique_ptr<Connection>> mConnections;
+    std::mutex mConnectionsMutex;       // Abort() vs. Close()
+    std::atomic<uint32_t> mNextFileId{1};
+    std::atomic<bool> mAborted{false};
+    std::mutex mErrMsgMutex;
+    std::string mErrMsg;
+};
+
+#endif // __FILE_SENDER_H__
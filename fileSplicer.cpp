@@ -0,0 +1,188 @@
+//
+// fileSplicer.cpp
+//
+#include "fileSplicer.h"
+#include <unistd.h>         // lseek(), pipe2()
+#include <string.h>         // strerror()
+#include <sys/stat.h>       // fstat()
+#include <algorithm>        // std::min()
+
+// Thread pipe, re-used for all the files the thread splices
+struct SplicePipe
+{
+    SplicePipe() { Open(); }
+    ~SplicePipe() { Close(); }
+
+    SplicePipe(const SplicePipe&) = delete;
+    SplicePipe& operator=(const SplicePipe&) = delete;
+
+    void Open()
+    {
+        if(pipe2(fds, O_CLOEXEC) != 0)
+        {
+            fds[0] = fds[1] = -1;
+            return;
+        }
+
+        // Note: Smaller pipe (the system max size) is fine too, only slower
+        size = fcntl(fds[1], F_SETPIPE_SZ, (int)FileSplicer::pipeSize);
+        if(size <= 0)
+            size = fcntl(fds[1], F_GETPIPE_SZ);
+    }
+
+    void Close()
+    {
+        if(fds[0] >= 0)
+            close(fds[0]);
+        if(fds[1] >= 0)
+            close(fds[1]);
+        fds[0] = fds[1] = -1;
+    }
+
+    int fds[2] {-1, -1};
+    int size{0};
+};
+
+static thread_local SplicePipe splicePipe;
+
+bool FileSplicer::OpenFile(int dirFd, const std::string& fileName, off_t readBeginOffset /*=0*/)
+{
+    CloseFile();
+
+    mFileName = fileName;
+    mFd = openat(dirFd, mFileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if(mFd < 0)
+    {
+        mErrNo = errno;
+        mErrMsg = "Could not open '" + mFileName + "' because of: " + strerror(mErrNo);
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(mFd, &st) != 0)
+    {
+        mErrNo = errno;
+        mErrMsg = "Could not fstat '" + mFileName + "' because of: " + strerror(mErrNo);
+        return false;
+    }
+
+    if(readBeginOffset > st.st_size)
+    {
+        mErrMsg = "Read begin offset " + std::to_string(readBeginOffset) + " is greater than file size "
+                  + std::to_string(st.st_size) + " of the file '" + mFileName + "'";
+        return false;
+    }
+
+    mFileSize = st.st_size;
+    mReadBeginOffset = readBeginOffset;
+    mReadOffset = readBeginOffset;
+    mDataEnd = 0;
+
+    if(splicePipe.fds[0] < 0)
+    {
+        mErrNo = errno;
+        mErrMsg = std::string("Could not make a pipe because of: ") + strerror(mErrNo);
+        return false;
+    }
+
+    return true;
+}
+
+void FileSplicer::CloseFile()
+{
+    mErrMsg.clear();
+    mErrNo = 0;
+    mFileName.clear();
+
+    if(mFd >= 0)
+    {
+        close(mFd);
+        mFd = -1;
+    }
+
+    mFileSize = 0;
+    mReadBeginOffset = 0;
+    mReadOffset = 0;
+    mDataEnd = 0;
+}
+
+// Find the data extent at (or after) the read offset
+bool FileSplicer::FindData()
+{
+    off_t dataBegin = lseek(mFd, mReadOffset, SEEK_DATA);
+    if(dataBegin < 0 && errno == ENXIO)
+    {
+        mReadOffset = mFileSize; // Only a hole left
+        return true;
+    }
+
+    off_t dataEnd = (dataBegin < 0 ? -1 : lseek(mFd, dataBegin, SEEK_HOLE));
+    if(dataEnd < 0)
+    {
+        // Note: File systems without SEEK_DATA support have it all data
+        if(errno != EINVAL)
+        {
+            mErrNo = errno;
+            mErrMsg = "Could not find data in '" + mFileName + "' because of: " + strerror(mErrNo);
+            return false;
+        }
+        dataBegin = mReadOffset;
+        dataEnd = mFileSize;
+    }
+
+    mReadOffset = dataBegin;
+    mDataEnd = std::min(dataEnd, mFileSize);
+    return true;
+}
+
+ssize_t FileSplicer::SpliceFile(int destFd, size_t maxSize, off_t& dataOffset)
+{
+    if(mReadOffset >= mDataEnd && !FindData())
+        return -1;
+
+    dataOffset = mReadOffset;
+    if(mReadOffset >= mFileSize)
+        return 0;
+
+    size_t size = std::min((size_t)(mDataEnd - mReadOffset), std::min(maxSize, (size_t)splicePipe.size));
+
+    // File to pipe...
+    off_t srcOffset = mReadOffset;
+    ssize_t got = 0;
+    while((got = splice(mFd, &srcOffset, splicePipe.fds[1], nullptr, size, SPLICE_F_MOVE | SPLICE_F_MORE)) < 0 && errno == EINTR)
+        ;
+
+    if(got <= 0)
+    {
+        mErrNo = (got < 0 ? errno : 0);
+        mErrMsg = "Could not splice '" + mFileName + "' because of: ";
+        mErrMsg += (got < 0 ? strerror(mErrNo) : "file was truncated");
+        return -1;
+    }
+
+    // ...and pipe to file (at the same offset)
+    off_t destOffset = mReadOffset;
+    ssize_t rem = got;
+    while(rem > 0)
+    {
+        ssize_t put = splice(splicePipe.fds[0], nullptr, destFd, &destOffset, rem, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(put < 0 && errno == EINTR)
+            continue;
+
+        if(put <= 0)
+        {
+            mErrNo = (put < 0 ? errno : ENOSPC);
+            mErrMsg = "Could not splice to the copy of '" + mFileName + "' because of: ";
+            mErrMsg += (put < 0 ? strerror(mErrNo) : "no space");
+
+            // Note: What is left in the pipe is no good for the next file
+            splicePipe.Close();
+            splicePipe.Open();
+            return -1;
+        }
+        rem -= put;
+    }
+
+    mReadOffset += got;
+    return got;
+}
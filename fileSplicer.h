@@ -0,0 +1,62 @@
+//
+// fileSplicer.h
+//
+#ifndef __FILE_SPLICER_H__
+#define __FILE_SPLICER_H__
+
+#include <string>
+#include <fcntl.h>          // AT_FDCWD
+#include <sys/types.h>      // off_t
+
+//
+// Helper class to copy file data without bringing it to user space: data
+// is spliced from the file to a pipe and from the pipe to the destination
+// file. Every thread has its own pipe (made once, sized with F_SETPIPE_SZ).
+// Only data extents are spliced (found with SEEK_DATA/SEEK_HOLE), so holes
+// stay holes, and the destination file size must be set once done
+// (i.e. with FileWriter::TruncateFile).
+// Note: Both files must support splice() (regular files of most local
+// file systems do), otherwise it fails with EINVAL (or ENOSYS).
+//
+class FileSplicer
+{
+public:
+    FileSplicer() = default;
+    ~FileSplicer() { CloseFile(); }
+
+    FileSplicer(const FileSplicer&) = delete;
+    FileSplicer& operator=(const FileSplicer&) = delete;
+
+    bool OpenFile(int dirFd, const std::string& fileName, off_t readBeginOffset=0);
+    void CloseFile();
+
+    // Splice up to maxSize bytes of the next data to destFd at the same
+    // offset (dataOffset). Return the bytes spliced, 0 if there was no more
+    // data (only a hole) or -1 on error.
+    ssize_t SpliceFile(int destFd, size_t maxSize, off_t& dataOffset);
+
+    bool HasMore() { return (mReadOffset < mFileSize); }
+    bool IsValid() { return mErrMsg.empty(); }
+    const std::string& GetError() { return mErrMsg; }
+    int GetErrno() { return mErrNo; } // Of the error (0 - not a system call error)
+    off_t GetFileSize() { return mFileSize; }
+    size_t GetReadSize() { return mReadOffset - mReadBeginOffset; }
+    off_t GetReadOffset() { return mReadOffset; }   // Data before it is spliced
+    int GetFd() { return mFd; }
+
+    static constexpr size_t pipeSize = 1024 * 1024;  // 1MB (the default max for non-root)
+
+private:
+    bool FindData();
+
+    std::string mErrMsg;
+    int mErrNo{0};
+    std::string mFileName;
+    int mFd{-1};
+    off_t mFileSize{0};
+    off_t mReadBeginOffset{0};
+    off_t mReadOffset{0};       // Where we are
+    off_t mDataEnd{0};          // End of the data extent we are in (0 - not in data)
+};
+
+#endif // __FILE_SPLICER_H__
@@ -4,14 +4,14 @@
 #include "fileWriter.h"
 #include <string.h>     // strerror()
 #include <unistd.h>
-#include <fcntl.h>      // open()
+#include <fcntl.h>      // openat()
 #include <sys/stat.h>   // fstat()
 #include <iostream>
 
 //
 // Log writer implementation
 //
-bool FileWriter::OpenFile(const std::string& fileName, bool append /*= true*/)
+bool FileWriter::OpenFile(int dirFd, const std::string& fileName, Mode mode /*= Mode::Truncate*/)
 {
     if(fileName.empty())
     {
@@ -21,13 +21,17 @@ bool FileWriter::OpenFile(const std::string& fileName, bool append /*= true*/)
 
     mFileName = fileName;
 
-    int flags = O_CREAT | O_RDWR | (append ? O_APPEND : O_TRUNC);
-    int mode = 0660;
+    int flags = O_CREAT | O_RDWR;
+    if(mode == Mode::Truncate)
+        flags |= O_TRUNC;
+    else if(mode == Mode::Append)
+        flags |= O_APPEND;
 
-    int fd = open(mFileName.c_str(), flags, mode);
+    int fd = openat(dirFd, mFileName.c_str(), flags | O_CLOEXEC, 0660);
     if(fd < 0)
     {
         int errNo = errno;
+        mErrNo = errNo;
         mErrMsg = "Could not open '" + mFileName + "' because of: ";
         mErrMsg += strerror(errNo);
         return false;
@@ -37,6 +41,7 @@ bool FileWriter::OpenFile(const std::string& fileName, bool append /*= true*/)
     if(fstat(fd, &st) != 0)
     {
         int errNo = errno;
+        mErrNo = errNo;
         mErrMsg = "Failed to stat '" + mFileName + "' because of: ";
         mErrMsg += strerror(errNo);
         close(fd);
@@ -44,11 +49,19 @@ bool FileWriter::OpenFile(const std::string& fileName, bool append /*= true*/)
     }
 
     mFd = fd;
+    mMode = mode;
     mFileSize = st.st_size;
     return true;
 }
 
 size_t FileWriter::WriteFile(const std::string& buf)
+{
+    // Note: Without O_APPEND, the end of file is where we have written so far
+    return Write(buf, (mMode == Mode::Append ? -1 : (off_t)mFileSize));
+}
+
+// Write at offset (-1 for the current file position)
+size_t FileWriter::Write(const std::string& buf, off_t offset)
 {
     size_t rem = buf.size();    // Bytes remaining to be written
     const void* ptr = buf.c_str();
@@ -57,14 +70,16 @@ size_t FileWriter::WriteFile(const std::string& buf)
     while(rem > 0)
     {
         // more to be written
-        ssize_t wrote = write(mFd, ptr, rem);
+        ssize_t wrote = (offset < 0 ? write(mFd, ptr, rem) : pwrite(mFd, ptr, rem, offset + written));
 
         if(wrote < 0)
         {
-            if(errno == EAGAIN)
+            if(errno == EAGAIN || errno == EINTR)
                 continue;
 
             int errNo = errno;
+
+            mErrNo = errNo;
             mErrMsg = "Failed to write to '" + mFileName + "' because of: ";
             mErrMsg += strerror(errNo);
             break;  // Unrecoverable error
@@ -76,22 +91,22 @@ size_t FileWriter::WriteFile(const std::string& buf)
         ptr = ((char*)ptr) + wrote;   // Advance write point
     }
 
-    // Advance written total and file size
-    mFileSize += written;
+    // Advance file size
+    if(offset < 0)
+        mFileSize += written;
+    else if(offset + written > mFileSize)
+        mFileSize = offset + written;
     return written;
 }
 
 // Preserve sparseness support
 size_t FileWriter::WriteFile(const std::string& buf, off_t offset)
 {
-    if(offset > (off_t)mFileSize)
-    {
-        return (TruncateFile(offset) ? WriteFile(buf) : 0);
-    }
-    else
-    {
-        return WriteFile(buf);
-    }
+    // Skip the hole by extending the file
+    if(offset > (off_t)mFileSize && !TruncateFile(offset))
+        return 0;
+
+    return Write(buf, (mMode == Mode::Append ? -1 : offset));
 }
 
 bool FileWriter::TruncateFile(size_t size)
@@ -104,6 +119,7 @@ bool FileWriter::TruncateFile(size_t size)
         if(errno != EINTR)
         {
             int errNo = errno;
+            mErrNo = errNo;
             mErrMsg = "Failed to truncate '" + mFileName + "' to " + std::to_string(size) + " bytes because of: ";
             mErrMsg += strerror(errNo);
             return false;  // Unrecoverable error
@@ -122,6 +138,7 @@ bool FileWriter::SetFilePermission(mode_t perm)
         if(errno != EINTR)
         {
             int errNo = errno;
+            mErrNo = errNo;
             mErrMsg = "Failed to chmod() '" + mFileName + "' because of: ";
             mErrMsg += strerror(errNo);
             return false;  // Unrecoverable error
@@ -135,6 +152,7 @@ bool FileWriter::SetFilePermission(mode_t perm)
 void FileWriter::CloseFile()
 {
     mErrMsg.clear();
+    mErrNo = 0;
     mFileName.clear();
 
     if(mFd > 0)
@@ -5,6 +5,7 @@
 #define __FILE_WRITER_H__
 
 #include <string>
+#include <fcntl.h>      // AT_FDCWD
 
 //
 // Helper class to write log file
@@ -15,26 +16,41 @@ public:
     FileWriter() = default;
     ~FileWriter() { if(IsValid()) { CloseFile(); } }
 
-    bool OpenFile(const std::string& fileName, bool append = true);
+    // How to open an existing file
+    enum class Mode
+    {
+        Truncate,   // Drop the old content (default)
+        Append,     // Keep the old content, always write at the end of file
+        Keep        // Keep the old content, write at the given offsets (i.e. to resume a copy)
+    };
+
+    bool OpenFile(int dirFd, const std::string& fileName, Mode mode = Mode::Truncate);
+    bool OpenFile(const std::string& fileName, Mode mode = Mode::Truncate) { return OpenFile(AT_FDCWD, fileName, mode); }
     size_t WriteFile(const std::string& buf);
     bool TruncateFile(size_t size);
     bool SetFilePermission(mode_t perm);
     void CloseFile();
 
-    // Preserve sparseness support
+    // Preserve sparseness support (offset can be past the end of file)
     size_t WriteFile(const std::string& buf, off_t offset);
 
     bool IsValid() { return mErrMsg.empty(); }
     const std::string& GetFileName() { return mFileName; }
     const std::string& GetError() { return mErrMsg; }
+    int GetErrno() { return mErrNo; } // Of the error (0 - not a system call error)
     size_t GetFileSize() { return mFileSize; }
+    int GetFd() { return mFd; }
 
 protected:
     std::string mErrMsg;
+    int mErrNo{0};
 
 private:
+    size_t Write(const std::string& buf, off_t offset);
+
     std::string mFileName;
     int mFd{-1};
+    Mode mMode{Mode::Truncate};
     size_t mFileSize{0};
 };
 
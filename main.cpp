@@ -4,23 +4,703 @@
 #include <string.h>     // strcpy()
 #include <limits.h>     // PATH_MAX
 #include <libgen.h>     // dirname()
+#include <getopt.h>     // getopt_long()
+#include <sys/stat.h>   // stat()
+#include <signal.h>     // sigtimedwait()
+#include <fcntl.h>      // open()
+#include <unistd.h>     // close()
+#include <time.h>       // time()
+#include <map>          // std::map
 #include <iostream>     // std::cout
-#include "dirCopy.h"
+#include <fstream>      // std::ofstream
+#include "copyJob.h"
+#include "fileReceiver.h"
+#include "dirEstimate.h"
 
 #define ERRORMSG(msg) std::cout << "[ERROR] " << __func__ << ": " << msg << std::endl;
 #define OUTMSG(msg) std::cout << msg << std::endl;
 
-int main(int argc, const char* argv[])
+static void Usage()
 {
-    if(argc < 3)
+    std::cout << "Usage: copy [options] <source> <destination> <read_block_size (optional)>" << std::endl;
+    std::cout << "       copy --tar [options] <source> <archive | -> <read_block_size (optional)>" << std::endl;
+    std::cout << "       copy --send [options] <source> <address> <read_block_size (optional)>" << std::endl;
+    std::cout << "       copy --receive [options] <address> <destination>" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -s, --sparse=<bytes>       Sparse files read block size (same as read_block_size)" << std::endl;
+    std::cout << "  -o, --order=<order>        Directory entries order: none (default), name or inode" << std::endl;
+    std::cout << "  -S, --schedule=<schedule>  Files copy order: fifo (default), inode, extent or cache" << std::endl;
+    std::cout << "                             (files in the page cache first, the rest as extent)" << std::endl;
+    std::cout << "  -d, --device-threads=[<path>:]<n>" << std::endl;
+    std::cout << "                             Max files copied concurrently per source/destination devices" << std::endl;
+    std::cout << "                             (default: no limit for fifo, 2 for inode/extent). With <path>," << std::endl;
+    std::cout << "                             only for the device of <path> (can be repeated)" << std::endl;
+    std::cout << "  -t, --threads=<n>          Number of copy threads (default 12)" << std::endl;
+    std::cout << "  -a, --adaptive=<min:max>   Adjust number of copy threads at runtime within min...max" << std::endl;
+    std::cout << "  -r, --rate=<bytes>[K|M|G]  Limit copy rate to bytes per second" << std::endl;
+    std::cout << "  -f, --file-rate=<n>        Limit copy rate to files per second" << std::endl;
+    std::cout << "  -D, --dest=<destination>   Also copy to <destination> (can be repeated, source is read once)" << std::endl;
+    std::cout << "  -m, --metrics              Print copy metrics when done" << std::endl;
+    std::cout << "  -T, --tar                  Write source as a tar (pax) archive file or to stdout ('-')" << std::endl;
+    std::cout << "  -X, --send                 Send source to the receiver at <address> (host:port or unix:<path>)" << std::endl;
+    std::cout << "  -R, --receive              Receive files at <address> into <destination> until SIGINT/SIGTERM" << std::endl;
+    std::cout << "  -c, --connections=<n>      Number of connections to the receiver (default 4)" << std::endl;
+    std::cout << "  -j, --journal=<file>       Record copy progress in the journal file" << std::endl;
+    std::cout << "  -u, --resume               Resume the copy recorded in the journal file" << std::endl;
+    std::cout << "  -p, --publish=<durability>[:<n>]" << std::endl;
+    std::cout << "                             Write files to temporary names and rename them in batches of n" << std::endl;
+    std::cout << "                             (default 256) once synced: none, range (sync_file_range) or syncfs" << std::endl;
+    std::cout << "  -P, --preserve             Preserve mode, ownership, timestamps and extended attributes (ACLs)" << std::endl;
+    std::cout << "  -n, --dry-run              Don't copy, estimate the copy size and time instead" << std::endl;
+    std::cout << "  -w, --read=<bytes>[K|M|G][:<bytes>[K|M|G]]" << std::endl;
+    std::cout << "                             Read files up to that size at once (default 256K), map larger" << std::endl;
+    std::cout << "                             files in windows of the second size (default 64M)" << std::endl;
+    std::cout << "  -e, --engine=<engine>      Copy file data by: user (read and write, default) or" << std::endl;
+    std::cout << "                             splice (in the kernel through a pipe, keeps holes)" << std::endl;
+    std::cout << "  -b, --pipeline=<depth>[:<size>]" << std::endl;
+    std::cout << "                             Read and write files of size (default 8M) or more at the" << std::endl;
+    std::cout << "                             same time, with up to depth chunks in flight" << std::endl;
+    std::cout << "  -W, --watch[=<ms>]         Keep copying files as they change after the copy, changes" << std::endl;
+    std::cout << "                             coalesced over ms (default 500) until cancelled" << std::endl;
+    std::cout << "  -i, --include=<pattern>    Copy files and directories matching the pattern, even if" << std::endl;
+    std::cout << "                             a later --exclude matches them (see below)" << std::endl;
+    std::cout << "  -x, --exclude=<pattern>    Skip files and directories matching the pattern (glob)." << std::endl;
+    std::cout << "                             Rules are matched in order, the first match decides." << std::endl;
+    std::cout << "                             A pattern with '/' matches the path under the source," << std::endl;
+    std::cout << "                             otherwise the name. Trailing '/' - directories only." << std::endl;
+    std::cout << "  -z, --size=<min>[:<max>]   Only copy files of min to max bytes (0 - no limit)" << std::endl;
+    std::cout << "  -A, --age=<max>[:<min>]    Only copy files modified at most max and at least min" << std::endl;
+    std::cout << "                             ago, in s, m, h or d (0 - no limit)" << std::endl;
+    std::cout << "  -C, --cpus=<list>          Run copy threads on these CPUs only (i.e. 0-3,8)" << std::endl;
+    std::cout << "  -N, --numa=<none|source|dest>" << std::endl;
+    std::cout << "                             Run copy threads (and allocate their buffers) on the NUMA" << std::endl;
+    std::cout << "                             node of the source or dest device (destination writers" << std::endl;
+    std::cout << "                             always run on their device node), or none (default)" << std::endl;
+    std::cout << "  -k, --keep-going           Keep copying other files if some can't be copied" << std::endl;
+    std::cout << "  -y, --retry=<n>[:<ms>]     Retry files failing with a transient error (i.e. EIO) up" << std::endl;
+    std::cout << "                             to n times, first after ms (default 100), doubled each time" << std::endl;
+    std::cout << "  -F, --failure-report=<file>" << std::endl;
+    std::cout << "                             Write files that can't be copied to the file (tab separated," << std::endl;
+    std::cout << "                             with \\\\, \\t and \\n escaped)" << std::endl;
+    std::cout << "Signals:" << std::endl;
+    std::cout << "  SIGUSR1                    Halve copy rate limits (sets them to current rates if not limited)" << std::endl;
+    std::cout << "  SIGUSR2                    Double copy rate limits" << std::endl;
+    std::cout << "  SIGINT, SIGTERM            Cancel copy" << std::endl;
+}
+
+static void PrintMetrics(const DirCopy::Metrics& metrics, const PathFilter& filter)
+{
+    OUTMSG("Files copied: " << metrics.files);
+    OUTMSG("Bytes copied: " << metrics.bytes);
+    if(metrics.skippedFiles > 0)
+        OUTMSG("Files skipped: " << metrics.skippedFiles << " (" << metrics.skippedBytes << " bytes, copied before)");
+    OUTMSG("Elapsed time: " << metrics.seconds << " sec");
+    if(metrics.throttleSeconds > 0)
+        OUTMSG("Throttled time: " << metrics.throttleSeconds << " sec (all threads)");
+    if(metrics.excludedFiles > 0 || metrics.prunedDirs > 0)
+        OUTMSG("Filtered out: " << metrics.excludedFiles << " files, " << metrics.prunedDirs << " directories (not read)");
+    for(size_t i = 0; i < metrics.filterMatches.size() && i < filter.GetRuleCount(); i++)
+    {
+        OUTMSG("Filter " << (filter.GetAction(i) == PathFilter::Action::Include ? "include" : "exclude")
+               << " '" << filter.GetPattern(i) << "': " << metrics.filterMatches[i] << " matches");
+    }
+    if(metrics.watchBatches > 0)
+        OUTMSG("Watch batches: " << metrics.watchBatches << " (" << metrics.watchRescans << " rescans)");
+    if(metrics.retries > 0)
+        OUTMSG("Retries: " << metrics.retries);
+    if(metrics.cachedFiles > 0)
+        OUTMSG("Cached files: " << metrics.cachedFiles << " (copied as found)");
+    if(metrics.pipelinedFiles > 0)
+        OUTMSG("Pipelined files: " << metrics.pipelinedFiles << " (read stall " << metrics.readStallSeconds
+               << " sec, write stall " << metrics.writeStallSeconds << " sec)");
+    if(metrics.seconds > 0)
+        OUTMSG("Throughput: " << metrics.bytes / metrics.seconds / (1024 * 1024) << " MB/sec, "
+               << metrics.files / metrics.seconds << " files/sec");
+
+    for(const auto& decision : metrics.threadDecisions)
+    {
+        OUTMSG("Threads: " << decision.time << " sec: " << decision.threads << " threads"
+               << " (" << decision.bytesPerSec / (1024 * 1024) << " MB/sec, "
+               << decision.filesPerSec << " files/sec, " << decision.latencyMs << " ms/file)");
+    }
+}
+
+// Format size with K, M, G or T suffix
+static std::string FormatSize(double size)
+{
+    static const char* suffixes[] = { "", "K", "M", "G", "T" };
+    size_t i = 0;
+    for(; size >= 1024 && i < sizeof(suffixes) / sizeof(suffixes[0]) - 1; i++)
+        size /= 1024;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), (i == 0 ? "%.0f%s" : "%.1f%s"), size, suffixes[i]);
+    return buf;
+}
+
+// Estimate the copy (dry run)
+static int Estimate(const char* srcName, const std::string& destDir, int threadCount, const PathFilter& filter)
+{
+    DirEstimate estimate(threadCount);
+    estimate.SetPathFilter(&filter);
+    if(!estimate.Estimate(srcName, destDir))
+    {
+        ERRORMSG(estimate.GetError());
+        return 1;
+    }
+
+    const DirEstimate::Result& result = estimate.GetResult();
+    OUTMSG("Directories: " << result.dirs);
+    OUTMSG("Files: " << result.files);
+    OUTMSG("Bytes: " << result.bytes << " (" << FormatSize(result.bytes) << "), allocated "
+           << result.allocatedBytes << " (" << FormatSize(result.allocatedBytes) << ")");
+    OUTMSG("Sparse files: " << result.sparseFiles << ", holes " << result.sparseBytes
+           << " (" << FormatSize(result.sparseBytes) << ")");
+    OUTMSG("Scan time: " << result.scanSeconds << " sec");
+
+    OUTMSG("File sizes:");
+    for(const auto& bucket : result.histogram)
+    {
+        std::string maxSize = (bucket.maxSize == UINT64_MAX ? "larger" : "<= " + FormatSize(bucket.maxSize));
+        std::cout << "  " << maxSize << std::string(maxSize.size() < 10 ? 10 - maxSize.size() : 0, ' ')
+                  << bucket.files << " files, " << FormatSize(bucket.bytes) << std::endl;
+    }
+
+    if(result.readBytesPerSec > 0)
+        OUTMSG("Read rate: " << FormatSize(result.readBytesPerSec) << "/sec");
+    if(result.writeBytesPerSec > 0)
+        OUTMSG("Write rate: " << FormatSize(result.writeBytesPerSec) << "/sec");
+    OUTMSG("File make time: " << result.fileSeconds * 1000 << " ms");
+    OUTMSG("Estimated copy time: " << result.seconds << " sec (" << threadCount << " threads)");
+    return 0;
+}
+
+// Parse age with s, m, h or d suffix (seconds)
+static long ParseAge(const char* str)
+{
+    char* end = nullptr;
+    long age = strtol(str, &end, 10);
+    switch(*end)
+    {
+    case 'd': age *= 24 * 60 * 60; break;
+    case 'h': age *= 60 * 60; break;
+    case 'm': age *= 60; break;
+    case 's': case '\0': break;
+    default: return -1;
+    }
+    return (end == str ? -1 : age);
+}
+
+// Parse size with optional K, M or G suffix
+static double ParseSize(const char* str)
+{
+    char* end = nullptr;
+    double size = strtod(str, &end);
+    switch(*end)
+    {
+    case 'K': case 'k': size *= 1024; break;
+    case 'M': case 'm': size *= 1024 * 1024; break;
+    case 'G': case 'g': size *= 1024 * 1024 * 1024; break;
+    case '\0': break;
+    default: return -1;
+    }
+    return size;
+}
+
+// Escape backslash, tab and new line characters (legal in file names) as
+// \\, \t and \n, so the report fields and lines stay apart
+static std::string EscapeField(const std::string& str)
+{
+    std::string escaped;
+    escaped.reserve(str.size());
+    for(char c : str)
+    {
+        if(c == '\\')
+            escaped += "\\\\";
+        else if(c == '\t')
+            escaped += "\\t";
+        else if(c == '\n')
+            escaped += "\\n";
+        else
+            escaped += c;
+    }
+    return escaped;
+}
+
+// Write failures as tab separated lines: path, errno, attempts, error
+static bool WriteFailureReport(const char* fileName, const std::vector<DirCopy::Failure>& failures)
+{
+    std::ofstream file(fileName, std::ios::trunc);
+    if(!file)
+        return false;
+
+    file << "# path\terrno\tattempts\terror\n";
+    for(const DirCopy::Failure& failure : failures)
+    {
+        file << EscapeField(failure.path) << '\t' << failure.errNo << '\t' << failure.attempts << '\t'
+             << EscapeField(failure.error) << '\n';
+    }
+
+    file.close();
+    return !file.fail();
+}
+
+// Adjust rate limits at runtime: SIGUSR1 to halve them, SIGUSR2 to double them.
+// Cancel the copy on SIGINT/SIGTERM.
+static void HandleSignal(CopyJob& job, int sig)
+{
+    if(sig == SIGINT || sig == SIGTERM)
+    {
+        std::cout << std::endl << "Cancelling..." << std::endl;
+        job.Cancel();
+        return;
+    }
+
+    DirCopy& dirCopy = job.GetDirCopy();
+    double bytesRate = dirCopy.GetBytesRateLimit();
+    double filesRate = dirCopy.GetFilesRateLimit();
+
+    if(sig == SIGUSR1)
     {
-        std::cout << "Usage: copy <source> <destination> <read_block_size (optional)>" << std::endl;
+        // If not limited yet, then start from the current throughput
+        if(bytesRate <= 0)
+            bytesRate = 2 * dirCopy.GetCurrentBytesRate();
+        if(filesRate <= 0)
+            filesRate = 2 * dirCopy.GetCurrentFilesRate();
+        bytesRate /= 2;
+        filesRate /= 2;
+    }
+    else if(sig == SIGUSR2)
+    {
+        bytesRate *= 2;
+        filesRate *= 2;
+    }
+
+    dirCopy.SetRateLimits(bytesRate, filesRate);
+    std::cout << std::endl << "Rate limits: " << bytesRate / (1024 * 1024) << " MB/sec, "
+              << filesRate << " files/sec" << std::endl;
+}
+
+// Receive files until SIGINT/SIGTERM
+static int Receive(const char* address, const char* destDir, int threadCount)
+{
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigset, nullptr);
+
+    FileReceiver receiver(threadCount);
+    if(!receiver.Listen(address))
+    {
+        ERRORMSG(receiver.GetError());
+        return 1;
+    }
+
+    OUTMSG("Receive at: " << address);
+    OUTMSG("Receive to: " << destDir);
+
+    bool res = false;
+    std::thread thread([&]() { res = receiver.Run(destDir); });
+
+    int sig = 0;
+    sigwait(&sigset, &sig);
+    receiver.Stop();
+    thread.join();
+
+    FileReceiver::Stats stats = receiver.GetStats();
+    OUTMSG("Connections: " << stats.connections << ", files: " << stats.files << ", bytes: " << stats.bytes
+           << ", failures: " << stats.failures);
+
+    if(!res)
+    {
+        ERRORMSG(receiver.GetError());
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t sparseBlockSize = 0;
+    DirReader::Order order = DirReader::Order::None;
+    DirCopy::Schedule schedule = DirCopy::Schedule::Fifo;
+    int deviceThreadCount = 0;
+    std::map<dev_t, int> deviceThreads;
+    int threadCount = 12;
+    int minThreads = 0;
+    int maxThreads = 0;
+    bool printMetrics = false;
+    double bytesRate = 0;
+    double filesRate = 0;
+    bool tar = false;
+    bool send = false;
+    bool receive = false;
+    int connectionCount = 4;
+    std::vector<std::string> extraDestNames;
+    const char* journalFile = nullptr;
+    bool resume = false;
+    bool publish = false;
+    bool preserve = false;
+    bool dryRun = false;
+    size_t preadMaxSize = FileReader::defaultPreadMaxSize;
+    size_t mapWindowSize = FileReader::defaultMapWindowSize;
+    DirCopy::CopyEngine engine = DirCopy::CopyEngine::User;
+    size_t pipelineDepth = 0;
+    bool watch = false;
+    PathFilter filter;
+    int watchCoalesceMs = 500;
+    cpu_set_t cpus;
+    bool hasCpus = false;
+    DirCopy::NumaPlacement numa = DirCopy::NumaPlacement::None;
+    bool keepGoing = false;
+    int retryCount = 0;
+    int retryDelayMs = 100;
+    const char* failureReport = nullptr;
+    size_t pipelineMinSize = 8 * 1024 * 1024;
+    FilePublisher::Durability durability = FilePublisher::Durability::Syncfs;
+    int publishBatchSize = 256;
+
+    static const struct option longOptions[] =
+    {
+        { "sparse",         required_argument, nullptr, 's' },
+        { "order",          required_argument, nullptr, 'o' },
+        { "schedule",       required_argument, nullptr, 'S' },
+        { "device-threads", required_argument, nullptr, 'd' },
+        { "threads",        required_argument, nullptr, 't' },
+        { "adaptive",       required_argument, nullptr, 'a' },
+        { "rate",           required_argument, nullptr, 'r' },
+        { "file-rate",      required_argument, nullptr, 'f' },
+        { "dest",           required_argument, nullptr, 'D' },
+        { "metrics",        no_argument,       nullptr, 'm' },
+        { "tar",            no_argument,       nullptr, 'T' },
+        { "send",           no_argument,       nullptr, 'X' },
+        { "receive",        no_argument,       nullptr, 'R' },
+        { "connections",    required_argument, nullptr, 'c' },
+        { "journal",        required_argument, nullptr, 'j' },
+        { "resume",         no_argument,       nullptr, 'u' },
+        { "publish",        required_argument, nullptr, 'p' },
+        { "preserve",       no_argument,       nullptr, 'P' },
+        { "dry-run",        no_argument,       nullptr, 'n' },
+        { "read",           required_argument, nullptr, 'w' },
+        { "engine",         required_argument, nullptr, 'e' },
+        { "pipeline",       required_argument, nullptr, 'b' },
+        { "watch",          optional_argument, nullptr, 'W' },
+        { "include",        required_argument, nullptr, 'i' },
+        { "exclude",        required_argument, nullptr, 'x' },
+        { "size",           required_argument, nullptr, 'z' },
+        { "age",            required_argument, nullptr, 'A' },
+        { "cpus",           required_argument, nullptr, 'C' },
+        { "numa",           required_argument, nullptr, 'N' },
+        { "keep-going",     no_argument,       nullptr, 'k' },
+        { "retry",          required_argument, nullptr, 'y' },
+        { "failure-report", required_argument, nullptr, 'F' },
+        { "help",           no_argument,       nullptr, 'h' },
+        { nullptr,          0,                 nullptr,  0  }
+    };
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "s:o:S:d:t:a:r:f:D:mTXRc:j:up:Pnw:e:b:W::i:x:z:A:C:N:ky:F:h", longOptions, nullptr)) != -1)
+    {
+        switch(opt)
+        {
+        case 's':
+            sparseBlockSize = atoi(optarg);
+            break;
+        case 'o':
+            if(!strcmp(optarg, "none"))
+                order = DirReader::Order::None;
+            else if(!strcmp(optarg, "name"))
+                order = DirReader::Order::Name;
+            else if(!strcmp(optarg, "inode"))
+                order = DirReader::Order::Inode;
+            else
+            {
+                ERRORMSG("Invalid order '" << optarg << "'");
+                return 1;
+            }
+            break;
+        case 'S':
+            if(!strcmp(optarg, "fifo"))
+                schedule = DirCopy::Schedule::Fifo;
+            else if(!strcmp(optarg, "inode"))
+                schedule = DirCopy::Schedule::Inode;
+            else if(!strcmp(optarg, "extent"))
+                schedule = DirCopy::Schedule::Extent;
+            else if(!strcmp(optarg, "cache"))
+                schedule = DirCopy::Schedule::Cache;
+            else
+            {
+                ERRORMSG("Invalid schedule '" << optarg << "'");
+                return 1;
+            }
+            break;
+        case 'd':
+        {
+            const char* count = strrchr(optarg, ':');
+            int threads = atoi(count ? count + 1 : optarg);
+            if(threads < 1)
+            {
+                ERRORMSG("Invalid device threads count '" << optarg << "'");
+                return 1;
+            }
+
+            if(!count)
+            {
+                deviceThreadCount = threads;
+                break;
+            }
+
+            std::string path(optarg, count - optarg);
+            struct stat st;
+            if(stat(path.c_str(), &st) != 0)
+            {
+                ERRORMSG("Invalid device path '" << path << "': " << strerror(errno));
+                return 1;
+            }
+            deviceThreads[st.st_dev] = threads;
+            break;
+        }
+        case 't':
+            threadCount = atoi(optarg);
+            if(threadCount < 1)
+            {
+                ERRORMSG("Invalid threads count '" << optarg << "'");
+                return 1;
+            }
+            break;
+        case 'a':
+            if(sscanf(optarg, "%d:%d", &minThreads, &maxThreads) != 2 || minThreads < 1 || maxThreads < minThreads)
+            {
+                ERRORMSG("Invalid adaptive threads range '" << optarg << "'");
+                return 1;
+            }
+            break;
+        case 'r':
+            bytesRate = ParseSize(optarg);
+            if(bytesRate < 0)
+            {
+                ERRORMSG("Invalid rate '" << optarg << "'");
+                return 1;
+            }
+            break;
+        case 'f':
+            filesRate = atof(optarg);
+            if(filesRate < 0)
+            {
+                ERRORMSG("Invalid file rate '" << optarg << "'");
+                return 1;
+            }
+            break;
+        case 'D':
+            extraDestNames.push_back(optarg);
+            break;
+        case 'm':
+            printMetrics = true;
+            break;
+        case 'T':
+            tar = true;
+            break;
+        case 'X':
+            send = true;
+            break;
+        case 'R':
+            receive = true;
+            break;
+        case 'c':
+            connectionCount = atoi(optarg);
+            if(connectionCount < 1)
+            {
+                ERRORMSG("Invalid connections count '" << optarg << "'");
+                return 1;
+            }
+            break;
+        case 'j':
+            journalFile = optarg;
+            break;
+        case 'u':
+            resume = true;
+            break;
+        case 'p':
+        {
+            publish = true;
+            const char* batch = strchr(optarg, ':');
+            std::string name(optarg, batch ? batch - optarg : strlen(optarg));
+            if(name == "none")
+                durability = FilePublisher::Durability::None;
+            else if(name == "range")
+                durability = FilePublisher::Durability::FileRange;
+            else if(name == "syncfs")
+                durability = FilePublisher::Durability::Syncfs;
+            else
+            {
+                ERRORMSG("Invalid publish durability '" << optarg << "'");
+                return 1;
+            }
+
+            if(batch && (publishBatchSize = atoi(batch + 1)) < 1)
+            {
+                ERRORMSG("Invalid publish batch size '" << optarg << "'");
+                return 1;
+            }
+            break;
+        }
+        case 'P':
+            preserve = true;
+            break;
+        case 'n':
+            dryRun = true;
+            break;
+        case 'w':
+        {
+            const char* window = strchr(optarg, ':');
+            double preadSize = ParseSize(std::string(optarg, window ? window - optarg : strlen(optarg)).c_str());
+            double windowSize = (window ? ParseSize(window + 1) : mapWindowSize);
+            if(preadSize < 0 || windowSize <= 0)
+            {
+                ERRORMSG("Invalid read sizes '" << optarg << "'");
+                return 1;
+            }
+            preadMaxSize = preadSize;
+            mapWindowSize = windowSize;
+            break;
+        }
+        case 'e':
+            if(!strcmp(optarg, "user"))
+                engine = DirCopy::CopyEngine::User;
+            else if(!strcmp(optarg, "splice"))
+                engine = DirCopy::CopyEngine::Splice;
+            else
+            {
+                ERRORMSG("Invalid engine '" << optarg << "'");
+                return 1;
+            }
+            break;
+        case 'b':
+        {
+            const char* size = strchr(optarg, ':');
+            int depth = atoi(optarg);
+            double minSize = (size ? ParseSize(size + 1) : pipelineMinSize);
+            if(depth < 0 || minSize < 0)
+            {
+                ERRORMSG("Invalid pipeline '" << optarg << "'");
+                return 1;
+            }
+            pipelineDepth = depth;
+            pipelineMinSize = minSize;
+            break;
+        }
+        case 'W':
+            watch = true;
+            if(optarg && (watchCoalesceMs = atoi(optarg)) < 0)
+            {
+                ERRORMSG("Invalid watch coalescing time '" << optarg << "'");
+                return 1;
+            }
+            break;
+        case 'i':
+        case 'x':
+            if(!filter.AddRule(opt == 'i' ? PathFilter::Action::Include : PathFilter::Action::Exclude, optarg))
+            {
+                ERRORMSG(filter.GetError());
+                return 1;
+            }
+            break;
+        case 'z':
+        {
+            const char* max = strchr(optarg, ':');
+            double minSize = ParseSize(std::string(optarg, max ? max - optarg : strlen(optarg)).c_str());
+            double maxSize = (max ? ParseSize(max + 1) : 0);
+            if(minSize < 0 || maxSize < 0)
+            {
+                ERRORMSG("Invalid size range '" << optarg << "'");
+                return 1;
+            }
+            filter.SetSizeRange(minSize, maxSize);
+            break;
+        }
+        case 'A':
+        {
+            const char* min = strchr(optarg, ':');
+            long maxAge = ParseAge(std::string(optarg, min ? min - optarg : strlen(optarg)).c_str());
+            long minAge = (min ? ParseAge(min + 1) : 0);
+            if(maxAge < 0 || minAge < 0)
+            {
+                ERRORMSG("Invalid age range '" << optarg << "'");
+                return 1;
+            }
+            time_t now = time(nullptr);
+            filter.SetTimeRange(maxAge > 0 ? now - maxAge : 0, minAge > 0 ? now - minAge : 0);
+            break;
+        }
+        case 'C':
+            if(!CpuAffinity::ParseCpuList(optarg, cpus))
+            {
+                ERRORMSG("Invalid CPU list '" << optarg << "'");
+                return 1;
+            }
+            hasCpus = true;
+            break;
+        case 'N':
+            if(!strcmp(optarg, "none"))
+                numa = DirCopy::NumaPlacement::None;
+            else if(!strcmp(optarg, "source"))
+                numa = DirCopy::NumaPlacement::Source;
+            else if(!strcmp(optarg, "dest"))
+                numa = DirCopy::NumaPlacement::Dest;
+            else
+            {
+                ERRORMSG("Invalid NUMA placement '" << optarg << "'");
+                return 1;
+            }
+            break;
+        case 'k':
+            keepGoing = true;
+            break;
+        case 'y':
+        {
+            int count = sscanf(optarg, "%d:%d", &retryCount, &retryDelayMs);
+            if(count < 1 || retryCount < 0 || retryDelayMs < 0)
+            {
+                ERRORMSG("Invalid retry '" << optarg << "'");
+                return 1;
+            }
+            break;
+        }
+        case 'F':
+            failureReport = optarg;
+            break;
+        default:
+            Usage();
+            return 0;
+        }
+    }
+
+    if(argc - optind < 2)
+    {
+        Usage();
         return 0;
     }
 
-    const char* srcName = argv[1];
-    const char* dstName = argv[2];
-    size_t sparseBlockSize = (argc > 3 ? atoi(argv[3]) : 0);
+    const char* srcName = argv[optind];
+    const char* dstName = argv[optind + 1];
+    if(argc - optind > 2)
+        sparseBlockSize = atoi(argv[optind + 2]);
+
+    if(receive)
+        return Receive(srcName, dstName, threadCount);
+
+    if(watch && (tar || send))
+    {
+        ERRORMSG("Watch mode only copies to directories");
+        return 1;
+    }
+
+    if(resume && !journalFile)
+    {
+        ERRORMSG("Resume requires the journal file (--journal)");
+        return 1;
+    }
 
     // For simplicity, make sure that destination directory is not a sub-directory of source directory
     char buf[PATH_MAX + 1] {};
@@ -35,22 +715,124 @@ int main(int argc, const char* argv[])
         return 1;
     }
 
+    // Estimate the copy into the destination directory
+    if(dryRun)
+    {
+        strcpy(buf, srcName);
+        return Estimate(srcName, std::string(dstName) + "/" + basename(buf), threadCount, filter);
+    }
+
+    // Open the archive (tar mode). Messages go to stderr if the archive goes to stdout.
+    int tarFd = -1;
+    if(tar && !strcmp(dstName, "-"))
+    {
+        tarFd = STDOUT_FILENO;
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+    else if(tar && (tarFd = open(dstName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0660)) < 0)
+    {
+        ERRORMSG("Failed to open '" << dstName << "': " << strerror(errno));
+        return 1;
+    }
+
+    // Write errors (i.e. the reader end of the pipe is gone) are reported
+    // by the tar stream instead
+    if(tar)
+        signal(SIGPIPE, SIG_IGN);
+
     // Make destination directory based on source directory name
     strcpy(buf, srcName);
-    std::string destDir = std::string(dstName) + "/" + basename(buf);
+    std::string destDir = (tar || send ? std::string(dstName) : std::string(dstName) + "/" + basename(buf));
+
+    // Extra destinations get the same source directory name
+    std::vector<std::string> destDirs { destDir };
+    for(const std::string& extraDestName : extraDestNames)
+    {
+        strcpy(buf, srcName);
+        destDirs.push_back(extraDestName + "/" + basename(buf));
+    }
 
     OUTMSG("Copy from :" << srcName);
-    OUTMSG("Copy to: " << destDir);
+    for(const std::string& dir : destDirs)
+        OUTMSG("Copy to: " << dir);
     OUTMSG("Sparse files read block size: " << sparseBlockSize);
 
+    // Block signals in all threads (before any is started) and handle them
+    // while waiting for the copy job instead
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    sigaddset(&sigset, SIGUSR2);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigset, nullptr);
+
     // Copy source directory into destination directory
-    DirCopy dirCopy(12); // Use 12 threads
-    if(!dirCopy.Copy(srcName, destDir, sparseBlockSize))
+    CopyJob job(threadCount);
+    DirCopy& dirCopy = job.GetDirCopy();
+    dirCopy.SetOrder(order);
+    dirCopy.SetSchedule(schedule, deviceThreadCount);
+    for(const auto& [dev, threads] : deviceThreads)
+        dirCopy.SetDeviceThreads(dev, threads);
+    if(maxThreads > 0)
+        dirCopy.SetAdaptiveThreads(minThreads, maxThreads);
+    dirCopy.SetRateLimits(bytesRate, filesRate);
+    if(journalFile)
+        dirCopy.SetJournal(journalFile, resume);
+    if(publish)
+        dirCopy.SetAtomicPublish(true, durability, publishBatchSize);
+    dirCopy.SetPreserveMetadata(preserve);
+    dirCopy.SetReadStrategy(preadMaxSize, mapWindowSize);
+    dirCopy.SetCopyEngine(engine);
+    dirCopy.SetPipeline(pipelineDepth, pipelineMinSize);
+    dirCopy.SetCpuAffinity(hasCpus ? &cpus : nullptr);
+    dirCopy.SetNumaPlacement(numa);
+    dirCopy.SetErrorPolicy(keepGoing, retryCount, retryDelayMs);
+    dirCopy.SetPathFilter(&filter);
+
+    if(tar)
+        job.StartTar(srcName, tarFd, sparseBlockSize);
+    else if(send)
+        job.StartRemote(srcName, dstName, connectionCount, sparseBlockSize);
+    else if(watch)
+        job.StartWatch(srcName, destDirs, sparseBlockSize, watchCoalesceMs);
+    else
+        job.Start(srcName, destDirs, sparseBlockSize);
+
+    // Report progress until done
+    int progress = -1;
+    while(!job.IsDone())
+    {
+        struct timespec timeout { 0, 100 * 1000 * 1000 }; // 100ms
+        int sig = sigtimedwait(&sigset, nullptr, &timeout);
+        if(sig > 0)
+            HandleSignal(job, sig);
+
+        DirCopy::Stats stats = job.GetStats();
+        if(stats.progress >= 0 && stats.progress != progress)
+        {
+            progress = stats.progress;
+            std::cout << '\r' << "Progress: " << progress << '%' << (progress == 100 ? '\n' : ' ') << std::flush;
+        }
+    }
+
+    CopyJob::Result result = job.GetFuture().get();
+    if(tarFd > STDOUT_FILENO)
+        close(tarFd);
+
+    if(printMetrics)
+        PrintMetrics(result.metrics, filter);
+
+    if(failureReport && !WriteFailureReport(failureReport, result.failures))
+        ERRORMSG("Failed to write failure report '" << failureReport << "': " << strerror(errno));
+
+    if(!result.success)
     {
-        ERRORMSG("srcName=" << srcName << ", error '" << dirCopy.GetError() << "'");
+        for(const DirCopy::Failure& failure : result.failures)
+            ERRORMSG("Failed to copy '" << failure.path << "': " << failure.error);
+        ERRORMSG("srcName=" << srcName << ", error '" << result.error << "'");
         return 1;
     }
 
     return 0;
 }
-
@@ -0,0 +1,155 @@
+//
+// multiWriter.cpp
+//
+#include "multiWriter.h"
+
+bool MultiWriter::OpenFiles(const std::vector<DirFdPtr>& dirs, const std::string& fileName, const std::vector<ThreadPool*>& pools,
+                            FileWriter::Mode mode /*= FileWriter::Mode::Truncate*/)
+{
+    CloseFiles();
+    mErrMsg.clear();
+    mErrNo = 0;
+
+    for(size_t i = 0; i < dirs.size(); i++)
+    {
+        auto file = std::make_unique<File>();
+        file->dir = dirs[i];
+        file->pool = pools[i];
+        file->idleSince = std::chrono::steady_clock::now();
+        if(!file->writer.OpenFile(dirs[i]->GetFd(), fileName, mode))
+        {
+            SetError(*file, file->writer.GetError(), file->writer.GetErrno());
+            return false;
+        }
+        mFiles.emplace_back(std::move(file));
+    }
+
+    return true;
+}
+
+bool MultiWriter::WriteFile(const std::shared_ptr<const std::string>& data, off_t offset)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    // Wait for the slowest file to catch up
+    std::chrono::steady_clock::time_point waitStart;
+    while(mErrMsg.empty())
+    {
+        bool full = false;
+        for(const auto& file : mFiles)
+            full = full || (file->chunks.size() >= mMaxPendingChunks);
+        if(!full)
+            break;
+        if(waitStart == std::chrono::steady_clock::time_point())
+            waitStart = std::chrono::steady_clock::now();
+        mCv.wait(lock);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if(waitStart != std::chrono::steady_clock::time_point())
+        mFullWaitNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(now - waitStart).count();
+
+    if(!mErrMsg.empty())
+        return false;
+
+    for(auto& file : mFiles)
+    {
+        file->chunks.emplace_back(Chunk { offset, data });
+        if(!file->busy)
+        {
+            mEmptyWaitNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(now - file->idleSince).count();
+            file->busy = true;
+            file->pool->Post([this](File* file) { WriteChunks(file); }, file.get());
+        }
+    }
+
+    return true;
+}
+
+void MultiWriter::WriteChunks(File* file)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while(!file->chunks.empty())
+    {
+        // Note: Once any file failed, we just drop the rest of the data
+        Chunk chunk = file->chunks.front();
+        if(mErrMsg.empty())
+        {
+            lock.unlock();
+            file->writer.WriteFile(*chunk.data, chunk.offset);
+            bool valid = file->writer.IsValid();
+            lock.lock();
+
+            if(!valid)
+                SetError(*file, file->writer.GetError(), file->writer.GetErrno());
+            else
+                file->writtenEnd = chunk.offset + chunk.data->size();
+        }
+
+        file->chunks.pop_front();
+        mCv.notify_all();
+    }
+
+    file->busy = false;
+    file->idleSince = std::chrono::steady_clock::now();
+    mCv.notify_all();
+}
+
+bool MultiWriter::CloseFiles()
+{
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for(const auto& file : mFiles)
+        {
+            while(file->busy)
+                mCv.wait(lock);
+        }
+    }
+
+    for(auto& file : mFiles)
+        file->writer.CloseFile();
+    mFiles.clear();
+    return IsValid();
+}
+
+bool MultiWriter::IsValid()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mErrMsg.empty();
+}
+
+off_t MultiWriter::GetWrittenEnd()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    off_t writtenEnd = -1;
+    for(const auto& file : mFiles)
+    {
+        if(writtenEnd < 0 || file->writtenEnd < writtenEnd)
+            writtenEnd = file->writtenEnd;
+    }
+    return (writtenEnd < 0 ? 0 : writtenEnd);
+}
+
+std::string MultiWriter::GetError()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mErrMsg;
+}
+
+int MultiWriter::GetErrno()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mErrNo;
+}
+
+void MultiWriter::SetError(const File& file, const std::string& err, int errNo)
+{
+    // Note: we only set the first error as most relevant
+    // Note: It must be called with mMutex locked (or before any writes)
+    if(mErrMsg.empty())
+    {
+        mErrMsg = err + " in '" + file.dir->GetPath() + "'";
+        mErrNo = errNo;
+    }
+}
@@ -0,0 +1,91 @@
+//
+// multiWriter.h
+//
+#ifndef __MULTI_WRITER_H__
+#define __MULTI_WRITER_H__
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>               // std::shared_ptr, std::unique_ptr
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "dirFd.h"
+#include "fileWriter.h"
+#include "threadPool.h"
+
+//
+// Helper class to write the same data to several files (i.e. the same file
+// in several destination directories). Every file is written by threads of
+// its own pool, so destinations are written concurrently, and data is shared
+// (not copied) by all of them. Once the slowest file is maxPendingChunks
+// behind, WriteFile() waits for it to catch up.
+// Note: With a single file, it is a write-behind ring of maxPendingChunks
+// chunks, so the caller reads the next chunk while the last one is written.
+//
+class MultiWriter
+{
+public:
+    MultiWriter(size_t maxPendingChunks=8) : mMaxPendingChunks(maxPendingChunks) {}
+    ~MultiWriter() { CloseFiles(); }
+
+    MultiWriter(const MultiWriter&) = delete;
+    MultiWriter& operator=(const MultiWriter&) = delete;
+
+    // Open fileName in every directory. Writes to the file in dirs[i] are
+    // done by pools[i] threads.
+    bool OpenFiles(const std::vector<DirFdPtr>& dirs, const std::string& fileName, const std::vector<ThreadPool*>& pools,
+                   FileWriter::Mode mode = FileWriter::Mode::Truncate);
+
+    // Queue data (at offset) to be written to all files
+    bool WriteFile(const std::shared_ptr<const std::string>& data, off_t offset);
+
+    // Wait for all the data to be written and close files
+    bool CloseFiles();
+
+    bool IsValid();
+    std::string GetError();
+    int GetErrno();     // Of the first error (0 - not a system call error)
+
+    // End of the data written to all files so far
+    off_t GetWrittenEnd();
+
+    // Stall times: WriteFile() waiting for the slowest file to catch up, and
+    // files waiting for WriteFile() to queue more data (sum of all files)
+    uint64_t GetFullWaitNanos() { return mFullWaitNanos; }
+    uint64_t GetEmptyWaitNanos() { return mEmptyWaitNanos; }
+
+private:
+    struct Chunk
+    {
+        off_t offset{0};
+        std::shared_ptr<const std::string> data;
+    };
+
+    struct File
+    {
+        DirFdPtr dir;
+        ThreadPool* pool{nullptr};
+        FileWriter writer;
+        std::deque<Chunk> chunks;   // Waiting to be written (the first one is being written)
+        bool busy{false};           // Pool thread is writing chunks
+        off_t writtenEnd{0};        // End of the last written chunk
+        std::chrono::steady_clock::time_point idleSince; // No chunks to write since
+    };
+
+    void WriteChunks(File* file);
+    void SetError(const File& file, const std::string& err, int errNo);
+
+    size_t mMaxPendingChunks{0};
+    std::vector<std::unique_ptr<File>> mFiles;
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::string mErrMsg;
+    int mErrNo{0};
+    std::atomic<uint64_t> mFullWaitNanos{0};
+    std::atomic<uint64_t> mEmptyWaitNanos{0};
+};
+
+#endif // __MULTI_WRITER_H__
@@ -0,0 +1,138 @@
+//
+// pathFilter.cpp
+//
+#include "pathFilter.h"
+#include <fnmatch.h>    // fnmatch()
+#include <string.h>     // strlen(), memcmp()
+
+bool PathFilter::AddRule(Action action, const std::string& pattern)
+{
+    Rule rule;
+    rule.action = action;
+    rule.pattern = pattern;
+
+    std::string match = pattern;
+    if(match.size() > 1 && match.back() == '/')
+    {
+        rule.dirOnly = true;
+        match.pop_back();
+    }
+    // Note: A leading '/' anchors the pattern to the source directory (as
+    // in .gitignore), so it is a path pattern even without another '/'
+    bool anchored = (match.size() > 1 && match.front() == '/');
+    if(anchored)
+        match.erase(0, 1);
+
+    if(match.empty() || match == "/")
+    {
+        mErrMsg = "Invalid (empty) filter pattern '" + pattern + "'";
+        return false;
+    }
+
+    rule.path = (anchored || match.find('/') != std::string::npos);
+
+    // Compile the pattern into the cheapest way to match it
+    // Note: In a path pattern '*' doesn't match '/', so leave it to fnmatch()
+    size_t wild = match.find_first_of("*?[\\");
+    if(wild == std::string::npos)
+    {
+        rule.kind = Kind::Literal;
+    }
+    else if(rule.path)
+    {
+        rule.kind = Kind::Glob;
+    }
+    else if(wild == match.size() - 1 && match.back() == '*')
+    {
+        rule.kind = Kind::Prefix;
+        match.pop_back();
+    }
+    else if(wild == 0 && match[0] == '*' && match.size() > 1 && match.find_first_of("*?[\\", 1) == std::string::npos)
+    {
+        rule.kind = Kind::Suffix;
+        match.erase(0, 1);
+    }
+    rule.match = std::move(match);
+
+    int index = (int)mRules.size();
+    if(rule.kind == Kind::Literal && !rule.path)
+    {
+        // Note: Only the first rule for the name matters
+        auto& names = (rule.dirOnly ? mLiteralDirs : mLiteralNames);
+        names.emplace(rule.match, index);
+    }
+    else
+    {
+        mScanRules.push_back(index);
+    }
+
+    if(rule.path)
+        mPathRules++;
+
+    mRules.emplace_back(std::move(rule));
+    return true;
+}
+
+int PathFilter::Match(const char* name, const std::string& relPath, bool isDir) const
+{
+    // The first literal name rule (if any), then any rule before it
+    int first = -1;
+    if(!mLiteralNames.empty() || !mLiteralDirs.empty())
+    {
+        std::string key(name);
+        auto it = mLiteralNames.find(key);
+        if(it != mLiteralNames.end())
+            first = it->second;
+
+        if(isDir && (it = mLiteralDirs.find(key)) != mLiteralDirs.end() && (first < 0 || it->second < first))
+            first = it->second;
+    }
+
+    size_t nameLen = strlen(name);
+    for(size_t index : mScanRules)
+    {
+        if(first >= 0 && (int)index > first)
+            break;
+        if(MatchRule(mRules[index], name, nameLen, relPath, isDir))
+            return (int)index;
+    }
+
+    return first;
+}
+
+bool PathFilter::MatchRule(const Rule& rule, const char* name, size_t nameLen, const std::string& relPath, bool isDir) const
+{
+    if(rule.dirOnly && !isDir)
+        return false;
+
+    const char* str = (rule.path ? relPath.c_str() : name);
+    size_t len = (rule.path ? relPath.size() : nameLen);
+    const std::string& match = rule.match;
+
+    switch(rule.kind)
+    {
+    case Kind::Literal:
+        return (len == match.size() && !memcmp(str, match.data(), len));
+    case Kind::Prefix:
+        return (len >= match.size() && !memcmp(str, match.data(), match.size()));
+    case Kind::Suffix:
+        return (len >= match.size() && !memcmp(str + len - match.size(), match.data(), match.size()));
+    case Kind::Glob:
+        break;
+    }
+
+    return (fnmatch(match.c_str(), str, (rule.path ? FNM_PATHNAME : 0)) == 0);
+}
+
+bool PathFilter::MatchStat(const struct stat& st) const
+{
+    if(mMinSize > 0 && (uint64_t)st.st_size < mMinSize)
+        return false;
+    if(mMaxSize > 0 && (uint64_t)st.st_size > mMaxSize)
+        return false;
+    if(mNewerThan > 0 && st.st_mtime < mNewerThan)
+        return false;
+    if(mOlderThan > 0 && st.st_mtime > mOlderThan)
+        return false;
+    return true;
+}
@@ -0,0 +1,99 @@
+//
+// pathFilter.h
+//
+#ifndef __PATH_FILTER_H__
+#define __PATH_FILTER_H__
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>     // uint64_t
+#include <time.h>       // time_t
+#include <sys/stat.h>   // struct stat
+
+//
+// Include/exclude rules for the source tree entries, compiled once (as the
+// rules are added) and matched by DirReader before an entry is dispatched,
+// so excluded directories are never read.
+//
+// Rules are glob patterns (fnmatch) matched in the order they were added,
+// and the first matching rule decides (entries no rule matches are included).
+// A pattern with '/' is matched against the path relative to the source
+// directory ('*' doesn't match '/', and a leading '/' anchors a name to the
+// source directory), otherwise against the entry name. A pattern with a
+// trailing '/' only matches directories. Literal names, "*suffix" and
+// "prefix*" patterns are matched without fnmatch(), and literal names with
+// a single hash lookup.
+//
+// Size and modification time ranges only apply to files (not directories).
+//
+class PathFilter
+{
+public:
+    PathFilter() = default;
+    ~PathFilter() = default;
+
+    enum class Action
+    {
+        Include,
+        Exclude
+    };
+
+    bool AddRule(Action action, const std::string& pattern);
+
+    // Only files of minSize to maxSize bytes (0 - no limit)
+    void SetSizeRange(uint64_t minSize, uint64_t maxSize) { mMinSize = minSize; mMaxSize = maxSize; }
+
+    // Only files modified between newerThan and olderThan (0 - no limit)
+    void SetTimeRange(time_t newerThan, time_t olderThan) { mNewerThan = newerThan; mOlderThan = olderThan; }
+
+    // Index of the first rule matching the entry (-1 - none).
+    // Note: relPath is only used if NeedsPath() is true.
+    int Match(const char* name, const std::string& relPath, bool isDir) const;
+
+    // Does the file fit the size and time ranges?
+    bool MatchStat(const struct stat& st) const;
+
+    bool IsEmpty() const { return mRules.empty() && !NeedsStat(); }
+    bool NeedsPath() const { return mPathRules > 0; }
+    bool NeedsStat() const { return (mMinSize > 0 || mMaxSize > 0 || mNewerThan > 0 || mOlderThan > 0); }
+    size_t GetRuleCount() const { return mRules.size(); }
+    Action GetAction(size_t rule) const { return mRules[rule].action; }
+    const std::string& GetPattern(size_t rule) const { return mRules[rule].pattern; }
+    const std::string& GetError() const { return mErrMsg; }
+
+private:
+    // How the pattern is matched
+    enum class Kind
+    {
+        Literal,    // Name is the pattern (hash lookup)
+        Prefix,     // "prefix*"
+        Suffix,     // "*suffix"
+        Glob        // Anything else (fnmatch)
+    };
+
+    struct Rule
+    {
+        Action action{Action::Exclude};
+        std::string pattern;    // As given (for reporting)
+        Kind kind{Kind::Glob};
+        std::string match;      // Compiled pattern (literal, prefix, suffix or glob)
+        bool dirOnly{false};    // Trailing '/'
+        bool path{false};       // Matched against the relative path
+    };
+
+    bool MatchRule(const Rule& rule, const char* name, size_t nameLen, const std::string& relPath, bool isDir) const;
+
+    std::vector<Rule> mRules;
+    std::vector<size_t> mScanRules;                     // Rules not in mLiteralNames (in order)
+    std::unordered_map<std::string, int> mLiteralNames; // Literal name (and directory only names)...
+    std::unordered_map<std::string, int> mLiteralDirs;  // ...to the first rule index
+    size_t mPathRules{0};
+    uint64_t mMinSize{0};
+    uint64_t mMaxSize{0};
+    time_t mNewerThan{0};
+    time_t mOlderThan{0};
+    std::string mErrMsg;
+};
+
+#endif // __PATH_FILTER_H__
@@ -0,0 +1,283 @@
+//
+// tarStream.cpp
+//
+#include "tarStream.h"
+#include <unistd.h>     // write()
+#include <string.h>     // strerror()
+#include <stdio.h>      // snprintf()
+
+bool TarStream::Start()
+{
+    if(mThread.joinable())
+        return true; // Already started
+
+    mThread = std::thread(&TarStream::Run, this);
+    return true;
+}
+
+bool TarStream::PushHeader(unsigned long seq, const Entry& entry)
+{
+    return Push(seq, MakeHeader(entry), false);
+}
+
+bool TarStream::PushData(unsigned long seq, std::string&& data)
+{
+    return Push(seq, std::move(data), false);
+}
+
+bool TarStream::PushEnd(unsigned long seq, off_t dataSize)
+{
+    // Pad the entry data to the block size
+    size_t rest = dataSize % blockSize;
+    return Push(seq, std::string(rest ? blockSize - rest : 0, '\0'), true);
+}
+
+bool TarStream::Push(unsigned long seq, std::string&& data, bool last)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    // Wait for room in the reorder buffer, unless it is the entry being
+    // written (it must always go through for the writer to make a progress)
+    while(!mAborted && seq != mWriteSeq && mBufferSize > 0 && mBufferSize + data.size() > mMaxBufferSize)
+        mCvRoom.wait(lock);
+
+    if(mAborted)
+        return false;
+
+    Chunks& chunks = mEntries[seq];
+    mBufferSize += data.size();
+    if(!data.empty())
+        chunks.data.emplace_back(std::move(data));
+    chunks.last = last;
+
+    bool notify = (seq == mWriteSeq);
+    lock.unlock();
+
+    if(notify)
+        mCvData.notify_one();
+    return true;
+}
+
+bool TarStream::Finish()
+{
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mFinishing = true;
+        mEndSeq = mNextSeq;
+    }
+    mCvData.notify_one();
+
+    if(mThread.joinable())
+        mThread.join();
+
+    if(mAborted)
+        return false;
+
+    // End of archive: two zero blocks
+    return Write(std::string(2 * blockSize, '\0'));
+}
+
+void TarStream::Abort(const std::string& err /*=""*/)
+{
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        if(!err.empty() && mErrMsg.empty())
+            mErrMsg = err;
+        mAborted = true;
+    }
+    mCvData.notify_all();
+    mCvRoom.notify_all();
+
+    // Note: The writer thread is joined by Finish() (or the destructor)
+}
+
+void TarStream::Run()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while(true)
+    {
+        // Wait for the data of the entry to write
+        auto it = mEntries.find(mWriteSeq);
+        while(!mAborted && !(mFinishing && mWriteSeq == mEndSeq) &&
+              (it == mEntries.end() || (it->second.data.empty() && !it->second.last)))
+        {
+            mCvData.wait(lock);
+            it = mEntries.find(mWriteSeq);
+        }
+
+        if(mAborted || (mFinishing && mWriteSeq == mEndSeq))
+            break;
+
+        Chunks& chunks = it->second;
+        if(!chunks.data.empty())
+        {
+            std::string data = std::move(chunks.data.front());
+            chunks.data.pop_front();
+            mBufferSize -= data.size();
+            lock.unlock();
+            mCvRoom.notify_all();
+
+            bool res = Write(data);
+
+            lock.lock();
+            if(!res)
+            {
+                mAborted = true;
+                mCvRoom.notify_all();
+                break;
+            }
+        }
+        else
+        {
+            // Done with this entry, go to the next one.
+            // Note: Its producer is no longer limited by the buffer size.
+            mEntries.erase(it);
+            mWriteSeq++;
+            mCvRoom.notify_all();
+        }
+    }
+}
+
+bool TarStream::Write(const std::string& data)
+{
+    const char* ptr = data.data();
+    size_t rem = data.size();
+
+    while(rem > 0)
+    {
+        ssize_t wrote = write(mFd, ptr, rem);
+        if(wrote < 0)
+        {
+            if(errno == EINTR || errno == EAGAIN)
+                continue;
+
+            std::unique_lock<std::mutex> lock(mMutex);
+            if(mErrMsg.empty())
+                mErrMsg = std::string("Failed to write tar stream because of: ") + strerror(errno);
+            return false;
+        }
+
+        rem -= wrote;
+        ptr += wrote;
+    }
+
+    return true;
+}
+
+off_t TarStream::GetDataSize(const Entry& entry)
+{
+    if(entry.type != '0')
+        return 0; // No data
+
+    if(entry.sparseMap.empty())
+        return entry.size;
+
+    // Sparse map (padded to the block size) followed by the data segments
+    std::string map = std::to_string(entry.sparseMap.size()) + "\n";
+    off_t size = 0;
+    for(const auto& [offset, length] : entry.sparseMap)
+    {
+        map += std::to_string(offset) + "\n" + std::to_string(length) + "\n";
+        size += length;
+    }
+
+    return ((map.size() + blockSize - 1) / blockSize) * blockSize + size;
+}
+
+std::string TarStream::MakeHeader(const Entry& entry)
+{
+    std::string name = entry.name;
+    if(entry.type == '5' && name.back() != '/')
+        name += '/';
+
+    off_t dataSize = GetDataSize(entry);
+    static constexpr off_t maxOctalSize = 077777777777; // 11 octal digits
+    static constexpr uid_t maxOctalId = 07777777;       // 7 octal digits
+
+    // Extended (pax) records for what doesn't fit into the ustar header
+    std::string records;
+    if(name.size() > 100)
+        AddPaxRecord(records, "path", name);
+    if(dataSize > maxOctalSize)
+        AddPaxRecord(records, "size", std::to_string(dataSize));
+    if(entry.uid > maxOctalId)
+        AddPaxRecord(records, "uid", std::to_string(entry.uid));
+    if(entry.gid > maxOctalId)
+        AddPaxRecord(records, "gid", std::to_string(entry.gid));
+
+    std::string ustarName = name;
+    std::string map;
+    if(!entry.sparseMap.empty())
+    {
+        // GNU sparse format 1.0: the real name and size go to pax records,
+        // and the sparse map goes at the beginning of the entry data
+        AddPaxRecord(records, "GNU.sparse.major", "1");
+        AddPaxRecord(records, "GNU.sparse.minor", "0");
+        AddPaxRecord(records, "GNU.sparse.name", name);
+        AddPaxRecord(records, "GNU.sparse.realsize", std::to_string(entry.size));
+
+        size_t slash = name.rfind('/');
+        ustarName = (slash == std::string::npos ? "" : name.substr(0, slash + 1)) + "GNUSparseFile.0/" +
+                    (slash == std::string::npos ? name : name.substr(slash + 1));
+
+        map = std::to_string(entry.sparseMap.size()) + "\n";
+        for(const auto& [offset, length] : entry.sparseMap)
+            map += std::to_string(offset) + "\n" + std::to_string(length) + "\n";
+        map.resize(((map.size() + blockSize - 1) / blockSize) * blockSize, '\0');
+    }
+
+    std::string header;
+    if(!records.empty())
+    {
+        header = MakeUstarHeader("PaxHeaders.0/" + ustarName.substr(ustarName.size() > 87 ? ustarName.size() - 87 : 0),
+                                 'x', 0644, 0, 0, records.size(), entry.mtime);
+        records.resize(((records.size() + blockSize - 1) / blockSize) * blockSize, '\0');
+        header += records;
+    }
+
+    header += MakeUstarHeader(ustarName, entry.type, entry.mode,
+                              (entry.uid > maxOctalId ? 0 : entry.uid), (entry.gid > maxOctalId ? 0 : entry.gid),
+                              (dataSize > maxOctalSize ? 0 : dataSize), entry.mtime);
+    header += map;
+    return header;
+}
+
+std::string TarStream::MakeUstarHeader(const std::string& name, char type, mode_t mode, uid_t uid, gid_t gid,
+                                       off_t size, time_t mtime)
+{
+    std::string header(blockSize, '\0');
+    char* buf = header.data();
+
+    // Note: Long names are in the pax "path" record, so just truncate here
+    memcpy(buf, name.c_str(), std::min(name.size(), (size_t)100));          // name
+    snprintf(buf + 100, 8, "%07o", (unsigned)(mode & 07777));               // mode
+    snprintf(buf + 108, 8, "%07o", (unsigned)(uid & 07777777));             // uid
+    snprintf(buf + 116, 8, "%07o", (unsigned)(gid & 07777777));             // gid
+    snprintf(buf + 124, 12, "%011llo", (unsigned long long)size);           // size
+    snprintf(buf + 136, 12, "%011llo", (unsigned long long)(mtime > 0 ? mtime : 0) & 077777777777); // mtime
+    memset(buf + 148, ' ', 8);                                              // chksum (spaces for now)
+    buf[156] = type;                                                        // typeflag
+    memcpy(buf + 257, "ustar", 6);                                          // magic
+    memcpy(buf + 263, "00", 2);                                             // version
+
+    unsigned sum = 0;
+    for(size_t i = 0; i < blockSize; i++)
+        sum += (unsigned char)buf[i];
+    snprintf(buf + 148, 8, "%06o", sum);
+    buf[155] = ' ';
+
+    return header;
+}
+
+void TarStream::AddPaxRecord(std::string& records, const std::string& key, const std::string& value)
+{
+    // Record is "<length> <key>=<value>\n" where length includes itself
+    size_t size = key.size() + value.size() + 3; // ' ', '=' and '\n'
+    size_t length = size + std::to_string(size).size();
+    if(std::to_string(length).size() != std::to_string(size).size())
+        length++;
+
+    records += std::to_string(length) + " " + key + "=" + value + "\n";
+}
+
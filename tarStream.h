@@ -0,0 +1,101 @@
+//
+// tarStream.h
+//
+#ifndef __TAR_STREAM_H__
+#define __TAR_STREAM_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <sys/types.h>
+
+//
+// Class TarStream to write a single ordered POSIX tar (pax) stream to a file
+// descriptor (i.e. pipe) from many threads. Every entry gets a sequence number
+// in the order entries must appear in the archive. Producers push entry data
+// in any order across entries, and the writer thread writes entries in
+// sequence order. Data of entries that are not written yet is kept in the
+// reorder buffer up to maxBufferSize bytes. Once the buffer is full, producers
+// of later entries wait, except for the producer of the entry being written.
+// Note: Entries must be started (i.e. posted to FIFO thread pool) in
+// sequence order for the producer of the entry being written to be running.
+//
+class TarStream
+{
+public:
+    TarStream(int fd, size_t maxBufferSize=64*1024*1024) : mFd(fd), mMaxBufferSize(maxBufferSize) {}
+    ~TarStream() { Abort(); }
+
+    // Entry header info
+    struct Entry
+    {
+        std::string name;           // Path in the archive
+        char type{'0'};             // '0' - regular file, '5' - directory
+        mode_t mode{0};
+        uid_t uid{0};
+        gid_t gid{0};
+        off_t size{0};              // File size
+        time_t mtime{0};
+
+        // Sparse file data segments (offset, size). If not empty, only those
+        // are stored in the archive (GNU pax sparse format 1.0)
+        std::vector<std::pair<off_t, off_t>> sparseMap;
+    };
+
+    bool Start();
+    unsigned long NextSeq() { return mNextSeq++; } // Must be called in archive order
+
+    // Push entry header, data and the end of entry (padding).
+    // Return false if the stream is aborted.
+    bool PushHeader(unsigned long seq, const Entry& entry);
+    bool PushData(unsigned long seq, std::string&& data);
+    bool PushEnd(unsigned long seq, off_t dataSize);
+
+    // Wait for all entries to be written and write the end of archive
+    bool Finish();
+    void Abort(const std::string& err="");
+    const std::string& GetError() { return mErrMsg; }
+
+    // Size of data stored in the archive for the entry
+    static off_t GetDataSize(const Entry& entry);
+
+private:
+    bool Push(unsigned long seq, std::string&& data, bool last);
+    void Run();
+    bool Write(const std::string& data);
+
+    static std::string MakeHeader(const Entry& entry);
+    static std::string MakeUstarHeader(const std::string& name, char type, mode_t mode, uid_t uid, gid_t gid,
+                                       off_t size, time_t mtime);
+    static void AddPaxRecord(std::string& records, const std::string& key, const std::string& value);
+
+    static constexpr size_t blockSize = 512;
+
+    struct Chunks
+    {
+        std::deque<std::string> data;
+        bool last{false};       // Got all the entry data
+    };
+
+    int mFd{-1};
+    size_t mMaxBufferSize{0};
+    unsigned long mNextSeq{0};  // Next entry to start (producers)
+    unsigned long mWriteSeq{0}; // Entry being written (writer)
+    unsigned long mEndSeq{0};   // Entries count (known once finishing)
+    bool mFinishing{false};
+    bool mAborted{false};
+    std::map<unsigned long, Chunks> mEntries;
+    size_t mBufferSize{0};
+    std::mutex mMutex;
+    std::condition_variable mCvData;    // Writer waits for data
+    std::condition_variable mCvRoom;    // Producers wait for room
+    std::thread mThread;
+    std::string mErrMsg;
+};
+
+#endif // __TAR_STREAM_H__
+
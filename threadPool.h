@@ -9,7 +9,11 @@
 #include <condition_variable>   // std::condition_variable
 #include <functional>           // std::function
 #include <list>                 // std::list
+#include <map>                  // std::map
+#include <vector>               // std::vector
 #include <assert.h>             // assert()
+#include <limits.h>             // ULONG_MAX
+#include "cpuAffinity.h"        // CpuAffinity
 
 //
 // Class ThreadPool to manager a pool of working threads
@@ -22,9 +26,55 @@ public:
 
     void Create(int threadCount);
 
+    // Run pool threads on the given CPUs only (nullptr - any CPU) and
+    // allocate their memory on the NUMA node (-1 - any node).
+    // Note: It applies to the threads started by the next Create().
+    void SetPlacement(const cpu_set_t* cpus, int memNode=-1);
+
     // Post function to be executed by ThreadPool along with function args
     template<class FUNC, class... ARGS>
-    void Post(FUNC&& func, ARGS&&... args);
+    void Post(FUNC&& func, ARGS&&... args) { PostToJob(0, 0, std::forward<FUNC>(func), std::forward<ARGS>(args)...); }
+
+    // Post function to the given queue. Requests of the same queue are
+    // processed in FIFO order, and pool threads take turns between queues
+    // (round robin), so a slow queue cannot hold up the others.
+    template<class FUNC, class... ARGS>
+    void PostToQueue(unsigned long queueId, FUNC&& func, ARGS&&... args)
+    {
+        PostToJob(0, queueId, std::forward<FUNC>(func), std::forward<ARGS>(args)...);
+    }
+
+    // Limit the number of threads processing the queue requests
+    // at the same time (0 - no limit)
+    void SetQueueLimit(unsigned long queueId, int limit) { SetJobQueueLimit(0, queueId, limit); }
+
+    //
+    // Jobs let many users share the same pool threads. Requests of a higher
+    // priority job are always picked up first. Jobs of the same priority share
+    // threads in proportion to their weights (weighted fair queuing).
+    // Note: Job 0 is the default job used by Post() and PostToQueue().
+    //
+    unsigned long AddJob(int priority=0, int weight=1);
+    void RemoveJob(unsigned long jobId); // Only once the job is done (see WaitJob)
+
+    template<class FUNC, class... ARGS>
+    void PostToJob(unsigned long jobId, unsigned long queueId, FUNC&& func, ARGS&&... args);
+    void SetJobQueueLimit(unsigned long jobId, unsigned long queueId, int limit);
+
+    // Wait for all the job requests to be processed (or dropped by StopJob).
+    // Note: It must not be called by any of pool threads.
+    void WaitJob(unsigned long jobId);
+
+    // Wait for the job queued requests (not being processed yet) to drop
+    // to maxQueued, to keep a producer from running too far ahead of pool
+    // threads. It returns at once if the job is stopped.
+    // Note: It must not be called by any of pool threads.
+    void WaitJobQueued(unsigned long jobId, unsigned long maxQueued);
+
+    // Drop all pending job requests and ignore the new ones. Requests being
+    // processed are not interrupted. It can be called by any thread.
+    void StopJob(unsigned long jobId);
+    bool IsJobStopped(unsigned long jobId);
 
     // Wait() will wait of all pool threads either done processing or stopped.
     // Note: It must not be called by any of pool threads since a thread cannot
@@ -40,15 +90,54 @@ public:
     // It can be called by any thread, including pool threads.
     void Stop();
 
+    // Check if pool threads are forced to stop (to let long running
+    // requests exit early)
+    bool IsStopped();
+
+    // Limit the number of threads processing requests to activeCount
+    // (1...threadCount). The rest of pool threads stay idle until resumed.
+    void SetActiveCount(int activeCount);
+    int GetActiveCount();
+
 private:
+    struct Queue
+    {
+        std::list<std::function<void()>> reqList;
+        int limit{0};           // Max requests processed at the same time (0 - no limit)
+        int running{0};         // Requests being processed
+    };
+
+    struct Job
+    {
+        int priority{0};
+        int weight{1};
+        double vtime{0};                    // Requests served divided by weight
+        std::map<unsigned long, Queue> queues;
+        unsigned long lastQueueId{0};       // Queue of the last popped request
+        unsigned long queuedCount{0};       // Requests in all queues
+        unsigned long reqCount{0};          // Requests queued or being processed
+        unsigned long queuedWaitMax{ULONG_MAX}; // Queued count WaitJobQueued() waits for
+        bool stop{false};
+    };
+
     void JoinThreads();
+    bool PopRequest(std::function<void()>& func, Job*& job, Queue*& queue);
+    Queue* FindQueue(Job& job);
 
     int mThreadCount{0};
+    int mActiveCount{0};
+    cpu_set_t mCpus{};
+    bool mHasCpus{false};
+    int mMemNode{-1};
     std::vector<std::thread> mThreads;
     std::mutex mMutex;
     std::condition_variable mCv;
     std::condition_variable mCvDone;
-    std::list<std::function<void()>> mReqList;
+    std::condition_variable mCvJobDone;
+    std::condition_variable mCvJobQueued;
+    std::map<unsigned long, Job> mJobs;
+    unsigned long mNextJobId{1};
+    unsigned long mQueuedCount{0};      // Requests in all jobs queues
     bool mStop{false};
     unsigned long mStoppedCount{0};
     unsigned long mReqCount{0};
@@ -58,16 +147,33 @@ private:
 //
 // Class ThreadPool implementation
 //
+inline void ThreadPool::SetPlacement(const cpu_set_t* cpus, int memNode)
+{
+    assert(mThreads.empty());
+    mHasCpus = (cpus != nullptr);
+    if(cpus)
+        mCpus = *cpus;
+    mMemNode = memNode;
+}
+
 inline void ThreadPool::Create(int threadCount)
 {
     assert(mThreads.empty());
+    mThreadCount = threadCount;
+    mActiveCount = threadCount;
     mThreads.resize(threadCount);
 
-    for(auto& thread : mThreads)
+    for(int index = 0; index < threadCount; index++)
     {
-        thread = std::thread([&]()
+        mThreads[index] = std::thread([&, index]()
         {
+            if(mHasCpus || mMemNode >= 0)
+                CpuAffinity::SetThreadPlacement(mHasCpus ? &mCpus : nullptr, mMemNode);
+
             bool isProcessing = false;
+            Job* job = nullptr;
+            Queue* queue = nullptr;
+            std::function<void()> func;
 
             while(true)
             {
@@ -76,31 +182,39 @@ inline void ThreadPool::Create(int threadCount)
                 // If we were processing before, then update request count.
                 // Make "Done" notification once all requests are processed
                 // to unblock Wait()
-                if(isProcessing && --mReqCount == 0 && !mHasMore)
-                    mCvDone.notify_one();
-
-                // Wait for a "New Request" notification
+                if(isProcessing)
+                {
+                    // If the queue was at its limit, then let other thread
+                    // pick up the queue request we were holding back.
+                    // Note: We may pick up a request of another job (or be
+                    // no longer active), so don't count on ourselves.
+                    if(--queue->running == queue->limit - 1 && !queue->reqList.empty())
+                        mCv.notify_one();
+
+                    if(--job->reqCount == 0)
+                        mCvJobDone.notify_all();
+
+                    if(--mReqCount == 0 && !mHasMore)
+                        mCvDone.notify_one();
+                }
+
+                // Wait for a "New Request" notification.
+                // Note: Threads above active count are idle until resumed
                 isProcessing = false;
-                while(mReqList.empty() && !mStop)
+                while(!mStop && (index >= mActiveCount || !PopRequest(func, job, queue)))
                     mCv.wait(lock);
 
                 // Do we have to stop?
                 if(mStop)
                     break;
 
-                if(mReqList.empty())
-                    continue; // We shouldn't be here, but just in case
-
-                // Pop the front element
-                auto func = mReqList.front();
-                mReqList.pop_front();
-
                 // Release the lock to let other threads go
                 lock.unlock();
 
                 // Process the request
                 isProcessing = true;
                 func();
+                func = nullptr; // Release request arguments
             }
 
             // If we are stopping, then update stopped threads count.
@@ -116,18 +230,221 @@ inline void ThreadPool::Create(int threadCount)
 }
 
 template<class FUNC, class... ARGS>
-inline void ThreadPool::Post(FUNC&& func, ARGS&&... args)
+inline void ThreadPool::PostToJob(unsigned long jobId, unsigned long queueId, FUNC&& func, ARGS&&... args)
 {
     // Add request to the list for a next available thread to pick up
+    bool hasIdle = false;
     {
         std::unique_lock<std::mutex> lock(mMutex);
         if(mStop)
             return;
+
+        Job& job = mJobs[jobId];
+        if(job.stop)
+            return;
+
+        // If the job was idle, then don't let it catch up on the time it
+        // wasn't using threads: start it from the least served active job
+        if(job.reqCount == 0)
+        {
+            double minVtime = -1;
+            for(const auto& [id, other] : mJobs)
+            {
+                if(other.reqCount > 0 && other.priority == job.priority && (minVtime < 0 || other.vtime < minVtime))
+                    minVtime = other.vtime;
+            }
+            if(minVtime > job.vtime)
+                job.vtime = minVtime;
+        }
+
         mReqCount++;
+        mQueuedCount++;
+        job.reqCount++;
+        job.queuedCount++;
         mHasMore = true;
-        mReqList.emplace_back(std::bind(std::forward<FUNC>(func), std::forward<ARGS>(args)...));
+        job.queues[queueId].reqList.emplace_back(std::bind(std::forward<FUNC>(func), std::forward<ARGS>(args)...));
+        hasIdle = (mActiveCount < mThreadCount);
+    }
+
+    // Note: If some threads are idle (above active count), then notify_one()
+    // could wake up one of them instead of an active thread
+    if(hasIdle)
+        mCv.notify_all();
+    else
+        mCv.notify_one();
+}
+
+inline void ThreadPool::SetJobQueueLimit(unsigned long jobId, unsigned long queueId, int limit)
+{
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mJobs[jobId].queues[queueId].limit = limit;
+    }
+
+    // Wake up threads in case the limit went up
+    mCv.notify_all();
+}
+
+inline unsigned long ThreadPool::AddJob(int priority /*=0*/, int weight /*=1*/)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    unsigned long jobId = mNextJobId++;
+    Job& job = mJobs[jobId];
+    job.priority = priority;
+    job.weight = (weight > 0 ? weight : 1);
+    return jobId;
+}
+
+inline void ThreadPool::RemoveJob(unsigned long jobId)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    auto it = mJobs.find(jobId);
+    if(it == mJobs.end())
+        return;
+
+    // Threads refer to the job while processing its requests
+    assert(it->second.reqCount == 0);
+    mJobs.erase(it);
+}
+
+inline void ThreadPool::WaitJob(unsigned long jobId)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    // We use loop to handle spurious wakeups
+    while(true)
+    {
+        auto it = mJobs.find(jobId);
+        if(it == mJobs.end() || it->second.reqCount == 0)
+            break;
+        mCvJobDone.wait(lock);
     }
-    mCv.notify_one();
+}
+
+inline void ThreadPool::WaitJobQueued(unsigned long jobId, unsigned long maxQueued)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    // We use loop to handle spurious wakeups
+    while(true)
+    {
+        auto it = mJobs.find(jobId);
+        if(mStop || it == mJobs.end() || it->second.stop || it->second.queuedCount <= maxQueued)
+        {
+            if(it != mJobs.end())
+                it->second.queuedWaitMax = ULONG_MAX;
+            break;
+        }
+        it->second.queuedWaitMax = maxQueued;
+        mCvJobQueued.wait(lock);
+    }
+}
+
+inline void ThreadPool::StopJob(unsigned long jobId)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    auto it = mJobs.find(jobId);
+    if(it == mJobs.end())
+        return;
+
+    Job& job = it->second;
+    job.stop = true;
+
+    // Drop all pending requests
+    for(auto& [queueId, queue] : job.queues)
+        queue.reqList.clear();
+
+    mQueuedCount -= job.queuedCount;
+    mReqCount -= job.queuedCount;
+    job.reqCount -= job.queuedCount;
+    job.queuedCount = 0;
+
+    if(job.reqCount == 0)
+        mCvJobDone.notify_all();
+    if(mReqCount == 0 && !mHasMore)
+        mCvDone.notify_one();
+    mCvJobQueued.notify_all();
+}
+
+inline bool ThreadPool::IsJobStopped(unsigned long jobId)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    auto it = mJobs.find(jobId);
+    return (it == mJobs.end() || it->second.stop);
+}
+
+// Find the next job queue in round robin order, skipping queues
+// already processing as many requests as their limit.
+// Note: It must be called with mMutex locked
+inline ThreadPool::Queue* ThreadPool::FindQueue(Job& job)
+{
+    if(job.queuedCount == 0)
+        return nullptr;
+
+    auto it = job.queues.upper_bound(job.lastQueueId);
+    for(size_t n = 0; n < job.queues.size(); n++, ++it)
+    {
+        if(it == job.queues.end())
+            it = job.queues.begin();
+
+        Queue& q = it->second;
+        if(q.reqList.empty() || (q.limit > 0 && q.running >= q.limit))
+            continue;
+
+        job.lastQueueId = it->first;
+        return &q;
+    }
+
+    return nullptr; // All queues with requests are at their limit
+}
+
+// Pop the next request of the highest priority job, or the least served
+// (by weight) job among jobs of the same priority.
+// Note: It must be called with mMutex locked
+inline bool ThreadPool::PopRequest(std::function<void()>& func, Job*& job, Queue*& queue)
+{
+    if(mQueuedCount == 0)
+        return false;
+
+    Job* bestJob = nullptr;
+    Queue* bestQueue = nullptr;
+    unsigned long bestLastQueueId = 0;
+
+    for(auto& [jobId, j] : mJobs)
+    {
+        if(bestJob && (j.priority < bestJob->priority ||
+                      (j.priority == bestJob->priority && j.vtime >= bestJob->vtime)))
+            continue; // Not better than what we have
+
+        unsigned long lastQueueId = j.lastQueueId;
+        Queue* q = FindQueue(j);
+        if(!q)
+            continue;
+
+        // Restore round robin position of the job we are not taking after all
+        if(bestJob)
+            bestJob->lastQueueId = bestLastQueueId;
+
+        bestJob = &j;
+        bestQueue = q;
+        bestLastQueueId = lastQueueId;
+    }
+
+    if(!bestJob)
+        return false; // All queues with requests are at their limit
+
+    // Pop the front element
+    func = std::move(bestQueue->reqList.front());
+    bestQueue->reqList.pop_front();
+    bestQueue->running++;
+    if(--bestJob->queuedCount == bestJob->queuedWaitMax)
+        mCvJobQueued.notify_all();
+    bestJob->vtime += 1.0 / bestJob->weight;
+    mQueuedCount--;
+
+    job = bestJob;
+    queue = bestQueue;
+    return true;
 }
 
 // Wait() will wait of all pool threads either done processing or stopped.
@@ -190,6 +507,36 @@ inline void ThreadPool::Stop()
     mStop = true;
     lock.unlock();
     mCv.notify_all();
+    mCvJobQueued.notify_all();
+}
+
+inline bool ThreadPool::IsStopped()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mStop;
+}
+
+inline void ThreadPool::SetActiveCount(int activeCount)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if(activeCount < 1)
+        activeCount = 1;
+    else if(activeCount > mThreadCount)
+        activeCount = mThreadCount;
+
+    bool resume = (activeCount > mActiveCount);
+    mActiveCount = activeCount;
+    lock.unlock();
+
+    // Wake up resumed threads (if we have requests for them)
+    if(resume)
+        mCv.notify_all();
+}
+
+inline int ThreadPool::GetActiveCount()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mActiveCount;
 }
 
 inline void ThreadPool::JoinThreads()
@@ -200,7 +547,8 @@ inline void ThreadPool::JoinThreads()
 
     // Cleanup after all threads are stopped
     mThreads.clear();
-    mReqList.clear();
+    mJobs.clear();
+    mQueuedCount = 0;
     mStop = false;
     mStoppedCount = 0;
     mReqCount = 0;
@@ -0,0 +1,132 @@
+//
+// tokenBucket.h
+//
+#ifndef __TOKEN_BUCKET_H__
+#define __TOKEN_BUCKET_H__
+
+#include <mutex>                // std::mutex
+#include <condition_variable>   // std::condition_variable
+#include <chrono>               // std::chrono
+#include <algorithm>            // std::min
+
+//
+// Class TokenBucket to limit the rate of operations (bytes, files, etc.)
+// shared by many threads. The bucket is refilled at the given rate up to one
+// second worth of tokens. The rate can be changed at any time, including
+// while other threads wait for tokens.
+//
+class TokenBucket
+{
+public:
+    TokenBucket() = default;
+    ~TokenBucket() = default;
+
+    // Set tokens rate per second (0 - no limit)
+    void SetRate(double rate);
+    double GetRate();
+
+    // Take count tokens, wait until they are available if we have to.
+    // Returns time (in seconds) spent waiting.
+    // Note: Requests larger than the bucket are let through once the bucket
+    // is full, leaving it in debt for the next requests.
+    double Consume(double count);
+
+    // Let waiting (and future) requests through without taking tokens until
+    // resumed, keeping the rate (i.e. to cancel the operations)
+    void Cancel();
+    void Resume();
+
+private:
+    void Refill(std::chrono::steady_clock::time_point now);
+
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    double mRate{0};
+    double mTokens{0};
+    bool mCancelled{false};
+    std::chrono::steady_clock::time_point mLastRefill{std::chrono::steady_clock::now()};
+};
+
+//
+// Class TokenBucket implementation
+//
+inline void TokenBucket::SetRate(double rate)
+{
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        auto now = std::chrono::steady_clock::now();
+        Refill(now);
+
+        // Start the new rate with a full bucket if we weren't limited before
+        if(mRate <= 0)
+            mTokens = rate;
+
+        mRate = (rate > 0 ? rate : 0);
+        mTokens = std::min(mTokens, mRate);
+    }
+
+    // Let waiting threads re-evaluate with the new rate
+    mCv.notify_all();
+}
+
+inline double TokenBucket::GetRate()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mRate;
+}
+
+inline double TokenBucket::Consume(double count)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if(mRate <= 0 || mCancelled)
+        return 0; // No limit
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    // We use loop to handle spurious wakeups and rate changes
+    while(mRate > 0 && !mCancelled)
+    {
+        Refill(std::chrono::steady_clock::now());
+
+        double needed = std::min(count, mRate); // No more than a full bucket
+        if(mTokens >= needed)
+        {
+            mTokens -= count;
+            break;
+        }
+
+        double waitSec = (needed - mTokens) / mRate;
+        mCv.wait_for(lock, std::chrono::duration<double>(waitSec));
+    }
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+inline void TokenBucket::Cancel()
+{
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCancelled = true;
+    }
+
+    mCv.notify_all();
+}
+
+inline void TokenBucket::Resume()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mCancelled = false;
+}
+
+// Note: It must be called with mMutex locked
+inline void TokenBucket::Refill(std::chrono::steady_clock::time_point now)
+{
+    double elapsedSec = std::chrono::duration<double>(now - mLastRefill).count();
+    mLastRefill = now;
+
+    if(mRate > 0)
+        mTokens = std::min(mTokens + elapsedSec * mRate, mRate);
+}
+
+#endif // __TOKEN_BUCKET_H__
+
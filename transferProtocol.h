@@ -0,0 +1,244 @@
+//
+// transferProtocol.h
+//
+#ifndef __TRANSFER_PROTOCOL_H__
+#define __TRANSFER_PROTOCOL_H__
+
+#include <string>
+#include <stdint.h>             // uint32_t, uint64_t
+#include <string.h>             // strerror(), memcpy()
+#include <unistd.h>             // read(), write(), close()
+#include <endian.h>             // htobe32(), be32toh()
+#include <netdb.h>              // getaddrinfo()
+#include <sys/socket.h>         // socket(), connect(), bind(), sendmsg()
+#include <sys/un.h>             // struct sockaddr_un
+#include <sys/uio.h>            // struct iovec
+
+//
+// Sender/receiver (host-to-host copy) protocol and socket helpers.
+//
+// Every message is a 9 bytes header (type, file id and payload size, all in
+// network byte order) followed by the payload. Many files are multiplexed on
+// the same connection (by file id), but all messages of a file go through the
+// same connection, so they arrive in order. Holes are never sent: a file is
+// a sequence of data messages with their offsets, and its end message has
+// the final file size.
+//
+// Sender                                  Receiver
+//   Hello   "dircpy <version>"
+//   Dir     <relative path>               Make directory
+//   Open    <relative path>               Create/truncate file
+//   Data    <offset:8> <data>             Write data at offset
+//   End     <size:8>                      Set file size (trailing hole), close
+//   Done                                  Wait for all connection files...
+//                                   <--   Status <failed files:4> <error>
+//
+// Addresses are "host:port" (TCP) or "unix:<path>" (Unix socket).
+//
+class TransferProtocol
+{
+public:
+    enum class MsgType : uint8_t
+    {
+        Hello = 1,
+        Dir,
+        Open,
+        Data,
+        End,
+        Done,
+        Status
+    };
+
+    static constexpr size_t headerSize = 9;
+    static constexpr uint32_t maxPayloadSize = 16 * 1024 * 1024;
+    static constexpr const char* helloText = "dircpy 1";
+
+    struct Header
+    {
+        MsgType type{MsgType::Hello};
+        uint32_t id{0};         // File id (0 - not a file message)
+        uint32_t size{0};       // Payload size
+    };
+
+    static void PackHeader(char* buf, MsgType type, uint32_t id, uint32_t size)
+    {
+        uint32_t beId = htobe32(id);
+        uint32_t beSize = htobe32(size);
+        buf[0] = (char)type;
+        memcpy(buf + 1, &beId, 4);
+        memcpy(buf + 5, &beSize, 4);
+    }
+
+    static Header UnpackHeader(const char* buf)
+    {
+        Header header;
+        uint32_t beId, beSize;
+        memcpy(&beId, buf + 1, 4);
+        memcpy(&beSize, buf + 5, 4);
+        header.type = (MsgType)buf[0];
+        header.id = be32toh(beId);
+        header.size = be32toh(beSize);
+        return header;
+    }
+
+    static void PackUint64(char* buf, uint64_t value)
+    {
+        value = htobe64(value);
+        memcpy(buf, &value, 8);
+    }
+
+    static uint64_t UnpackUint64(const char* buf)
+    {
+        uint64_t value;
+        memcpy(&value, buf, 8);
+        return be64toh(value);
+    }
+
+    // Write/read exactly size bytes. Return false on error (or end of stream).
+    static bool WriteAll(int fd, struct iovec* iov, int iovCount)
+    {
+        while(iovCount > 0)
+        {
+            // Note: Peer that is gone is an error, not SIGPIPE
+            struct msghdr msg {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovCount;
+            ssize_t wrote = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if(wrote < 0)
+            {
+                if(errno == EINTR || errno == EAGAIN)
+                    continue;
+                return false;
+            }
+
+            // Skip what we have written
+            while(iovCount > 0 && (size_t)wrote >= iov->iov_len)
+            {
+                wrote -= iov->iov_len;
+                iov++;
+                iovCount--;
+            }
+            if(iovCount > 0)
+            {
+                iov->iov_base = (char*)iov->iov_base + wrote;
+                iov->iov_len -= wrote;
+            }
+        }
+        return true;
+    }
+
+    static bool ReadAll(int fd, void* buf, size_t size)
+    {
+        char* ptr = (char*)buf;
+        while(size > 0)
+        {
+            ssize_t got = read(fd, ptr, size);
+            if(got < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            if(got <= 0)
+                return false;
+            ptr += got;
+            size -= got;
+        }
+        return true;
+    }
+
+    // Open connected (or listening) socket for the address
+    static int Connect(const std::string& address, std::string& errMsg) { return Open(address, false, errMsg); }
+    static int Listen(const std::string& address, std::string& errMsg) { return Open(address, true, errMsg); }
+
+private:
+    static int Open(const std::string& address, bool listening, std::string& errMsg)
+    {
+        // Unix socket?
+        if(address.compare(0, 5, "unix:") == 0)
+        {
+            struct sockaddr_un addr {};
+            addr.sun_family = AF_UNIX;
+            std::string path = address.substr(5);
+            if(path.empty() || path.size() >= sizeof(addr.sun_path))
+            {
+                errMsg = "Invalid unix socket path '" + path + "'";
+                return -1;
+            }
+            memcpy(addr.sun_path, path.c_str(), path.size());
+
+            int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if(fd < 0)
+            {
+                errMsg = std::string("Failed to create socket because of: ") + strerror(errno);
+                return -1;
+            }
+
+            if(listening)
+                unlink(path.c_str()); // Left from the previous run
+
+            int res = (listening ? bind(fd, (struct sockaddr*)&addr, sizeof(addr)) :
+                                   connect(fd, (struct sockaddr*)&addr, sizeof(addr)));
+            if(res != 0 || (listening && listen(fd, SOMAXCONN) != 0))
+            {
+                errMsg = std::string("Failed to ") + (listening ? "listen on '" : "connect to '") +
+                         address + "' because of: " + strerror(errno);
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        // TCP "host:port" (empty or "*" host to listen on all addresses)
+        size_t colon = address.rfind(':');
+        if(colon == std::string::npos)
+        {
+            errMsg = "Invalid address '" + address + "' (expected host:port or unix:path)";
+            return -1;
+        }
+        std::string host = address.substr(0, colon);
+        std::string port = address.substr(colon + 1);
+        if(host.size() > 1 && host.front() == '[' && host.back() == ']')
+            host = host.substr(1, host.size() - 2); // IPv6
+        if(host == "*")
+            host.clear();
+
+        struct addrinfo hints {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = (listening ? AI_PASSIVE : 0);
+
+        struct addrinfo* addrs = nullptr;
+        int res = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addrs);
+        if(res != 0)
+        {
+            errMsg = "Failed to resolve '" + address + "' because of: " + gai_strerror(res);
+            return -1;
+        }
+
+        int fd = -1;
+        errMsg.clear();
+        for(struct addrinfo* ai = addrs; ai && fd < 0; ai = ai->ai_next)
+        {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if(fd < 0)
+                continue;
+
+            int on = 1;
+            if(listening)
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+            res = (listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) : connect(fd, ai->ai_addr, ai->ai_addrlen));
+            if(res != 0 || (listening && listen(fd, SOMAXCONN) != 0))
+            {
+                errMsg = std::string("Failed to ") + (listening ? "listen on '" : "connect to '") +
+                         address + "' because of: " + strerror(errno);
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addrs);
+
+        if(fd < 0 && errMsg.empty())
+            errMsg = "Failed to create socket for '" + address + "' because of: " + strerror(errno);
+        return fd;
+    }
+};
+
+#endif // __TRANSFER_PROTOCOL_H__